@@ -0,0 +1,403 @@
+-- Micro benchmarks for the individual operations of the VM and the runtime.
+--
+-- Each benchmark is a loop that does one kind of operation N times. We time
+-- it with os.clock, subtract the time of an empty loop, and print the time
+-- per operation in nanoseconds. Each benchmark runs a few times and we keep
+-- the fastest, because the slower runs are only noise.
+--
+-- The results are only meaningful to compare the same operation across the
+-- interpreter and the compilers (see scripts/bench-micro.lua).
+
+local benchs = {}
+
+local function bench(name, fn)
+    benchs[#benchs+1] = { name = name, fn = fn }
+end
+
+local function empty_loop(n)
+    local x = 0
+    for i = 1, n do
+        x = i
+    end
+    return x
+end
+
+--
+-- Arithmetic and comparisons
+--
+
+bench("arith_int", function(n)
+    local x = 0
+    for i = 1, n do
+        x = x + i
+    end
+    return x
+end)
+
+bench("arith_float", function(n)
+    local x = 0.0
+    for i = 1, n do
+        x = x * 0.5 + 1.0
+    end
+    return x
+end)
+
+bench("arith_mixed", function(n)
+    local x = 0.0
+    for i = 1, n do
+        x = x + i
+    end
+    return x
+end)
+
+bench("compare_lt", function(n)
+    local c = 0
+    local m = n // 2
+    for i = 1, n do
+        if i < m then c = c + 1 end
+    end
+    return c
+end)
+
+--
+-- Variables
+--
+
+local upvalue = 0
+
+bench("upvalue_get_set", function(n)
+    for i = 1, n do
+        upvalue = i
+    end
+    return upvalue
+end)
+
+bench("global_get", function(n)
+    local x
+    for _ = 1, n do
+        x = print
+    end
+    return x
+end)
+
+--
+-- Tables, by key type
+--
+
+bench("table_get_int", function(n)
+    local t = { 10, 20, 30, 40, 50, 60, 70, 80 }
+    local x = 0
+    for i = 1, n do
+        x = t[(i & 7) + 1]
+    end
+    return x
+end)
+
+bench("table_set_int", function(n)
+    local t = { 10, 20, 30, 40, 50, 60, 70, 80 }
+    for i = 1, n do
+        t[(i & 7) + 1] = i
+    end
+    return t
+end)
+
+bench("table_get_field", function(n)
+    local t = { x = 1, y = 2, z = 3 }
+    local x = 0
+    for _ = 1, n do
+        x = t.y
+    end
+    return x
+end)
+
+bench("table_set_field", function(n)
+    local t = { x = 1, y = 2, z = 3 }
+    for i = 1, n do
+        t.y = i
+    end
+    return t
+end)
+
+bench("table_get_string", function(n)
+    local t = { x = 1, y = 2, z = 3 }
+    local keys = { "x", "y", "z", "x" }
+    local x = 0
+    for i = 1, n do
+        x = t[keys[(i & 3) + 1]]
+    end
+    return x
+end)
+
+bench("table_set_string", function(n)
+    local t = { x = 1, y = 2, z = 3 }
+    local keys = { "x", "y", "z", "x" }
+    for i = 1, n do
+        t[keys[(i & 3) + 1]] = i
+    end
+    return t
+end)
+
+bench("table_get_float", function(n)
+    local t = { [0.5] = 1, [1.5] = 2, [2.5] = 3, [3.5] = 4 }
+    local x = 0
+    for i = 1, n do
+        x = t[(i & 3) + 0.5]
+    end
+    return x
+end)
+
+bench("table_get_object", function(n)
+    local k1, k2 = {}, {}
+    local t = { [k1] = 1, [k2] = 2 }
+    local x = 0
+    for _ = 1, n do
+        x = t[k1]
+    end
+    return x
+end)
+
+bench("table_get_missing", function(n)
+    local t = { x = 1, y = 2, z = 3 }
+    local x
+    for _ = 1, n do
+        x = t.w
+    end
+    return x
+end)
+
+bench("table_get_index_mt", function(n)
+    local t = setmetatable({}, { __index = { y = 2 } })
+    local x = 0
+    for _ = 1, n do
+        x = t.y
+    end
+    return x
+end)
+
+bench("table_length", function(n)
+    local t = { 10, 20, 30, 40, 50, 60, 70, 80 }
+    local x = 0
+    for _ = 1, n do
+        x = #t
+    end
+    return x
+end)
+
+--
+-- Calls, by arity
+--
+
+local function f0() return 0 end
+local function f1(a) return a end
+local function f3(a, b, c) return c end
+local function f8(a, b, c, d, e, f, g, h) return h end
+local function fv(...) return (...) end
+
+bench("call_0", function(n)
+    local x
+    for _ = 1, n do
+        x = f0()
+    end
+    return x
+end)
+
+bench("call_1", function(n)
+    local x
+    for i = 1, n do
+        x = f1(i)
+    end
+    return x
+end)
+
+bench("call_3", function(n)
+    local x
+    for i = 1, n do
+        x = f3(i, i, i)
+    end
+    return x
+end)
+
+bench("call_8", function(n)
+    local x
+    for i = 1, n do
+        x = f8(i, i, i, i, i, i, i, i)
+    end
+    return x
+end)
+
+bench("call_vararg", function(n)
+    local x
+    for i = 1, n do
+        x = fv(i, i, i)
+    end
+    return x
+end)
+
+bench("call_method", function(n)
+    local obj = { get = function(self) return self end }
+    local x
+    for _ = 1, n do
+        x = obj:get()
+    end
+    return x
+end)
+
+bench("call_c", function(n)
+    local abs = math.abs
+    local x
+    for i = 1, n do
+        x = abs(i)
+    end
+    return x
+end)
+
+bench("call_pcall", function(n)
+    local x
+    for _ = 1, n do
+        x = pcall(f0)
+    end
+    return x
+end)
+
+--
+-- Closures
+--
+
+bench("closure_new", function(n)
+    local f
+    for _ = 1, n do
+        f = function() return 0 end
+    end
+    return f
+end)
+
+bench("closure_new_upvalue", function(n)
+    local f
+    for i = 1, n do
+        f = function() return i end
+    end
+    return f
+end)
+
+--
+-- Strings
+--
+
+bench("string_intern", function(n)
+    local s = "abcdefghijklmnopqrstuvwxyz"
+    local sub = string.sub
+    local x
+    for i = 1, n do
+        local j = (i & 15) + 1
+        x = sub(s, j, j + 5)
+    end
+    return x
+end)
+
+bench("string_tostring", function(n)
+    local x
+    for i = 1, n do
+        x = tostring(i & 1023)
+    end
+    return x
+end)
+
+bench("concat_2", function(n)
+    local a, b = "hello", "world"
+    local x
+    for _ = 1, n do
+        x = a .. b
+    end
+    return x
+end)
+
+bench("concat_4", function(n)
+    local a, b = "hello", "world"
+    local x
+    for _ = 1, n do
+        x = a .. " " .. b .. "!"
+    end
+    return x
+end)
+
+bench("concat_number", function(n)
+    local a = "item"
+    local x
+    for i = 1, n do
+        x = a .. (i & 1023)
+    end
+    return x
+end)
+
+bench("concat_long", function(n)
+    local a = string.rep("x", 100)
+    local x
+    for _ = 1, n do
+        x = a .. a
+    end
+    return x
+end)
+
+--
+-- Allocation and garbage collection
+--
+
+bench("alloc_table_empty", function(n)
+    local t
+    for _ = 1, n do
+        t = {}
+    end
+    return t
+end)
+
+bench("alloc_table_array", function(n)
+    local t
+    for i = 1, n do
+        t = { i, i, i, i }
+    end
+    return t
+end)
+
+bench("alloc_table_record", function(n)
+    local t
+    for i = 1, n do
+        t = { x = i, y = i, z = i }
+    end
+    return t
+end)
+
+bench("alloc_table_grow", function(n)
+    local t
+    for i = 1, n do
+        if i & 15 == 1 then t = {} end
+        t[#t + 1] = i
+    end
+    return t
+end)
+
+--
+-- Driver
+--
+
+local clock = os.clock
+
+local function measure(fn, n)
+    local best = math.huge
+    for _ = 1, 3 do
+        collectgarbage()
+        local t0 = clock()
+        fn(n)
+        local t1 = clock()
+        best = math.min(best, t1 - t0)
+    end
+    return best
+end
+
+return function(N)
+    N = N or 1000000
+    local base = measure(empty_loop, N)
+    for _, b in ipairs(benchs) do
+        local t = measure(b.fn, N)
+        print(string.format("%-20s %8.2f", b.name, math.max(0, t - base) * 1e9 / N))
+    end
+end
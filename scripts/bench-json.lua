@@ -0,0 +1,219 @@
+-- A minimal JSON encoder and decoder, for the benchmark scripts.
+-- Objects are Lua tables with string keys, and arrays are sequences.
+-- The keys of the objects are written in alphabetical order, so that the
+-- output is stable, and null is decoded as nil.
+
+local json = {}
+
+--
+-- Encoder
+--
+
+local escapes = {
+    ['"'] = '\\"', ['\\'] = '\\\\', ['\b'] = '\\b', ['\f'] = '\\f',
+    ['\n'] = '\\n', ['\r'] = '\\r', ['\t'] = '\\t',
+}
+
+local function encode_string(s)
+    return '"' .. string.gsub(s, '[%c"\\]', function(c)
+        return escapes[c] or string.format("\\u%04x", string.byte(c))
+    end) .. '"'
+end
+
+local function is_array(t)
+    local n = 0
+    for _ in pairs(t) do n = n + 1 end
+    return n == #t and (n > 0 or getmetatable(t) == json.array_mt)
+end
+
+local function encode(v, indent, out)
+    local tv = type(v)
+    if tv == "nil" then
+        out[#out+1] = "null"
+    elseif tv == "boolean" then
+        out[#out+1] = tostring(v)
+    elseif tv == "number" then
+        if v ~= v or v == math.huge or v == -math.huge then
+            error("cannot encode " .. tostring(v) .. " in JSON")
+        elseif math.type(v) == "integer" then
+            out[#out+1] = string.format("%d", v)
+        else
+            -- The shortest representation that reads back as the same number
+            local s = string.format("%.15g", v)
+            if tonumber(s) ~= v then s = string.format("%.17g", v) end
+            out[#out+1] = s
+        end
+    elseif tv == "string" then
+        out[#out+1] = encode_string(v)
+    elseif tv == "table" then
+        local inner = indent .. "  "
+        if is_array(v) then
+            -- Arrays of numbers are short enough to fit in one line
+            local flat = true
+            for _, x in ipairs(v) do
+                if type(x) == "table" then flat = false; break end
+            end
+            out[#out+1] = "["
+            for i, x in ipairs(v) do
+                if i > 1 then out[#out+1] = "," end
+                if flat then
+                    if i > 1 then out[#out+1] = " " end
+                else
+                    out[#out+1] = "\n" .. inner
+                end
+                encode(x, inner, out)
+            end
+            if not flat and #v > 0 then out[#out+1] = "\n" .. indent end
+            out[#out+1] = "]"
+        else
+            local keys = {}
+            for key in pairs(v) do
+                if type(key) ~= "string" then
+                    error("cannot encode a table with non-string keys in JSON")
+                end
+                keys[#keys+1] = key
+            end
+            table.sort(keys)
+            out[#out+1] = "{"
+            for i, key in ipairs(keys) do
+                if i > 1 then out[#out+1] = "," end
+                out[#out+1] = "\n" .. inner .. encode_string(key) .. ": "
+                encode(v[key], inner, out)
+            end
+            if #keys > 0 then out[#out+1] = "\n" .. indent end
+            out[#out+1] = "}"
+        end
+    else
+        error("cannot encode a " .. tv .. " in JSON")
+    end
+end
+
+-- Tables with this metatable are encoded as arrays even if they are empty.
+json.array_mt = {}
+
+function json.array(t)
+    return setmetatable(t or {}, json.array_mt)
+end
+
+function json.encode(v)
+    local out = {}
+    encode(v, "", out)
+    return table.concat(out)
+end
+
+--
+-- Decoder
+--
+
+local function decode_error(s, pos, msg)
+    local line = 1
+    for _ in string.gmatch(string.sub(s, 1, pos - 1), "\n") do line = line + 1 end
+    error(string.format("JSON line %d: %s", line, msg), 0)
+end
+
+local function skip_space(s, pos)
+    return (string.find(s, "[^ \t\r\n]", pos)) or #s + 1
+end
+
+local decode_value
+
+local function decode_string(s, pos)
+    local buf = {}
+    pos = pos + 1   -- skip the opening quote
+    while true do
+        local a, b = string.find(s, '^[^"\\%c]+', pos)
+        if a then
+            buf[#buf+1] = string.sub(s, a, b)
+            pos = b + 1
+        end
+        local c = string.sub(s, pos, pos)
+        if c == '"' then
+            return table.concat(buf), pos + 1
+        elseif c == "\\" then
+            local e = string.sub(s, pos + 1, pos + 1)
+            if e == "u" then
+                local hex = string.match(s, "^%x%x%x%x", pos + 2)
+                if not hex then decode_error(s, pos, "invalid unicode escape") end
+                buf[#buf+1] = utf8.char(tonumber(hex, 16))
+                pos = pos + 6
+            else
+                local r = ({ b = "\b", f = "\f", n = "\n", r = "\r", t = "\t",
+                             ['"'] = '"', ["\\"] = "\\", ["/"] = "/" })[e]
+                if not r then decode_error(s, pos, "invalid escape") end
+                buf[#buf+1] = r
+                pos = pos + 2
+            end
+        else
+            decode_error(s, pos, "unterminated string")
+        end
+    end
+end
+
+local function decode_list(s, pos, close, item)
+    pos = skip_space(s, pos + 1)
+    if string.sub(s, pos, pos) == close then
+        return pos + 1
+    end
+    while true do
+        pos = skip_space(s, item(pos))
+        local c = string.sub(s, pos, pos)
+        if c == close then
+            return pos + 1
+        elseif c ~= "," then
+            decode_error(s, pos, "expected ',' or '" .. close .. "'")
+        end
+        pos = skip_space(s, pos + 1)
+    end
+end
+
+function decode_value(s, pos)
+    pos = skip_space(s, pos)
+    local c = string.sub(s, pos, pos)
+    if c == "{" then
+        local t = {}
+        pos = decode_list(s, pos, "}", function(p)
+            if string.sub(s, p, p) ~= '"' then decode_error(s, p, "expected a key") end
+            local key
+            key, p = decode_string(s, p)
+            p = skip_space(s, p)
+            if string.sub(s, p, p) ~= ":" then decode_error(s, p, "expected ':'") end
+            t[key], p = decode_value(s, p + 1)
+            return p
+        end)
+        return t, pos
+    elseif c == "[" then
+        local t = json.array()
+        pos = decode_list(s, pos, "]", function(p)
+            local v
+            v, p = decode_value(s, p)
+            t[#t+1] = v
+            return p
+        end)
+        return t, pos
+    elseif c == '"' then
+        return decode_string(s, pos)
+    else
+        for word, v in pairs({ ["true"] = true, ["false"] = false, ["null"] = json.null }) do
+            if string.sub(s, pos, pos + #word - 1) == word then
+                if v == json.null then v = nil end
+                return v, pos + #word
+            end
+        end
+        local num = string.match(s, "^-?%d+%.?%d*[eE]?[-+]?%d*", pos)
+        if not num or not tonumber(num) then
+            decode_error(s, pos, "unexpected character")
+        end
+        return tonumber(num), pos + #num
+    end
+end
+
+json.null = {}
+
+function json.decode(s)
+    local v, pos = decode_value(s, 1)
+    pos = skip_space(s, pos)
+    if pos <= #s then decode_error(s, pos, "trailing garbage") end
+    return v
+end
+
+return json
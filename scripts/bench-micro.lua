@@ -0,0 +1,221 @@
+#!/usr/bin/lua
+
+-- Runs the micro benchmarks (experiments/micro.lua) under the interpreter and
+-- both compilers. Run it from the experiments directory:
+--
+--     ../src/lua ../scripts/bench-micro.lua [options]
+--
+-- It prints a table with the nanoseconds per operation of each benchmark, for
+-- each implementation, to stderr, and writes the same numbers as JSON to
+-- stdout (or to --output).
+--
+--   --fast, --medium, --slow  number of operations (default: --medium)
+--   --impl a,b,...            implementations to run (default: lua,aot,trm)
+--   --runs n                  runs of each implementation; we report the
+--                             median of each benchmark (default: 3)
+--   --cpu n                   pin the benchmarks to this CPU, or "none" (default: 0)
+--   --output file             write the JSON here instead of stdout
+
+local script_dir = string.match(arg[0], "^(.*/)") or "./"
+local json = dofile(script_dir .. "bench-json.lua")
+
+local sizes = { fast = 1000, medium = 1000000, slow = 10000000 }
+
+local nkey = "medium"
+local opts = {
+    impl   = "lua,aot,trm",
+    runs   = 3,
+    cpu    = "0",
+    output = false,
+}
+do
+    local i = 1
+    while i <= #arg do
+        local a = arg[i]
+        if     a == "--fast"   then nkey = "fast"
+        elseif a == "--medium" then nkey = "medium"
+        elseif a == "--slow"   then nkey = "slow"
+        else
+            local key = string.match(a, "^%-%-(%a+)$")
+            if key == nil or opts[key] == nil or arg[i+1] == nil then
+                io.stderr:write("bench-micro: invalid option " .. a .. "\n")
+                os.exit(2)
+            end
+            opts[key] = arg[i+1]
+            i = i + 1
+        end
+        i = i + 1
+    end
+    opts.runs = math.tointeger(tonumber(opts.runs)) or error("bench-micro: --runs expects an integer")
+end
+
+local impls = {
+    { name = "lua", suffix = "",     compile = false                     },
+    { name = "aot", suffix = "_aot", compile = "../src/luaot"            },
+    { name = "trm", suffix = "_trm", compile = "../src/luaot-trampoline" },
+}
+
+do
+    local by_name = {}
+    for _, impl in ipairs(impls) do by_name[impl.name] = impl end
+    local selected = {}
+    for name in string.gmatch(opts.impl, "[^,]+") do
+        selected[#selected+1] = by_name[name] or error("bench-micro: unknown implementation " .. name)
+    end
+    impls = selected
+end
+
+--
+-- Shell
+--
+
+local function quote(s)
+    if string.find(s, '^[A-Za-z0-9_./]*$') then
+        return s
+    else
+        return "'" .. s:gsub("'", "'\\''") .. "'"
+    end
+end
+
+local function prepare(cmd_fmt, ...)
+    local params = table.pack(...)
+    return (string.gsub(cmd_fmt, '([%%][%%]?)(%d*)', function(s, i)
+        if s == "%" then
+            return quote(params[tonumber(i)])
+        else
+            return "%"..i
+        end
+    end))
+end
+
+local function run(cmd_fmt, ...)
+    return (os.execute(prepare(cmd_fmt, ...)))
+end
+
+local function exists(filename)
+    return run("test -f %1", filename)
+end
+
+local function newer(file1, file2)
+    return run("test %1 -nt %2", file1, file2)
+end
+
+--
+-- Recompile
+--
+
+io.stderr:write("Recompiling the compiler...\n")
+assert(run("cd .. && make guess --quiet >&2"))
+io.stderr:write("...done\n")
+
+for _, impl in ipairs(impls) do
+    local mod = "micro" .. impl.suffix
+    if impl.compile and (not exists(mod .. ".so") or
+                         newer(impl.compile, mod .. ".so") or
+                         newer("micro.lua", mod .. ".so")) then
+        assert(run(impl.compile .. " micro.lua -o %1.c", mod))
+        assert(run("../scripts/compile %1.c >&2", mod))
+    end
+end
+
+--
+-- Execute
+--
+
+local pin = false
+if opts.cpu ~= "none" then
+    pin = run("command -v taskset > /dev/null")
+    if not pin then
+        io.stderr:write("warning: taskset not found; the benchmarks will not be pinned to a CPU\n")
+    end
+end
+
+-- Returns the list of benchmark names, in order, and a table from each name
+-- to its time per operation.
+local function run_micro(impl)
+    local cmd = prepare("../src/lua main.lua %1 %2", "micro" .. impl.suffix, sizes[nkey])
+    if pin then
+        cmd = prepare("taskset -c %1 ", opts.cpu) .. cmd
+    end
+    local p = assert(io.popen(cmd))
+    local names, times = {}, {}
+    for line in p:lines() do
+        local name, ns = string.match(line, "^(%S+)%s+([%d.]+)$")
+        if name then
+            names[#names+1] = name
+            times[name] = tonumber(ns)
+        end
+    end
+    if not p:close() then
+        error("bench-micro: command failed: " .. cmd, 0)
+    end
+    return names, times
+end
+
+local function median(xs)
+    table.sort(xs)
+    local n = #xs
+    if n % 2 == 1 then
+        return xs[(n + 1) // 2]
+    else
+        return (xs[n // 2] + xs[n // 2 + 1]) / 2
+    end
+end
+
+local names
+local results = {}  -- results[impl][name] = ns per operation
+for _, impl in ipairs(impls) do
+    io.stderr:write(string.format("RUN micro %s\n", impl.name))
+    local samples = {}
+    for _ = 1, opts.runs do
+        local ns, times = run_micro(impl)
+        names = names or ns
+        for name, t in pairs(times) do
+            samples[name] = samples[name] or {}
+            table.insert(samples[name], t)
+        end
+    end
+    results[impl.name] = {}
+    for name, ts in pairs(samples) do
+        results[impl.name][name] = median(ts)
+    end
+end
+
+--
+-- Report
+--
+
+local header = { string.format("%-20s", "ns/op") }
+for _, impl in ipairs(impls) do
+    header[#header+1] = string.format("%9s", impl.name)
+end
+io.stderr:write(table.concat(header), "\n")
+
+local rows = json.array()
+for _, name in ipairs(names) do
+    local line = { string.format("%-20s", name) }
+    local row = { benchmark = name }
+    for _, impl in ipairs(impls) do
+        local t = results[impl.name][name]
+        line[#line+1] = string.format("%9.2f", t)
+        row[impl.name] = t
+    end
+    io.stderr:write(table.concat(line), "\n")
+    rows[#rows+1] = row
+end
+
+local out = io.stdout
+if opts.output then
+    out = assert(io.open(opts.output, "w"))
+end
+out:write(json.encode({
+    size     = nkey,
+    n        = sizes[nkey],
+    date     = os.date("!%Y-%m-%dT%H:%M:%SZ"),
+    settings = {
+        runs = opts.runs,
+        cpu  = pin and opts.cpu or "none",
+    },
+    results  = rows,
+}), "\n")
+if out ~= io.stdout then out:close() end
@@ -1,15 +1,73 @@
 #!/usr/bin/lua
 
+-- Benchmark harness. Run it from the experiments directory:
+--
+--     ../src/lua ../scripts/bench-run.lua [options]
+--
+-- For each benchmark and implementation, it does a few warmup runs, and then
+-- repeats the benchmark until the 95% confidence interval of the median time
+-- is narrow enough, or until it reaches the maximum number of runs. The
+-- results go to stdout (or to --output) as JSON, and the progress to stderr.
+--
+--   --fast, --medium, --slow  size of the inputs (default: --slow)
+--   --bench a,b,...           benchmarks to run (default: all of them)
+--   --impl a,b,...            implementations to run (default: lua,aot,trm)
+--   --warmup n                runs that are not measured (default: 1)
+--   --min-runs n              minimum number of measured runs (default: 5)
+--   --max-runs n              maximum number of measured runs (default: 30)
+--   --ci x                    stop when the half width of the confidence
+--                             interval is below x times the median (default: 0.02)
+--   --cpu n                   pin the benchmarks to this CPU, or "none" (default: 0)
+--   --output file             write the JSON here instead of stdout
+--   --baseline file           compare with the JSON of an earlier run
+--   --threshold x             a result is a regression if its median is more
+--                             than x times slower than the baseline, and the
+--                             confidence intervals do not overlap (default: 0.05)
+--   --perf                    run "perf stat" once for each benchmark, instead
+--
+-- With --baseline, the exit status is 1 if there was a regression.
+-- The timings need bash, and CPU pinning needs taskset.
+
+local script_dir = string.match(arg[0], "^(.*/)") or "./"
+local json = dofile(script_dir .. "bench-json.lua")
+
 local nkey = "slow"
 local mode = "time"
+local opts = {
+    bench     = false,
+    impl      = "lua,aot,trm",
+    warmup    = 1,
+    min_runs  = 5,
+    max_runs  = 30,
+    ci        = 0.02,
+    cpu       = "0",
+    output    = false,
+    baseline  = false,
+    threshold = 0.05,
+}
 do
+    local numeric = { warmup = true, min_runs = true, max_runs = true, ci = true, threshold = true }
     local i = 1
     while i <= #arg do
-        if     arg[i] == "--fast"   then nkey = "fast"
-        elseif arg[i] == "--medium" then nkey = "medium"
-        elseif arg[i] == "--slow"   then nkey = "slow"
-        elseif arg[i] == "--time"   then mode = "time"
-        elseif arg[i] == "--perf"   then mode = "perf"
+        local a = arg[i]
+        if     a == "--fast"   then nkey = "fast"
+        elseif a == "--medium" then nkey = "medium"
+        elseif a == "--slow"   then nkey = "slow"
+        elseif a == "--time"   then mode = "time"
+        elseif a == "--perf"   then mode = "perf"
+        else
+            local key = string.match(a, "^%-%-([%a-]+)$")
+            key = key and string.gsub(key, "-", "_")
+            if key == nil or opts[key] == nil or arg[i+1] == nil then
+                io.stderr:write("bench-run: invalid option " .. a .. "\n")
+                os.exit(2)
+            end
+            local v = arg[i+1]
+            if numeric[key] then
+                v = tonumber(v) or error("bench-run: " .. a .. " expects a number")
+            end
+            opts[key] = v
+            i = i + 1
         end
         i = i + 1
     end
@@ -19,14 +77,23 @@ end
 -- fast   : runs on a blink of an eye (for testing / debugging)
 -- medium : the aot version takes more than 1 second
 -- slow   : the jit version takes more than 1 second
+--
+-- knucleotide reads the output of fasta for the same N, and revcomp reads it
+-- from stdin. We generate these files with fasta if they are missing.
+-- empty.lua is not here because it is only for measuring the module sizes
+-- (see bench-sizes), and micro.lua has its own script (see bench-micro.lua).
 
 local benchs = {
     { name = "binarytrees",  fast =   5, medium =      16, slow =      16 },
+    { name = "coro",         fast =   1, medium =       1, slow =       1 },
     { name = "fannkuch",     fast =   5, medium =      10, slow =      11 },
     { name = "fasta",        fast = 100, medium = 1000000, slow = 2500000 },
-    { name = "knucleotide",  fast = 100, medium = 1000000, slow = 1000000 },
+    { name = "fib",          fast =  20, medium =      32, slow =      35 },
+    { name = "knucleotide",  fast = 100, medium = 1000000, slow = 1000000, fasta = "file" },
     { name = "mandelbrot",   fast =  20, medium =    2000, slow =    4000 },
+    { name = "manorboy",     fast =  10, medium =      17, slow =      18 },
     { name = "nbody",        fast = 100, medium = 1000000, slow = 5000000 },
+    { name = "revcomp",      fast = 100, medium = 1000000, slow = 2500000, fasta = "stdin" },
     { name = "spectralnorm", fast = 100, medium =    1000, slow =    4000 },
 }
 
@@ -38,6 +105,20 @@ local impls = {
     { name = "trm", suffix = "_trm", interpreter = "../src/lua",    compile = "../src/luaot-trampoline"},
 }
 
+local function choose(list, names, what)
+    if not names then return list end
+    local by_name = {}
+    for _, x in ipairs(list) do by_name[x.name] = x end
+    local selected = {}
+    for name in string.gmatch(names, "[^,]+") do
+        selected[#selected+1] = by_name[name] or error("bench-run: unknown " .. what .. " " .. name)
+    end
+    return selected
+end
+
+benchs = choose(benchs, opts.bench, "benchmark")
+impls  = choose(impls,  opts.impl,  "implementation")
+
 --
 -- Shell
 --
@@ -69,6 +150,10 @@ local function exists(filename)
     return run("test -f %1", filename)
 end
 
+local function newer(file1, file2)
+    return run("test %1 -nt %2", file1, file2)
+end
+
 --
 -- Recompile
 --
@@ -80,18 +165,35 @@ io.stderr:write("...done\n")
 for _, b in ipairs(benchs) do
     for _, s in ipairs(impls) do
         local mod = b.name .. s.suffix
-        if s.compile and not exists(mod .. ".so") then
+        if s.compile and (not exists(mod .. ".so") or
+                          newer(s.compile, mod .. ".so") or
+                          newer(b.name .. ".lua", mod .. ".so")) then
             assert(run(s.compile.." %1.lua -o %2.c", b.name, mod))
-            assert(run("../scripts/compile %2.c",    b.name, mod))
+            assert(run("../scripts/compile %2.c >&2", b.name, mod))
         end
     end
 end
 
+local function fasta_output(n)
+    local filename = "fasta-output-" .. n .. ".txt"
+    if not exists(filename) then
+        io.stderr:write("Generating " .. filename .. "...\n")
+        assert(run("../src/lua main.lua fasta %1 > %2", n, filename))
+    end
+    return filename
+end
+
+for _, b in ipairs(benchs) do
+    if b.fasta then
+        fasta_output(assert(b[nkey]))
+    end
+end
+
 --
 -- Execute
 --
 
-local function bench_cmd(b, impl)
+local function bench_cmd(b, impl, pin)
     local module
     if string.match(impl.interpreter, "luajit") and exists(b.name.."_jit.lua") then
         module = b.name .. "_jit"
@@ -100,34 +202,235 @@ local function bench_cmd(b, impl)
     end
 
     local n = assert(b[nkey])
-    return prepare(impl.interpreter .. " main.lua %1 %2 > /dev/null", module, n)
+    local cmd
+    if b.fasta == "stdin" then
+        cmd = prepare(impl.interpreter .. " main.lua %1 < %2", module, fasta_output(n))
+    else
+        cmd = prepare(impl.interpreter .. " main.lua %1 %2", module, n)
+    end
+    if pin then
+        cmd = prepare("taskset -c %1 ", opts.cpu) .. cmd
+    end
+    return cmd
+end
+
+--
+-- Statistics
+--
+
+local function median(sorted)
+    local n = #sorted
+    if n % 2 == 1 then
+        return sorted[(n + 1) // 2]
+    else
+        return (sorted[n // 2] + sorted[n // 2 + 1]) / 2
+    end
+end
+
+local function sorted_copy(xs)
+    local ys = table.move(xs, 1, #xs, 1, {})
+    table.sort(ys)
+    return ys
+end
+
+-- Median absolute deviation
+local function mad(xs, med)
+    local devs = {}
+    for i, x in ipairs(xs) do devs[i] = math.abs(x - med) end
+    return median(sorted_copy(devs))
+end
+
+-- Distribution-free 95% confidence interval of the median, from the order
+-- statistics of the sample. It is conservative with few samples, where it
+-- degrades to the whole range.
+local function median_ci(sorted)
+    local n = #sorted
+    local w = 1.96 * math.sqrt(n) / 2
+    local lo = math.max(1, math.floor(n / 2 - w + 0.5))
+    local hi = math.min(n, math.floor(1 + n / 2 + w + 0.5))
+    return sorted[lo], sorted[hi]
+end
+
+local function summarize(times)
+    local sorted = sorted_copy(times)
+    local med = median(sorted)
+    local lo, hi = median_ci(sorted)
+    local sum = 0
+    for _, x in ipairs(times) do sum = sum + x end
+    return {
+        median  = med,
+        mad     = mad(times, med),
+        ci_low  = lo,
+        ci_high = hi,
+        mean    = sum / #times,
+        min     = sorted[1],
+        max     = sorted[#sorted],
+    }
+end
+
+--
+-- Timing
+--
+
+-- Runs the command once, and returns its wall clock, user and system times.
+local function measure(cmd)
+    local errfile = os.tmpname()
+    local script = string.format(
+        'TIMEFORMAT="%%3R %%3U %%3S"; time { %s > /dev/null 2> %s; }', cmd, quote(errfile))
+    local p = assert(io.popen(prepare("bash -c %1 2>&1", script)))
+    local out = p:read("a")
+    local ok = p:close()
+    local f = io.open(errfile)
+    local err = f and f:read("a") or ""
+    if f then f:close() end
+    os.remove(errfile)
+    local real, user, sys = string.match(out, "([%d.]+) ([%d.]+) ([%d.]+)%s*$")
+    if not ok or not real then
+        error("bench-run: command failed: " .. cmd .. "\n" .. err .. out, 0)
+    end
+    return tonumber(real), tonumber(user), tonumber(sys)
+end
+
+local function bench_one(b, impl, pin)
+    local cmd = bench_cmd(b, impl, pin)
+    for _ = 1, opts.warmup do
+        measure(cmd)
+    end
+    local real, user, sys = json.array(), json.array(), json.array()
+    local stats
+    repeat
+        local r, u, s = measure(cmd)
+        real[#real+1], user[#user+1], sys[#sys+1] = r, u, s
+        stats = summarize(real)
+        local width = (stats.ci_high - stats.ci_low) / 2
+        local converged = #real >= opts.min_runs and width <= opts.ci * stats.median
+    until converged or #real >= opts.max_runs
+    stats.benchmark      = b.name
+    stats.implementation = impl.name
+    stats.n              = b[nkey]
+    stats.runs           = #real
+    stats.converged      = (stats.ci_high - stats.ci_low) / 2 <= opts.ci * stats.median
+    stats.real           = real
+    stats.user           = user
+    stats.sys            = sys
+    return stats
+end
+
+--
+-- Baseline
+--
+
+local function load_baseline(filename)
+    local f = assert(io.open(filename))
+    local data = json.decode(f:read("a"))
+    f:close()
+    local by_key = {}
+    for _, r in ipairs(data.results) do
+        by_key[r.benchmark .. "/" .. r.implementation] = r
+    end
+    return by_key
+end
+
+-- Returns nil if the baseline has no comparable result.
+local function compare(r, base)
+    if not base or base.n ~= r.n then
+        return nil
+    end
+    local verdict
+    if r.median > base.median * (1 + opts.threshold) and r.ci_low > base.ci_high then
+        verdict = "regression"
+    elseif r.median < base.median * (1 - opts.threshold) and r.ci_high < base.ci_low then
+        verdict = "improvement"
+    else
+        verdict = "same"
+    end
+    return {
+        median  = base.median,
+        ratio   = r.median / base.median,
+        verdict = verdict,
+    }
+end
+
+--
+-- Main
+--
+
+local out = io.stdout
+if opts.output then
+    out = assert(io.open(opts.output, "w"))
 end
 
 if mode == "time" then
 
+    local pin = false
+    if opts.cpu ~= "none" then
+        pin = run("command -v taskset > /dev/null")
+        if not pin then
+            io.stderr:write("warning: taskset not found; the benchmarks will not be pinned to a CPU\n")
+        end
+    end
+
+    local baseline = opts.baseline and load_baseline(opts.baseline)
+    local results = json.array()
+    local regressions = 0
     for _, b in ipairs(benchs) do
         for _, impl in ipairs(impls) do
-            local cmd = bench_cmd(b, impl)
-            for rep = 1, 20 do
-                print(string.format("RUN %s %s %s", b.name, impl.name, rep))
-                assert(run("/usr/bin/time -p sh -c %1 2>&1", cmd))
-                print()
+            io.stderr:write(string.format("RUN %s %s ", b.name, impl.name))
+            local r = bench_one(b, impl, pin)
+            io.stderr:write(string.format("%.3f +- %.3f (%d runs%s)",
+                r.median, r.mad, r.runs, r.converged and "" or ", not converged"))
+            if baseline then
+                r.baseline = compare(r, baseline[b.name .. "/" .. impl.name])
+                if r.baseline then
+                    io.stderr:write(string.format(" %+.1f%% %s",
+                        (r.baseline.ratio - 1) * 100, r.baseline.verdict))
+                    if r.baseline.verdict == "regression" then
+                        regressions = regressions + 1
+                    end
+                else
+                    io.stderr:write(" no baseline")
+                end
             end
+            io.stderr:write("\n")
+            results[#results+1] = r
         end
     end
 
+    out:write(json.encode({
+        size     = nkey,
+        date     = os.date("!%Y-%m-%dT%H:%M:%SZ"),
+        settings = {
+            warmup    = opts.warmup,
+            min_runs  = opts.min_runs,
+            max_runs  = opts.max_runs,
+            ci        = opts.ci,
+            cpu       = pin and opts.cpu or "none",
+            baseline  = opts.baseline or nil,
+            threshold = opts.baseline and opts.threshold or nil,
+        },
+        results  = results,
+    }), "\n")
+    if out ~= io.stdout then out:close() end
+
+    if regressions > 0 then
+        io.stderr:write(string.format("%d regression(s)\n", regressions))
+        os.exit(1)
+    end
+
 elseif mode == "perf" then
 
     for _, b in ipairs(benchs) do
         for _, impl in ipairs(impls) do
             if impl.name == "lua" or impl.name == "cor" then
-                local cmd = bench_cmd(b, impl)
-                --print(string.format("RUN %s %s %s", b.name, impl.name, rep))
-                assert(run("LANG=C perf stat sh -c %1 2>&1", cmd))
-                print()
+                local cmd = bench_cmd(b, impl, false)
+                local p = assert(io.popen(prepare("LANG=C perf stat sh -c %1 2>&1 > /dev/null", cmd)))
+                out:write(p:read("a"))
+                assert(p:close())
+                out:write("\n")
             end
         end
     end
+    if out ~= io.stdout then out:close() end
 
 else
     error("impossible")
@@ -1,17 +1,15 @@
 #!/usr/bin/lua
 
-print("Benchmark,Implementation,N,Time")
-while true do
-    local line1 = io.read("*l")
-    if not line1 then break end
-    local line2 = assert(io.read("*l"))
-    local _ = assert(io.read("*l"))
-    local _ = assert(io.read("*l"))
-    local _ = assert(io.read("*l"))
+-- Converts the JSON from bench-run.lua to CSV, with one line per run.
 
-    local name, impl, i = string.match(line1, "RUN (%S+) (%S+) (%S+)")
-    local time          = string.match(line2, "real (%S+)")
+local script_dir = string.match(arg[0], "^(.*/)") or "./"
+local json = dofile(script_dir .. "bench-json.lua")
 
-    print(table.concat({name,impl,i,time}, ","))
-end
+local data = json.decode(io.read("a"))
 
+print("Benchmark,Implementation,N,Time")
+for _, r in ipairs(data.results) do
+    for i, time in ipairs(r.real) do
+        print(table.concat({r.benchmark, r.implementation, i, time}, ","))
+    end
+end
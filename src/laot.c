@@ -0,0 +1,211 @@
+/*
+** $Id: laot.c $
+** Cache of compiled functions, for tiered execution
+** See Copyright Notice in lua.h
+*/
+
+#define laot_c
+#define LUA_CORE
+
+#include "lprefix.h"
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lua.h"
+
+#include "laot.h"
+#include "lstate.h"
+#include "lvm.h"
+
+
+/*
+** The interpreter counts the calls and loop iterations of each function.
+** When a function gets hot, we look for compiled code for it in the
+** directory named by the environment variable LUAOT_CACHE. Each shared
+** library in that directory exports a 'luaot_tier_functions' array, which
+** lists its functions by the hash of their bytecode, and also has their
+** full signature, to check that the function really is the same before
+** we run native code for it. We load all of them
+** the first time, and again when something changes in the directory. The
+** libraries stay loaded until the state is closed.
+*/
+
+#if defined(LUA_USE_DLOPEN)	/* { */
+
+#include <dirent.h>
+#include <dlfcn.h>
+#include <sys/stat.h>
+#include <time.h>
+
+typedef struct AotCache {
+  char *dir;  /* NULL if there is no cache */
+  time_t mtime;  /* of the directory, when we read it */
+  time_t readtime;  /* when we read the directory */
+  LuaotTierEntry *entries;
+  int nentries;
+  char **names;  /* libraries that we already loaded */
+  void **libs;
+  int nlibs;
+} AotCache;
+
+
+static void addentries (AotCache *c, const LuaotTierEntry *e) {
+  int n = 0;
+  LuaotTierEntry *entries;
+  while (e[n].implementation != NULL) n++;
+  entries = (LuaotTierEntry *)realloc(c->entries,
+                                      (c->nentries + n) * sizeof(*entries));
+  if (entries == NULL) return;  /* just ignore this library */
+  memcpy(entries + c->nentries, e, n * sizeof(*entries));
+  c->entries = entries;
+  c->nentries += n;
+}
+
+
+static int isloaded (AotCache *c, const char *name) {
+  int i;
+  for (i = 0; i < c->nlibs; i++) {
+    if (strcmp(c->names[i], name) == 0) return 1;
+  }
+  return 0;
+}
+
+
+static void loadlib (AotCache *c, const char *name) {
+  size_t len = strlen(c->dir) + strlen(name) + 2;
+  char *path = (char *)malloc(len);
+  char *savedname = (char *)malloc(strlen(name) + 1);
+  char **names = (char **)realloc(c->names, (c->nlibs + 1) * sizeof(char *));
+  void **libs;
+  void *lib;
+  if (names != NULL) c->names = names;
+  libs = (void **)realloc(c->libs, (c->nlibs + 1) * sizeof(void *));
+  if (libs != NULL) c->libs = libs;
+  if (path == NULL || savedname == NULL || names == NULL || libs == NULL) {
+    free(path); free(savedname);
+    return;
+  }
+  snprintf(path, len, "%s/%s", c->dir, name);
+  lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  free(path);
+  strcpy(savedname, name);
+  c->names[c->nlibs] = savedname;  /* do not try it again, even if it failed */
+  c->libs[c->nlibs] = lib;
+  c->nlibs++;
+  if (lib != NULL) {
+    const LuaotTierEntry *e =
+      (const LuaotTierEntry *)dlsym(lib, "luaot_tier_functions");
+    if (e != NULL) addentries(c, e);
+  }
+}
+
+
+static void readdirectory (AotCache *c) {
+  struct stat st;
+  DIR *d;
+  struct dirent *ent;
+  if (stat(c->dir, &st) != 0) return;
+  /* a change in the same second as the last read could have been missed */
+  if (c->readtime != 0 && st.st_mtime == c->mtime && st.st_mtime < c->readtime)
+    return;  /* nothing changed */
+  c->mtime = st.st_mtime;
+  c->readtime = time(NULL);
+  d = opendir(c->dir);
+  if (d == NULL) return;
+  while ((ent = readdir(d)) != NULL) {
+    size_t len = strlen(ent->d_name);
+    if (len > 3 && strcmp(ent->d_name + len - 3, ".so") == 0 &&
+        !isloaded(c, ent->d_name))
+      loadlib(c, ent->d_name);
+  }
+  closedir(d);
+}
+
+
+static AotCache *getcache (lua_State *L) {
+  global_State *g = G(L);
+  if (g->aotcache == NULL) {
+    AotCache *c = (AotCache *)calloc(1, sizeof(AotCache));
+    const char *dir = getenv("LUAOT_CACHE");
+    if (c == NULL) return NULL;
+    if (dir != NULL && *dir != '\0') {
+      c->dir = (char *)malloc(strlen(dir) + 1);
+      if (c->dir != NULL) strcpy(c->dir, dir);
+    }
+    g->aotcache = c;
+  }
+  return (AotCache *)g->aotcache;
+}
+
+
+/*
+** Whether the signature of 'p' is the one in entry 'e'.
+*/
+static int samesig (const Proto *p, const LuaotTierEntry *e) {
+  size_t size = luaV_codesig(p, NULL, 0);
+  lu_byte *sig;
+  int res;
+  if (size != e->sizesig) return 0;
+  sig = (lu_byte *)malloc(size);
+  if (sig == NULL) return 0;
+  luaV_codesig(p, sig, size);
+  res = (memcmp(sig, e->sig, size) == 0);
+  free(sig);
+  return res;
+}
+
+
+/*
+** Looks for a compiled version of 'p', and installs it. Returns whether
+** it found one.
+*/
+int luaA_tierup (lua_State *L, Proto *p) {
+  AotCache *c = getcache(L);
+  unsigned int hash;
+  int i;
+  if (c == NULL || c->dir == NULL) return 0;
+  readdirectory(c);
+  hash = luaV_codehash(p);
+  for (i = 0; i < c->nentries; i++) {
+    const LuaotTierEntry *e = &c->entries[i];
+    if (e->hash == hash && e->sizecode == p->sizecode && samesig(p, e)) {
+      p->aot_implementation = e->implementation;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+void luaA_freecache (lua_State *L) {
+  AotCache *c = (AotCache *)G(L)->aotcache;
+  int i;
+  if (c == NULL) return;
+  for (i = 0; i < c->nlibs; i++) {
+    if (c->libs[i] != NULL) dlclose(c->libs[i]);
+    free(c->names[i]);
+  }
+  free(c->libs);
+  free(c->names);
+  free(c->entries);
+  free(c->dir);
+  free(c);
+  G(L)->aotcache = NULL;
+}
+
+#else	/* }{ */
+
+int luaA_tierup (lua_State *L, Proto *p) {
+  UNUSED(L); UNUSED(p);
+  return 0;  /* no dynamic libraries, so no cache */
+}
+
+
+void luaA_freecache (lua_State *L) {
+  UNUSED(L);
+}
+
+#endif	/* } */
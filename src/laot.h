@@ -0,0 +1,36 @@
+/*
+** $Id: laot.h $
+** Cache of compiled functions, for tiered execution
+** See Copyright Notice in lua.h
+*/
+
+#ifndef laot_h
+#define laot_h
+
+#include "lobject.h"
+#include "lstate.h"
+
+
+/*
+** How many calls and loop iterations an interpreted function runs before
+** we look for a compiled version of it.
+*/
+#if !defined(LUAOT_TIER_THRESHOLD)
+#define LUAOT_TIER_THRESHOLD	1000
+#endif
+
+
+/* An entry of the 'luaot_tier_functions' array (see 'luaot -t') */
+typedef struct LuaotTierEntry {
+  unsigned int hash;  /* 'luaV_codehash' of the function */
+  int sizecode;
+  AotCompiledFunction implementation;
+  const lu_byte *sig;  /* 'luaV_codesig' of the function */
+  size_t sizesig;
+} LuaotTierEntry;
+
+
+LUAI_FUNC int luaA_tierup (lua_State *L, Proto *p);
+LUAI_FUNC void luaA_freecache (lua_State *L);
+
+#endif
@@ -249,7 +249,8 @@ static int luaB_type (lua_State *L) {
 }
 
 
-static int luaB_next (lua_State *L) {
+/* AOT: not static, so that compiled for loops can recognize it */
+int luaB_next (lua_State *L) {
   luaL_checktype(L, 1, LUA_TTABLE);
   lua_settop(L, 2);  /* create a 2nd argument if there isn't one */
   if (lua_next(L, 1))
@@ -278,8 +279,9 @@ static int luaB_pairs (lua_State *L) {
 
 /*
 ** Traversal function for 'ipairs'
+** (AOT: not static, so that compiled for loops can recognize it)
 */
-static int ipairsaux (lua_State *L) {
+int luaB_ipairsaux (lua_State *L) {
   lua_Integer i = luaL_checkinteger(L, 2) + 1;
   lua_pushinteger(L, i);
   return (lua_geti(L, 1, i) == LUA_TNIL) ? 1 : 2;
@@ -287,12 +289,12 @@ static int ipairsaux (lua_State *L) {
 
 
 /*
-** 'ipairs' function. Returns 'ipairsaux', given "table", 0.
+** 'ipairs' function. Returns 'luaB_ipairsaux', given "table", 0.
 ** (The given "table" may not be a table.)
 */
 static int luaB_ipairs (lua_State *L) {
   luaL_checkany(L, 1);
-  lua_pushcfunction(L, ipairsaux);  /* iteration function */
+  lua_pushcfunction(L, luaB_ipairsaux);  /* iteration function */
   lua_pushvalue(L, 1);  /* state */
   lua_pushinteger(L, 0);  /* initial value */
   return 3;
@@ -875,3 +875,299 @@ int luaG_traceexec (lua_State *L, const Instruction *pc) {
   return 1;  /* keep 'trap' on */
 }
 
+
+
+/*
+** {======================================================
+** Sampling profiler
+** =======================================================
+*/
+
+/*
+** If the environment variable LUAOT_SAMPLES names a file when a state is
+** created, a SIGPROF timer interrupts the program LUAOT_SAMPLE_RATE times
+** per second of CPU time (default 1000). Each time, the signal handler
+** walks the call stack of the running coroutine, and of the coroutines
+** that resumed it, and counts the stack. Lua frames are "source:line",
+** and C functions are "[C]". The interpreter saves 'savedpc' before each
+** instruction that may need it, but compiled functions only save it at
+** calls and where they may raise an error, so their lines are those of
+** the last such instruction, which is close but not always exact. When
+** the state is closed, the stacks are written to the file in the "folded"
+** format of the flame graph tools, one stack per line, from the root.
+**
+** The handler cannot allocate memory, so everything that it needs is
+** allocated up front, and it copies the name of each function the first
+** time that it sees it ('sampleid' in Proto). It reads the stack and the
+** CallInfo list without any locking. 'luaD_reallocstack' blocks the
+** signal while it moves the stack, because the handler could read the
+** freed one. Calls and returns change 'L->ci' and fill the new frame in
+** several steps, which is too frequent to block, so the handler checks
+** that each frame points inside the stack and may still see a frame that
+** is half built: a sample can be lost or go to the wrong function or
+** line. The values in the stack always point to live objects, so the
+** Protos that it reads and marks are never freed memory.
+*/
+
+#if defined(LUA_USE_POSIX)	/* { */
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#define SAMPLEMAXDEPTH	128	/* frames per stack; deeper ones are cut */
+#define SAMPLEMAXNAMES	4096	/* different functions */
+#define SAMPLEMAXSTACKS	16384	/* different stacks (a power of 2) */
+#define SAMPLEMAXFRAMES	(1 << 20)	/* frames of all the stacks */
+#define SAMPLEMAXTHREADS	64	/* nested coroutines */
+
+#define SAMPLE_C	0	/* name id of C functions */
+#define SAMPLE_OTHER	1	/* name id when there are too many functions */
+
+typedef struct SampleFrame {
+  unsigned int id;  /* name of the function */
+  int line;
+} SampleFrame;
+
+typedef struct SampleStack {
+  unsigned int hash;
+  unsigned int first;  /* index of its first frame in 'frames' */
+  unsigned int depth;
+  unsigned int count;  /* samples; 0 if the entry is free */
+} SampleStack;
+
+typedef struct Sampler {
+  global_State *g;  /* state being sampled */
+  lua_State *threads[SAMPLEMAXTHREADS];  /* running coroutines */
+  volatile int nthreads;
+  char (*names)[LUA_IDSIZE];
+  unsigned int nnames;
+  SampleStack *stacks;
+  SampleFrame *frames;
+  unsigned int nframes;
+  unsigned long lost;  /* samples that did not fit */
+  char *filename;
+  sigset_t savedmask;  /* see 'luaG_sampleblock' */
+} Sampler;
+
+static Sampler sampler;
+
+
+static unsigned int samplename (Proto *p) {
+  char *c;
+  if (p->sampleid == 0) {  /* first time we see this function? */
+    if (sampler.nnames == SAMPLEMAXNAMES)
+      return SAMPLE_OTHER;
+    if (p->source)
+      luaO_chunkid(sampler.names[sampler.nnames], getstr(p->source),
+                   tsslen(p->source));
+    else
+      strcpy(sampler.names[sampler.nnames], "=?");
+    for (c = sampler.names[sampler.nnames]; *c != '\0'; c++) {
+      if (*c == ';')
+        *c = ',';  /* ';' separates the frames */
+    }
+    p->sampleid = sampler.nnames++;
+  }
+  return p->sampleid;
+}
+
+
+/* Frames of a thread, from the top; returns the new number of frames */
+static int sampleframes (lua_State *L, SampleFrame *f, int n) {
+  CallInfo *ci;
+  for (ci = L->ci; ci != &L->base_ci && n < SAMPLEMAXDEPTH;
+       ci = ci->previous) {
+    if (ci == NULL || ci->func < L->stack || ci->func >= L->stack_last)
+      break;  /* not a frame that we can trust */
+    if (isLua(ci) && ttisLclosure(s2v(ci->func))) {
+      Proto *p = clLvalue(s2v(ci->func))->p;
+      int pc = cast_int(ci->u.l.savedpc - p->code) - 1;
+      f[n].id = samplename(p);
+      f[n].line = (0 <= pc && pc < p->sizecode) ? luaG_getfuncline(p, pc)
+                                                : p->linedefined;
+    }
+    else {
+      f[n].id = SAMPLE_C;
+      f[n].line = -1;
+    }
+    n++;
+  }
+  return n;
+}
+
+
+static void samplehandler (int sig) {
+  SampleFrame f[SAMPLEMAXDEPTH];
+  unsigned int hash = 0;
+  unsigned int h;
+  int nthreads = sampler.nthreads;
+  int n = 0;
+  int t, i;
+  (void)sig;
+  if (nthreads > SAMPLEMAXTHREADS) {  /* coroutines nested too deep? */
+    sampler.lost++;
+    return;
+  }
+  for (t = nthreads - 1; t >= 0 && n < SAMPLEMAXDEPTH; t--)
+    n = sampleframes(sampler.threads[t], f, n);
+  if (n == 0)
+    return;  /* not running Lua */
+  for (i = 0; i < n; i++)
+    hash = (hash ^ f[i].id ^ (cast_uint(f[i].line) << 12)) * 16777619u;
+  for (h = hash; ; h++) {  /* find the stack in the hash table */
+    SampleStack *s = &sampler.stacks[h & (SAMPLEMAXSTACKS - 1)];
+    if (s->count == 0) {  /* a new stack */
+      if (h - hash == SAMPLEMAXSTACKS / 2 ||
+          sampler.nframes + n > SAMPLEMAXFRAMES) {
+        sampler.lost++;  /* the table is full enough */
+        return;
+      }
+      s->hash = hash;
+      s->first = sampler.nframes;
+      s->depth = n;
+      memcpy(&sampler.frames[s->first], f, n * sizeof(SampleFrame));
+      sampler.nframes += n;
+      s->count = 1;
+      return;
+    }
+    if (s->hash == hash && s->depth == cast_uint(n) &&
+        memcmp(&sampler.frames[s->first], f, n * sizeof(SampleFrame)) == 0) {
+      s->count++;
+      return;
+    }
+  }
+}
+
+
+void luaG_startsampling (lua_State *L) {
+  const char *filename = getenv("LUAOT_SAMPLES");
+  const char *rate = getenv("LUAOT_SAMPLE_RATE");
+  long hz = (rate != NULL) ? strtol(rate, NULL, 10) : 1000;
+  struct sigaction sa;
+  struct itimerval timer;
+  if (filename == NULL || sampler.g != NULL)
+    return;  /* not asked for, or already sampling another state */
+  if (hz <= 0 || hz > 1000000)
+    hz = 1000;
+  sampler.names = cast(char (*)[LUA_IDSIZE],
+                       calloc(SAMPLEMAXNAMES, LUA_IDSIZE));
+  sampler.stacks = cast(SampleStack *,
+                        calloc(SAMPLEMAXSTACKS, sizeof(SampleStack)));
+  sampler.frames = cast(SampleFrame *,
+                        malloc(SAMPLEMAXFRAMES * sizeof(SampleFrame)));
+  sampler.filename = cast_charp(malloc(strlen(filename) + 1));
+  if (sampler.names == NULL || sampler.stacks == NULL ||
+      sampler.frames == NULL || sampler.filename == NULL) {
+    fprintf(stderr, "luaot samples: not enough memory\n");
+    return;  /* leak the rest; we are in trouble anyway */
+  }
+  strcpy(sampler.filename, filename);
+  strcpy(sampler.names[SAMPLE_C], "[C]");
+  strcpy(sampler.names[SAMPLE_OTHER], "?");
+  sampler.nnames = 2;
+  sampler.g = G(L);
+  sampler.threads[0] = L;
+  sampler.nthreads = 1;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = samplehandler;
+  sa.sa_flags = SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGPROF, &sa, NULL);
+  timer.it_interval.tv_sec = 0;
+  timer.it_interval.tv_usec = (hz == 1) ? 999999 : 1000000 / hz;
+  timer.it_value = timer.it_interval;
+  setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+
+/*
+** Coroutines tell the sampler when they start and stop running. Only
+** 'nthreads' is shared with the handler, so we set the thread first.
+*/
+void luaG_sampleresume (lua_State *L) {
+  if (G(L) == sampler.g) {
+    int n = sampler.nthreads;
+    if (n < SAMPLEMAXTHREADS)
+      sampler.threads[n] = L;
+    sampler.nthreads = n + 1;
+  }
+}
+
+
+void luaG_sampleyield (lua_State *L) {
+  if (G(L) == sampler.g)
+    sampler.nthreads--;
+}
+
+
+/*
+** Blocks (or unblocks) the signal of the sampler, if it is sampling 'L'.
+** Calls cannot be nested.
+*/
+void luaG_sampleblock (lua_State *L, int block) {
+  if (G(L) != sampler.g)
+    return;
+  if (block) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPROF);
+    sigprocmask(SIG_BLOCK, &set, &sampler.savedmask);
+  }
+  else
+    sigprocmask(SIG_SETMASK, &sampler.savedmask, NULL);
+}
+
+
+void luaG_stopsampling (lua_State *L) {
+  struct itimerval timer;
+  FILE *f;
+  unsigned int s;
+  if (G(L) != sampler.g)
+    return;
+  memset(&timer, 0, sizeof(timer));
+  setitimer(ITIMER_PROF, &timer, NULL);
+  signal(SIGPROF, SIG_IGN);
+  sampler.g = NULL;
+  f = fopen(sampler.filename, "w");
+  if (f == NULL)
+    perror("luaot samples");
+  else {
+    for (s = 0; s < SAMPLEMAXSTACKS; s++) {
+      SampleStack *st = &sampler.stacks[s];
+      int i;
+      if (st->count == 0)
+        continue;
+      for (i = st->depth - 1; i >= 0; i--) {  /* from the root */
+        SampleFrame *fr = &sampler.frames[st->first + i];
+        fputs(sampler.names[fr->id], f);
+        if (fr->line >= 0)
+          fprintf(f, ":%d", fr->line);
+        if (i > 0)
+          fputc(';', f);
+      }
+      fprintf(f, " %u\n", st->count);
+    }
+    fclose(f);
+  }
+  if (sampler.lost > 0)
+    fprintf(stderr, "luaot samples: lost %lu samples\n", sampler.lost);
+  free(sampler.names);
+  free(sampler.stacks);
+  free(sampler.frames);
+  free(sampler.filename);
+  memset(&sampler, 0, sizeof(sampler));
+}
+
+#else				/* }{ */
+
+void luaG_startsampling (lua_State *L) { (void)L; }
+void luaG_sampleresume (lua_State *L) { (void)L; }
+void luaG_sampleyield (lua_State *L) { (void)L; }
+void luaG_sampleblock (lua_State *L, int block) { (void)L; (void)block; }
+void luaG_stopsampling (lua_State *L) { (void)L; }
+
+#endif				/* } */
+
+/* }====================================================== */
@@ -58,6 +58,11 @@ LUAI_FUNC const char *luaG_addinfo (lua_State *L, const char *msg,
                                                   TString *src, int line);
 LUAI_FUNC l_noret luaG_errormsg (lua_State *L);
 LUAI_FUNC int luaG_traceexec (lua_State *L, const Instruction *pc);
+LUAI_FUNC void luaG_startsampling (lua_State *L);
+LUAI_FUNC void luaG_sampleresume (lua_State *L);
+LUAI_FUNC void luaG_sampleyield (lua_State *L);
+LUAI_FUNC void luaG_sampleblock (lua_State *L, int block);
+LUAI_FUNC void luaG_stopsampling (lua_State *L);
 
 
 #endif
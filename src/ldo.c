@@ -199,6 +199,7 @@ int luaD_reallocstack (lua_State *L, int newsize, int raiseerror) {
       luaM_error(L);
     else return 0;  /* do not raise an error */
   }
+  luaG_sampleblock(L, 1);  /* AOT: the sampler must not see it moving */
   /* number of elements to be copied to the new stack */
   i = ((oldsize <= newsize) ? oldsize : newsize) + EXTRA_STACK;
   memcpy(newstack, L->stack, i * sizeof(StackValue));
@@ -208,6 +209,7 @@ int luaD_reallocstack (lua_State *L, int newsize, int raiseerror) {
   luaM_freearray(L, L->stack, oldsize + EXTRA_STACK);
   L->stack = newstack;
   L->stack_last = L->stack + newsize;
+  luaG_sampleblock(L, 0);
   return 1;
 }
 
@@ -785,7 +787,9 @@ LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs,
   L->nCcalls = (from) ? getCcalls(from) : 0;
   luai_userstateresume(L, nargs);
   api_checknelems(L, (L->status == LUA_OK) ? nargs + 1 : nargs);
+  luaG_sampleresume(L);
   status = luaD_rawrunprotected(L, resume, &nargs);
+  luaG_sampleyield(L);
    /* continue running after recoverable errors */
   status = precover(L, status);
   if (l_likely(!errorstatus(status)))
@@ -261,6 +261,14 @@ Proto *luaF_newproto (lua_State *L) {
   f->lastlinedefined = 0;
   f->source = NULL;
   f->aot_implementation = NULL;
+  f->aot_counter = 0;
+  f->sampleid = 0;
+#if defined(LUAOT_PROFILE)
+  f->profile = NULL;
+#endif
+#if defined(LUAOT_COUNTERS)
+  f->counters = NULL;
+#endif
   return f;
 }
 
@@ -585,6 +585,137 @@ static int searcher_C (lua_State *L) {
 }
 
 
+/*
+** {======================================================
+** Cache of AOT-compiled modules
+** If the environment variable LUAOT_CACHE names a directory,
+** 'searcher_AOT' loads Lua modules from 'package.path' and looks in
+** that directory for a compiled version of their bytecode, named
+** 'luaot_<hash>.so'. If there is none and LUAOT_BUILD is set, it runs
+** "$LUAOT_BUILD module.lua cache/luaot_<hash>.so" in the background
+** and returns the interpreted module meanwhile. The build must write
+** the library atomically (e.g. with a rename). A file
+** 'luaot_<hash>.build' with the output of the build marks that it has
+** been started, so it is never run twice for the same bytecode.
+** =======================================================
+*/
+
+#if defined(LUA_USE_DLOPEN)
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#define AOT_CACHE_VAR	"LUAOT_CACHE"
+#define AOT_BUILD_VAR	"LUAOT_BUILD"
+
+
+/* FNV-1a over the dumped bytecode */
+static int hashwriter (lua_State *L, const void *p, size_t sz, void *ud) {
+  const unsigned char *b = (const unsigned char *)p;
+  lua_Unsigned *h = (lua_Unsigned *)ud;
+  size_t i;
+  (void)L;
+  for (i = 0; i < sz; i++)
+    *h = (*h ^ b[i]) * 0x100000001b3u;
+  return 0;
+}
+
+
+static void addquoted (luaL_Buffer *b, const char *s) {
+  luaL_addchar(b, '\'');
+  for (; *s; s++) {
+    if (*s == '\'')
+      luaL_addstring(b, "'\\''");
+    else
+      luaL_addchar(b, *s);
+  }
+  luaL_addchar(b, '\'');
+}
+
+
+/*
+** Start the build of 'lua_file' into 'so_file', unless some other
+** process already did. Errors are ignored: the module just keeps
+** being interpreted.
+*/
+static void startbuild (lua_State *L, const char *lua_file,
+                        const char *so_file, const char *build_file) {
+  const char *cmd = getenv(AOT_BUILD_VAR);
+  luaL_Buffer b;
+  int fd;
+  if (cmd == NULL || *cmd == '\0') return;
+  fd = open(build_file, O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd < 0) return;  /* already started (or cannot write in the cache) */
+  close(fd);
+  luaL_buffinit(L, &b);
+  luaL_addstring(&b, "( ");
+  luaL_addstring(&b, cmd);
+  luaL_addchar(&b, ' ');
+  addquoted(&b, lua_file);
+  luaL_addchar(&b, ' ');
+  addquoted(&b, so_file);
+  luaL_addstring(&b, " ) </dev/null >>");
+  addquoted(&b, build_file);
+  luaL_addstring(&b, " 2>&1 &");
+  luaL_pushresult(&b);
+  (void)system(lua_tostring(L, -1));
+  lua_pop(L, 1);
+}
+
+
+static int aotcacheon (void) {
+  const char *dir = getenv(AOT_CACHE_VAR);
+  return (dir != NULL && *dir != '\0');
+}
+
+
+static int searcher_AOT (lua_State *L) {
+  const char *dir = getenv(AOT_CACHE_VAR);
+  const char *name = luaL_checkstring(L, 1);
+  const char *filename;
+  const char *so_file;
+  lua_Unsigned h = 0xcbf29ce484222325u;
+  char base[32];
+  FILE *f;
+  int top;
+  if (dir == NULL || *dir == '\0') return 0;  /* no cache */
+  filename = findfile(L, name, "path", LUA_LSUBSEP);
+  if (filename == NULL) return 0;  /* 'searcher_Lua' will report it */
+  if (luaL_loadfile(L, filename) != LUA_OK)
+    return checkload(L, 0, filename);
+  top = lua_gettop(L);  /* the interpreted chunk */
+  lua_dump(L, hashwriter, &h, 0);
+  snprintf(base, sizeof(base), "luaot_%016llx", (unsigned long long)h);
+  so_file = lua_pushfstring(L, "%s" LUA_DIRSEP "%s.so", dir, base);
+  if ((f = fopen(so_file, "r")) != NULL) {  /* already compiled? */
+    fclose(f);
+    if (lookforfunc(L, so_file, lua_pushfstring(L, LUA_POF"%s", base)) == 0)
+      return checkload(L, 1, filename);  /* return the luaopen function */
+  }
+  else
+    startbuild(L, filename, so_file,
+               lua_pushfstring(L, "%s" LUA_DIRSEP "%s.build", dir, base));
+  lua_settop(L, top);  /* broken library or not built yet: interpret it */
+  return checkload(L, 1, filename);
+}
+
+#else
+
+static int aotcacheon (void) {
+  return 0;  /* no cache without dynamic libraries */
+}
+
+
+static int searcher_AOT (lua_State *L) {
+  (void)L;
+  return 0;  /* no cache without dynamic libraries */
+}
+
+#endif
+
+/* }====================================================== */
+
+
 static int searcher_Croot (lua_State *L) {
   const char *filename;
   const char *name = luaL_checkstring(L, 1);
@@ -710,14 +841,21 @@ static const luaL_Reg ll_funcs[] = {
 static void createsearcherstable (lua_State *L) {
   static const lua_CFunction searchers[] =
     {searcher_preload, searcher_Lua, searcher_C, searcher_Croot, NULL};
-  int i;
+  int i, n = 0;
   /* create 'searchers' table */
-  lua_createtable(L, sizeof(searchers)/sizeof(searchers[0]) - 1, 0);
+  lua_createtable(L, sizeof(searchers)/sizeof(searchers[0]), 0);
   /* fill it with predefined searchers */
   for (i=0; searchers[i] != NULL; i++) {
+    /* AOT: with a cache, compiled modules come before the Lua ones (only
+       then, so that the standard searchers keep their usual indices) */
+    if (searchers[i] == searcher_Lua && aotcacheon()) {
+      lua_pushvalue(L, -2);
+      lua_pushcclosure(L, searcher_AOT, 1);
+      lua_rawseti(L, -2, ++n);
+    }
     lua_pushvalue(L, -2);  /* set 'package' as upvalue for all searchers */
     lua_pushcclosure(L, searchers[i], 1);
-    lua_rawseti(L, -2, i+1);
+    lua_rawseti(L, -2, ++n);
   }
   lua_setfield(L, -2, "searchers");  /* put it in field 'searchers' */
 }
@@ -566,6 +566,14 @@ typedef struct Proto {
   TString  *source;  /* used for debug information */
   GCObject *gclist;
   AotCompiledFunction aot_implementation;
+  unsigned int aot_counter;  /* calls and loop iterations (see laot.c) */
+  unsigned int sampleid;  /* name in the sampling profiler (see ldebug.c) */
+#if defined(LUAOT_PROFILE)
+  void *profile;  /* see lvm.c */
+#endif
+#if defined(LUAOT_COUNTERS)
+  void *counters;  /* see lvm.c */
+#endif
 } Proto;
 
 /* }================================================================== */
@@ -15,6 +15,7 @@
 
 #include "lua.h"
 
+#include "laot.h"
 #include "lapi.h"
 #include "ldebug.h"
 #include "ldo.h"
@@ -26,6 +27,7 @@
 #include "lstring.h"
 #include "ltable.h"
 #include "ltm.h"
+#include "lvm.h"
 
 
 
@@ -276,6 +278,7 @@ static void close_state (lua_State *L) {
     luai_userstateclose(L);
   }
   luaM_freearray(L, G(L)->strt.hash, G(L)->strt.size);
+  luaA_freecache(L);
   freestack(L);
   lua_assert(gettotalbytes(g) == sizeof(LG));
   (*g->frealloc)(g->ud, fromstate(L), sizeof(LG), 0);  /* free main block */
@@ -370,6 +373,7 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->ud = ud;
   g->warnf = NULL;
   g->ud_warn = NULL;
+  g->aotcache = NULL;
   g->mainthread = L;
   g->seed = luai_makeseed(L);
   g->gcrunning = 0;  /* no GC while building state */
@@ -403,6 +407,8 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
     close_state(L);
     L = NULL;
   }
+  else
+    luaG_startsampling(L);  /* if LUAOT_SAMPLES asks for it */
   return L;
 }
 
@@ -410,7 +416,11 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
 LUA_API void lua_close (lua_State *L) {
   lua_lock(L);
   L = G(L)->mainthread;  /* only the main thread can be closed */
+  luaG_stopsampling(L);
   close_state(L);
+#if defined(LUAOT_COUNTERS)
+  luaV_countreport();
+#endif
 }
 
 
@@ -295,6 +295,7 @@ typedef struct global_State {
   TString *strcache[STRCACHE_N][STRCACHE_M];  /* cache for strings in API */
   lua_WarnFunction warnf;  /* warning function */
   void *ud_warn;         /* auxiliary data to 'warnf' */
+  void *aotcache;  /* compiled functions for tiered execution (see laot.c) */
 } global_State;
 
 
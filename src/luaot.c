@@ -8,10 +8,13 @@
 
 #include <ctype.h>
 #include <errno.h>
+#include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "lua.h"
 #include "lauxlib.h"
@@ -22,6 +25,7 @@
 #include "lopnames.h"
 #include "lstate.h"
 #include "lundump.h"
+#include "lvm.h"
 
 //
 // Command-line arguments and main function
@@ -31,25 +35,41 @@
 //
 
 static const char *program_name    = "luaot";
-static char *input_filename  = NULL;
+static char **input_filenames = NULL;
+static int  ninputs          = 0;
 static char *output_filename = NULL;
 static char *module_name     = NULL;
 
 static FILE * output_file = NULL;
 static int nfunctions = 0;
+static int *module_first_function = NULL;  // Id of the main function of each input
 static TString **tmname;
 
 int executable = 0;
+static int embed_bytecode = 0;
+static int strip_debug_info = 0;
+static int emit_proto_data = 0;
+static int nshards = 0;
+static int no_hooks = 0;
+static char *profile_filename = NULL;
+static int tier_table = 0;
 static
 void usage()
 {
     fprintf(stderr,
-          "usage: %s [options] [filename]\n"
+          "usage: %s [options] [filenames]\n"
           "Available options are:\n"
           "  -o name            output to file 'name'\n"
           "  -m name            generate code with `name` function as main function\n"
           "  -s                 use  switches instead of gotos in generated code\n"
-          "  -e                 add a main symbol for executables\n",
+          "  -e                 add a main symbol for executables\n"
+          "  -b                 embed precompiled bytecode instead of the source code\n"
+          "  -S                 strip the debug information (implies -b, unless -p)\n"
+          "  -p                 build the functions from static C data instead of loading them\n"
+          "  -j n               split the functions across n more C files, generated in parallel\n"
+          "  -n                 do not support debug hooks in the compiled functions\n"
+          "  -P file            optimize for the profiles in 'file' (see LUAOT_PROFILE in lvm.c)\n"
+          "  -t                 export the functions for tiered execution (see laot.c)\n",
           program_name);
 }
 
@@ -110,6 +130,25 @@ static void doargs(int argc, char **argv)
                 module_name = argv[i];
             } else if (0 == strcmp(arg, "-e")) {
                 executable = 1;
+            } else if (0 == strcmp(arg, "-b")) {
+                embed_bytecode = 1;
+            } else if (0 == strcmp(arg, "-S")) {
+                strip_debug_info = 1;
+            } else if (0 == strcmp(arg, "-p")) {
+                emit_proto_data = 1;
+            } else if (0 == strcmp(arg, "-n")) {
+                no_hooks = 1;
+            } else if (0 == strcmp(arg, "-j")) {
+                i++;
+                if (i >= argc) { fatal_error("missing argument for -j"); }
+                nshards = atoi(argv[i]);
+                if (nshards < 1) { fatal_error("the argument for -j must be a positive number"); }
+            } else if (0 == strcmp(arg, "-t")) {
+                tier_table = 1;
+            } else if (0 == strcmp(arg, "-P")) {
+                i++;
+                if (i >= argc) { fatal_error("missing argument for -P"); }
+                profile_filename = argv[i];
             } else if (0 == strcmp(arg, "-o")) {
                 i++;
                 if (i >= argc) { fatal_error("missing argument for -o"); }
@@ -119,49 +158,76 @@ static void doargs(int argc, char **argv)
                 exit(1);
             }
         } else {
-            switch (npos) {
-                case 0:
-                    input_filename = arg;
-                    break;
-                default:
-                    fatal_error("too many positional arguments");
-                    break;
-            }
+            input_filenames = realloc(input_filenames, (npos + 1) * sizeof(char *));
+            if (!input_filenames) { fatal_error("out of memory"); }
+            input_filenames[npos] = arg;
             npos++;
         }
     }
 
-    if (output_filename == NULL) {
+    if (output_filename == NULL || npos == 0) {
         usage();
         exit(1);
     }
+    ninputs = npos;
+
+    if (strip_debug_info && !emit_proto_data) {
+        embed_bytecode = 1;
+    }
 }
 
-static char *get_module_name_from_filename(const char *);
+static char *get_module_name_from_filename(const char *, const char *);
 static void check_module_name(const char *);
 static void replace_dots(char *);
-static void print_functions();
-static void print_source_code();
+static void print_functions(Proto **, int);
+static void print_source_code(const char *, int);
+static void print_bytecode(lua_State *L, int, int);
+static void print_proto_data();
+static void print_backend_header();
+static const char *shard_header_name();
+static void read_profiles(const char *);
 
 int main(int argc, char **argv)
 {
     // Process input arguments
 
     doargs(argc, argv);
+    if (profile_filename) {
+        read_profiles(profile_filename);
+    }
 
     if (!module_name) {
-        module_name = get_module_name_from_filename(output_filename);
+        module_name = get_module_name_from_filename(output_filename, ".c");
     }
     check_module_name(module_name);
     replace_dots(module_name);
 
+    // When we compile several files at once, each of them is a separate Lua
+    // module, named after its path. The luaopen function of the output file
+    // adds all of them to package.preload.
+    int bundle = (ninputs > 1);
+    char **input_modules = malloc(ninputs * sizeof(char *));
+    if (!input_modules) { fatal_error("out of memory"); }
+    for (int m = 0; m < ninputs; m++) {
+        if (bundle) {
+            input_modules[m] = get_module_name_from_filename(input_filenames[m], ".lua");
+            check_module_name(input_modules[m]);
+        } else {
+            input_modules[m] = module_name;
+        }
+    }
+
     // Read the input
 
     lua_State *L = luaL_newstate();
-    if (luaL_loadfile(L, input_filename) != LUA_OK) {
-        fatal_error(lua_tostring(L,-1));
+    Proto **protos = malloc(ninputs * sizeof(Proto *));
+    if (!protos) { fatal_error("out of memory"); }
+    for (int m = 0; m < ninputs; m++) {
+        if (luaL_loadfile(L, input_filenames[m]) != LUA_OK) {
+            fatal_error(lua_tostring(L,-1));
+        }
+        protos[m] = getproto(s2v(L->top-1));
     }
-    Proto *proto = getproto(s2v(L->top-1));
     tmname = G(L)->tmname;
 
     // Generate the file
@@ -169,24 +235,63 @@ int main(int argc, char **argv)
     output_file = fopen(output_filename, "w");
     if (output_file == NULL) { fatal_error(strerror(errno)); }
 
-    #if defined(LUAOT_USE_GOTOS)
-    println("#include \"luaot_header.c\"");
-    #elif defined(LUAOT_USE_SWITCHES)
-    println("#include \"trampoline_header.c\"");
-    #endif
-    printnl();
-    print_functions(proto);
-    printnl();
-    print_source_code();
+    if (nshards > 0) {
+        println("#include \"%s\"", shard_header_name());
+    } else {
+        print_backend_header();
+    }
     printnl();
-    println("#define LUAOT_MODULE_NAME \"%s\"", module_name);
-    println("#define LUAOT_LUAOPEN_NAME luaopen_%s", module_name);
+    print_functions(protos, ninputs);
     printnl();
-    #if defined(LUAOT_USE_GOTOS)
-    println("#include \"luaot_footer.c\"");
-    #elif defined(LUAOT_USE_SWITCHES)
-    println("#include \"trampoline_footer.c\"");
-    #endif
+    if (emit_proto_data) {
+        print_proto_data();
+        printnl();
+    }
+    for (int m = 0; m < ninputs; m++) {
+        if (emit_proto_data) {
+            // Already printed
+        } else if (embed_bytecode) {
+            print_bytecode(L, m - ninputs, m);
+            printnl();
+            println("#define LUAOT_MODULE_BYTECODE LUAOT_MODULE_BYTECODE_%d", m);
+        } else {
+            print_source_code(input_filenames[m], m);
+            printnl();
+            println("#define LUAOT_MODULE_SOURCE_CODE LUAOT_MODULE_SOURCE_CODE_%d", m);
+        }
+        println("#define LUAOT_MODULE_NAME \"%s\"", input_modules[m]);
+        println("#define LUAOT_FIRST_FUNCTION %d", module_first_function[m]);
+        if (bundle) {
+            char *open_name = strdup(input_modules[m]);
+            replace_dots(open_name);
+            println("#define LUAOT_LUAOPEN_NAME luaot_open_%s", open_name);
+            println("#define LUAOT_LUAOPEN_STATIC 1");
+            free(open_name);
+        } else {
+            println("#define LUAOT_LUAOPEN_NAME luaopen_%s", module_name);
+        }
+        printnl();
+        #if defined(LUAOT_USE_GOTOS)
+        println("#include \"luaot_footer.c\"");
+        #elif defined(LUAOT_USE_SWITCHES)
+        println("#include \"trampoline_footer.c\"");
+        #endif
+        printnl();
+    }
+    if (bundle) {
+        println("int luaopen_%s(lua_State *L) {", module_name);
+        println("    luaL_getsubtable(L, LUA_REGISTRYINDEX, LUA_PRELOAD_TABLE);");
+        for (int m = 0; m < ninputs; m++) {
+            char *open_name = strdup(input_modules[m]);
+            replace_dots(open_name);
+            println("    lua_pushcfunction(L, luaot_open_%s);", open_name);
+            println("    lua_setfield(L, -2, \"%s\");", input_modules[m]);
+            free(open_name);
+        }
+        println("    lua_pop(L, 1);");
+        println("    return 0;");
+        println("}");
+    }
     if (executable) {
       printnl();
       printnl();
@@ -200,7 +305,17 @@ int main(int argc, char **argv)
       println("   lua_rawseti(L, -2, i);");
       println(" }");
       println(" lua_setglobal(L, \"arg\");");
-      println(" lua_pushcfunction(L, LUAOT_LUAOPEN_NAME);");
+      if (bundle) {
+        // The first file is the main program
+        char *open_name = strdup(input_modules[0]);
+        replace_dots(open_name);
+        println(" luaL_requiref(L, \"%s\", luaopen_%s, 0);", module_name, module_name);
+        println(" lua_pop(L, 1);");
+        println(" lua_pushcfunction(L, luaot_open_%s);", open_name);
+        free(open_name);
+      } else {
+        println(" lua_pushcfunction(L, luaopen_%s);", module_name);
+      }
       println("i = lua_pcall(L, 0, 0, 0);");
       println(" if (i != LUA_OK) {");
       println("   fprintf(stderr, \"%%s\\n\", lua_tostring(L, -1));");
@@ -217,8 +332,11 @@ int main(int argc, char **argv)
 // Deduce the Lua module name given the file name
 // Example:  ./foo/bar/baz.c -> foo.bar.baz
 static
-char *get_module_name_from_filename(const char *filename)
+char *get_module_name_from_filename(const char *filename, const char *ext)
 {
+    while (filename[0] == '.' && filename[1] == '/') {
+        filename += 2;
+    }
     size_t n = strlen(filename);
 
     int has_extension = 0;
@@ -230,8 +348,9 @@ char *get_module_name_from_filename(const char *filename)
         }
     }
 
-    if (!has_extension || 0 != strcmp(filename + sep, ".c")) {
-        fatal_error("output file does not have a \".c\" extension");
+    if (!has_extension || 0 != strcmp(filename + sep, ext)) {
+        fprintf(stderr, "%s: file %s does not have a \"%s\" extension\n", program_name, filename, ext);
+        exit(1);
     }
 
     char *module_name = malloc(sep+1);
@@ -255,7 +374,7 @@ void check_module_name(const char *module_name)
     for (size_t i = 0; module_name[i] != '\0'; i++) {
         int c = module_name[i];
         if (!isalnum(c) && c != '_' && c != '.') {
-            fatal_error("output module name must contain only letters, numbers, or '.'");
+            fatal_error("module names must contain only letters, numbers, or '.'");
         }
     }
 }
@@ -734,76 +853,1796 @@ void luaot_PrintOpcodeComment(Proto *f, int pc)
     print("\n");
 }
 
-#if defined(LUAOT_USE_GOTOS)
-#include "luaot_gotos.c"
-#elif defined(LUAOT_USE_SWITCHES)
-#include "luaot_switches.c"
-#else
-#error "Must define LUAOT_USE_GOTOS or LUAOT_USE_SWITCHES"
-#endif
+//
+// Call targets
+// ------------
+//
+// We try to guess which function is called by each OP_CALL, looking at where
+// the called value came from. If it is a local function of this module that
+// is never reassigned, the generated code calls the C implementation of that
+// function directly. The guess is always checked at run time, because
+// debug.setlocal and debug.setupvalue can change what is in there.
+//
+
+static Proto **all_protos = NULL;  // Indexed by function id
+static Proto **all_parents = NULL;
+static int nprotos = 0;
 
+// This traversal order should be the same one that create_functions uses.
 static
-void create_functions(Proto *p)
+void collect_protos(Proto *f, Proto *parent)
 {
-    // luaot_footer.c should use the same traversal order as this.
-    create_function(p);
-    for (int i = 0; i < p->sizep; i++) {
-        create_functions(p->p[i]);
+    int id = nprotos++;
+    all_protos = realloc(all_protos, nprotos * sizeof(Proto *));
+    all_parents = realloc(all_parents, nprotos * sizeof(Proto *));
+    if (!all_protos || !all_parents) { fatal_error("out of memory"); }
+    all_protos[id] = f;
+    all_parents[id] = parent;
+    for (int i = 0; i < f->sizep; i++) {
+        collect_protos(f->p[i], f);
     }
 }
 
 static
-void print_functions(Proto *p)
+int proto_id(Proto *f)
 {
-    create_functions(p);
+    for (int id = 0; id < nprotos; id++) {
+        if (all_protos[id] == f) return id;
+    }
+    return -1;
+}
 
-    println("static AotCompiledFunction LUAOT_FUNCTIONS[] = {");
-    for (int i = 0; i < nfunctions; i++) {
-        println("  magic_implementation_%02d,", i);
+// Whether the instruction at `pc` may assign to register `r`. Instructions
+// that write a variable number of registers are assumed to write all the
+// registers starting from A.
+static
+int instruction_may_write(Proto *f, int pc, int r)
+{
+    Instruction instr = f->code[pc];
+    OpCode op = GET_OPCODE(instr);
+    int a = GETARG_A(instr);
+    switch (op) {
+        case OP_SETTABUP: case OP_SETTABLE: case OP_SETI: case OP_SETFIELD:
+        case OP_SETUPVAL: case OP_SETLIST:
+        case OP_MMBIN: case OP_MMBINI: case OP_MMBINK:
+        case OP_EQ: case OP_LT: case OP_LE: case OP_EQK:
+        case OP_EQI: case OP_LTI: case OP_LEI: case OP_GTI: case OP_GEI:
+        case OP_TEST: case OP_JMP: case OP_CLOSE: case OP_TBC:
+        case OP_RETURN: case OP_RETURN0: case OP_RETURN1:
+        case OP_TFORPREP: case OP_VARARGPREP: case OP_EXTRAARG:
+            return 0;
+        case OP_SELF:
+            return (r == a || r == a + 1);
+        case OP_LOADNIL:
+            return (a <= r && r <= a + GETARG_B(instr));
+        case OP_CALL: case OP_TAILCALL: case OP_VARARG:
+        case OP_FORPREP: case OP_FORLOOP:
+        case OP_TFORCALL: case OP_TFORLOOP:
+            return (r >= a);
+        default:
+            return (r == a);
     }
-    println("  NULL");
-    println("};");
 }
 
+// The upvalue that the instruction at `pc` accesses, or -1.
 static
-void print_source_code()
+int instruction_upvalue(Proto *f, int pc)
 {
-    // Since the code we are generating is lifted from lvm.c, we need it to use
-    // Lua functions instead of C functions. And to create the Lua functions,
-    // we have to `load` them from source code.
-    //
-    // The most readable approach would be to bundle this Lua source code as a
-    // big C string literal. However, C compilers have limits on how big a
-    // string literal can be, so instead of using a string literal, we use a
-    // plain char array instead.
+    Instruction instr = f->code[pc];
+    switch (GET_OPCODE(instr)) {
+        case OP_GETUPVAL: case OP_SETUPVAL: case OP_GETTABUP:
+            return GETARG_B(instr);
+        case OP_SETTABUP:
+            return GETARG_A(instr);
+        default:
+            return -1;
+    }
+}
 
-    FILE *infile = fopen(input_filename, "r");
-    if (!infile) { fatal_error("could not open input file a second time"); }
+static
+int uses_upvalue(Proto *f, int u)
+{
+    for (int pc = 0; pc < f->sizecode; pc++) {
+        if (instruction_upvalue(f, pc) == u) return 1;
+    }
+    return 0;
+}
 
-    println("static const char LUAOT_MODULE_SOURCE_CODE[] = {");
+// Declares a C variable for each upvalue that the function accesses, and the
+// luaot_loadupvals macro that loads them again. The UpVal objects of a closure
+// only change with debug.upvaluejoin, which can only run in Lua code, so the
+// headers call luaot_loadupvals after anything that can run Lua code. Their
+// value pointers change more often, when the upvalue is closed or when the
+// stack is reallocated, so those are still read at each access.
+static
+void print_upvalue_pointers(Proto *f)
+{
+    for (int u = 0; u < f->sizeupvalues; u++) {
+        if (uses_upvalue(f, u)) {
+            println("  UpVal *upval_%02d = cl->upvals[%d];", u, u);
+        }
+    }
+    println("  #undef  luaot_loadupvals");
+    print("  #define luaot_loadupvals() (");
+    for (int u = 0; u < f->sizeupvalues; u++) {
+        if (uses_upvalue(f, u)) {
+            print("upval_%02d = cl->upvals[%d], ", u, u);
+        }
+    }
+    println("(void)0)");
+}
 
-    int c;
-    int col = 0;
-    do {
-        if (col == 0) {
-            print(" ");
+// Finds the local variable that is stored in register `r` at `pc`.
+static
+int find_local(Proto *f, int r, int pc)
+{
+    int n = 0;
+    for (int i = 0; i < f->sizelocvars; i++) {
+        if (f->locvars[i].startpc > pc) break;
+        if (pc < f->locvars[i].endpc) {
+            if (n == r) return i;
+            n++;
         }
+    }
+    return -1;
+}
 
-        c = fgetc(infile);
-        if (c == EOF) {
-            print(" %3d", 0);
-        } else {
-            print(" %3d", c);
-            print(",");
+static Proto *resolve_upvalue(Proto *f, int idx, int depth);
+
+// The function that register `r` holds right before `pc`, or NULL.
+static
+Proto *resolve_register(Proto *f, int pc, int r, int depth)
+{
+    if (depth > 8) return NULL;
+
+    int var = find_local(f, r, pc);
+    if (var >= 0) {
+        // A local variable. Its initial value should be assigned by the CLOSURE
+        // right before the variable becomes active, and never changed again.
+        LocVar *v = &f->locvars[var];
+        int def = v->startpc - 1;
+        if (!(def >= 0 && GET_OPCODE(f->code[def]) == OP_CLOSURE && GETARG_A(f->code[def]) == r)) {
+            return NULL;
         }
+        for (int q = def + 1; q < v->endpc && q < f->sizecode; q++) {
+            if (instruction_may_write(f, q, r)) return NULL;
+        }
+        return f->p[GETARG_Bx(f->code[def])];
+    }
 
-        col++;
-        if (col == 16 || c == EOF) {
-            print("\n");
-            col = 0;
+    // A temporary. Look at the instruction that last assigned to it.
+    for (int q = pc - 1; q >= 0; q--) {
+        if (!instruction_may_write(f, q, r)) continue;
+        Instruction instr = f->code[q];
+        switch (GET_OPCODE(instr)) {
+            case OP_MOVE:
+                return resolve_register(f, q, GETARG_B(instr), depth + 1);
+            case OP_GETUPVAL:
+                return resolve_upvalue(f, GETARG_B(instr), depth + 1);
+            case OP_CLOSURE:
+                return f->p[GETARG_Bx(instr)];
+            default:
+                return NULL;
         }
-    } while (c != EOF);
-    println("};");
+    }
+    return NULL;
+}
 
-    fclose(infile);
+// The function that upvalue `idx` of `f` holds, or NULL.
+static
+Proto *resolve_upvalue(Proto *f, int idx, int depth)
+{
+    int id = proto_id(f);
+    Proto *parent = (id >= 0 ? all_parents[id] : NULL);
+    if (!parent || depth > 8) return NULL;
+
+    // Find the instruction that created the closure for `f`.
+    for (int pc = 0; pc < parent->sizecode; pc++) {
+        Instruction instr = parent->code[pc];
+        if (GET_OPCODE(instr) == OP_CLOSURE && parent->p[GETARG_Bx(instr)] == f) {
+            Upvaldesc *uv = &f->upvalues[idx];
+            if (uv->instack && uv->idx == GETARG_A(instr)) {
+                // A `local function` that refers to itself. Its variable only
+                // becomes active after the CLOSURE instruction.
+                return resolve_register(parent, pc + 1, uv->idx, depth + 1);
+            } else if (uv->instack) {
+                return resolve_register(parent, pc, uv->idx, depth + 1);
+            } else {
+                return resolve_upvalue(parent, uv->idx, depth + 1);
+            }
+        }
+    }
+    return NULL;
+}
+
+// The function id of the callee of the OP_CALL at `pc`, or -1.
+static
+int call_target(Proto *f, int pc)
+{
+    Instruction instr = f->code[pc];
+    Proto *callee = resolve_register(f, pc, GETARG_A(instr), 0);
+    return (callee ? proto_id(callee) : -1);
+}
+
+// Tests are followed by a jump, which is taken when the condition is not
+// equal to k. The jump itself is never executed as a separate instruction.
+static
+int is_conditional(OpCode op)
+{
+    return ((OP_EQ <= op && op <= OP_GEI) || op == OP_TEST || op == OP_TESTSET);
+}
+
+//
+// Profiles
+// --------
+//
+// With -P, we read the profiles that the interpreter writes when it is
+// compiled with LUAOT_PROFILE (see lvm.c). We find the profile of each
+// function by the hash of its bytecode, so functions that changed since the
+// profile was made are treated as if they had no profile. If the same
+// function appears several times, for example because the file has the
+// results of several runs, we add the counts together.
+//
+
+typedef struct ProfileEntry {
+    unsigned long count;     // Times that the instruction ran
+    unsigned long taken;     // Times that the jump after a test was taken
+    unsigned char types[2];  // Types of the operands (see luaV_profoperands)
+} ProfileEntry;
+
+typedef struct Profile {
+    unsigned int hash;
+    int sizecode;
+    unsigned long calls;
+    ProfileEntry *pcs;
+} Profile;
+
+static Profile *profiles = NULL;
+static int nprofiles = 0;
+static Profile *current_profile = NULL;  // Of the function being compiled
+
+// We only trust the profile of an instruction if it ran this many times.
+#define PROFILE_MIN_COUNT 100
+
+static
+Profile *find_profile(unsigned int hash, int sizecode)
+{
+    for (int j = 0; j < nprofiles; j++) {
+        if (profiles[j].hash == hash && profiles[j].sizecode == sizecode) return &profiles[j];
+    }
+    return NULL;
+}
+
+static
+void read_profiles(const char *filename)
+{
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) { fatal_error(strerror(errno)); }
+
+    char line[512];
+    Profile *prof = NULL;
+    while (fgets(line, sizeof(line), f)) {
+        unsigned int hash;
+        int sizecode, pc, t0, t1;
+        unsigned long calls, count, taken;
+        if (3 == sscanf(line, "function %x %d %lu", &hash, &sizecode, &calls)) {
+            if (sizecode <= 0) { fatal_error("malformed profile"); }
+            prof = find_profile(hash, sizecode);
+            if (prof == NULL) {
+                profiles = realloc(profiles, (nprofiles + 1) * sizeof(Profile));
+                if (!profiles) { fatal_error("out of memory"); }
+                prof = &profiles[nprofiles++];
+                prof->hash = hash;
+                prof->sizecode = sizecode;
+                prof->calls = 0;
+                prof->pcs = calloc(sizecode, sizeof(ProfileEntry));
+                if (!prof->pcs) { fatal_error("out of memory"); }
+            }
+            prof->calls += calls;
+        } else if (5 == sscanf(line, "%d %lu %lu %d %d", &pc, &count, &taken, &t0, &t1)) {
+            if (!prof || pc < 0 || pc >= prof->sizecode) { fatal_error("malformed profile"); }
+            ProfileEntry *e = &prof->pcs[pc];
+            e->count += count;
+            e->taken += taken;
+            e->types[0] |= t0;
+            e->types[1] |= t1;
+        } else {
+            fatal_error("malformed profile");
+        }
+    }
+    fclose(f);
+}
+
+static
+Profile *profile_of(Proto *f)
+{
+    return find_profile(luaV_codehash(f), f->sizecode);
+}
+
+// A function is cold if we have a profile for its module, but the function
+// itself never ran.
+static
+int is_cold_function(Proto *f)
+{
+    if (!profile_filename || profile_of(f)) return 0;
+    Proto *root = f;
+    for (int id = proto_id(f); all_parents[id] != NULL; id = proto_id(root)) {
+        root = all_parents[id];
+    }
+    return (root != f && profile_of(root) != NULL);
+}
+
+// The branch prediction hint for the jump after the test at `pc`, when it is
+// taken. It is "" if we don't know.
+static
+const char *jump_hint(int pc)
+{
+    if (!current_profile) return "";
+    ProfileEntry *e = &current_profile->pcs[pc];
+    if (e->count < PROFILE_MIN_COUNT) return "";
+    if (e->taken <= e->count / 16) return "l_unlikely";
+    if (e->taken >= e->count - e->count / 16) return "l_likely";
+    return "";
+}
+
+// Tests use LUAOT_SKIP_HINT for the condition that skips their jump.
+static
+void print_skip_hint(int pc)
+{
+    const char *hint = jump_hint(pc);
+    if (0 == strcmp(hint, "l_likely")) hint = "l_unlikely";
+    else if (0 == strcmp(hint, "l_unlikely")) hint = "l_likely";
+    println("  #undef  LUAOT_SKIP_HINT");
+    println("  #define LUAOT_SKIP_HINT %s", hint);
+}
+
+// The static analyses are only used by the goto backend, for now.
+#if defined(LUAOT_USE_GOTOS)
+
+//
+// Control flow
+// ------------
+//
+
+// Arithmetic instructions skip the following OP_MMBIN in their fast path.
+static
+int is_arith_with_mmbin(OpCode op)
+{
+    return (OP_ADDI <= op && op <= OP_SHR);
+}
+
+static
+int next_jump_target(Proto *f, int pc)
+{
+    Instruction next = f->code[pc+1];
+    return (pc+2) + GETARG_sJ(next);
+}
+
+// Tests and arithmetic that constant propagation has folded have a single
+// successor, or -1. See fold_constants.
+static int *folded_succ = NULL;
+
+// Stores the possible successors of the instruction at `pc` in `succ`, and
+// returns how many there are. Instructions that return have no successors.
+static
+int instruction_successors(Proto *f, int pc, int *succ)
+{
+    Instruction instr = f->code[pc];
+    OpCode op = GET_OPCODE(instr);
+    if (folded_succ && folded_succ[pc] >= 0) {
+        succ[0] = folded_succ[pc];
+        return 1;
+    }
+    if (is_arith_with_mmbin(op)) {
+        succ[0] = pc + 2;
+        succ[1] = pc + 1;
+        return 2;
+    }
+    if (is_conditional(op)) {
+        succ[0] = pc + 2;
+        succ[1] = next_jump_target(f, pc);
+        return 2;
+    }
+    switch (op) {
+        case OP_LOADKX:
+        case OP_NEWTABLE:
+        case OP_LFALSESKIP:
+            succ[0] = pc + 2;
+            return 1;
+        case OP_SETLIST:
+            succ[0] = pc + (TESTARG_k(instr) ? 2 : 1);
+            return 1;
+        case OP_JMP:
+            succ[0] = (pc+1) + GETARG_sJ(instr);
+            return 1;
+        case OP_FORLOOP:
+        case OP_TFORLOOP:
+            succ[0] = pc + 1;
+            succ[1] = (pc+1) - GETARG_Bx(instr);
+            return 2;
+        case OP_FORPREP:
+            succ[0] = pc + 1;
+            succ[1] = (pc+1) + GETARG_Bx(instr) + 1;
+            return 2;
+        case OP_TFORPREP:
+            succ[0] = (pc+1) + GETARG_Bx(instr);
+            return 1;
+        case OP_TAILCALL:
+        case OP_RETURN:
+        case OP_RETURN0:
+        case OP_RETURN1:
+        case OP_EXTRAARG:
+            return 0;
+        default:
+            succ[0] = pc + 1;
+            return 1;
+    }
+}
+
+//
+// Type inference
+// --------------
+//
+// A forward dataflow analysis that computes which types each register may
+// hold before each instruction executes. The backends use this information to
+// emit code without the usual tag checks in places where the operand types
+// are known. The analysis assumes that registers are only modified by the
+// function's own bytecode, except for the registers captured by closures,
+// which may hold anything. Since the debug library can break that assumption,
+// the generated code must still check the types once at the start of each
+// specialized block, and fall back to the generic code if the check fails.
+//
+
+typedef unsigned char TypeSet;
+
+#define T_INT   1
+#define T_FLT   2
+#define T_OTHER 4
+#define T_NUM   (T_INT | T_FLT)
+#define T_ANY   (T_INT | T_FLT | T_OTHER)
+
+static int      types_nregs = 0;
+static TypeSet *types_before = NULL;  // sizecode * nregs
+static char    *types_reached = NULL; // sizecode
+
+#define TYPES_AT(pc) (types_before + (size_t)(pc) * types_nregs)
+
+static
+int is_exact_type(TypeSet t)
+{
+    return (t == T_INT || t == T_FLT);
+}
+
+static
+TypeSet constant_type(Proto *f, int kidx)
+{
+    const TValue *o = &f->k[kidx];
+    if (ttisinteger(o)) return T_INT;
+    if (ttisfloat(o))   return T_FLT;
+    return T_OTHER;
+}
+
+// The result of an arithmetic operation when it does not call a metamethod.
+static
+TypeSet arith_result_type(OpCode op, TypeSet b, TypeSet c)
+{
+    TypeSet res = 0;
+    switch (op) {
+        case OP_DIV: case OP_POW: case OP_DIVK: case OP_POWK:
+            if ((b & T_NUM) && (c & T_NUM)) res = T_FLT;
+            break;
+        case OP_BAND: case OP_BOR: case OP_BXOR: case OP_SHL: case OP_SHR:
+        case OP_BANDK: case OP_BORK: case OP_BXORK: case OP_SHRI: case OP_SHLI:
+            if ((b & T_NUM) && (c & T_NUM)) res = T_INT;
+            break;
+        default:
+            if ((b & T_INT) && (c & T_INT)) res |= T_INT;
+            if (((b & T_FLT) && (c & T_NUM)) || ((c & T_FLT) && (b & T_NUM))) res |= T_FLT;
+            break;
+    }
+    return (res ? res : T_ANY);
+}
+
+// Type of the second operand of an arithmetic instruction.
+static
+TypeSet arith_operand2_type(Proto *f, Instruction instr, const TypeSet *st)
+{
+    switch (GET_OPCODE(instr)) {
+        case OP_ADDI: case OP_SHRI: case OP_SHLI:
+            return T_INT;
+        case OP_ADDK: case OP_SUBK: case OP_MULK: case OP_MODK:
+        case OP_POWK: case OP_DIVK: case OP_IDIVK:
+        case OP_BANDK: case OP_BORK: case OP_BXORK:
+            return constant_type(f, GETARG_C(instr));
+        default:
+            return st[GETARG_C(instr)];
+    }
+}
+
+// Arithmetic instructions only call the OP_MMBIN fallback if the operands
+// are not numbers, or if bitwise operands are not convertible to integers.
+static
+int arith_may_call_metamethod(Proto *f, Instruction instr, const TypeSet *st)
+{
+    OpCode op = GET_OPCODE(instr);
+    TypeSet b = st[GETARG_B(instr)];
+    TypeSet c = arith_operand2_type(f, instr, st);
+    switch (op) {
+        case OP_BAND: case OP_BOR: case OP_BXOR: case OP_SHL: case OP_SHR:
+        case OP_BANDK: case OP_BORK: case OP_BXORK: case OP_SHRI: case OP_SHLI:
+            return (b != T_INT || c != T_INT);
+        default:
+            return ((b & T_OTHER) || (c & T_OTHER));
+    }
+}
+
+static
+void set_types_from(TypeSet *st, int first, TypeSet t)
+{
+    for (int r = first; r < types_nregs; r++) {
+        st[r] = t;
+    }
+}
+
+// Updates the register types `st` with the effect of the instruction at `pc`,
+// when control flows from it to `target`.
+static
+void infer_edge(Proto *f, int pc, int target, TypeSet *st)
+{
+    Instruction instr = f->code[pc];
+    OpCode op = GET_OPCODE(instr);
+    int a = GETARG_A(instr);
+
+    if (is_arith_with_mmbin(op)) {
+        // If the metamethod is called, OP_MMBIN sets the result.
+        if (target == pc + 2) {
+            st[a] = arith_result_type(op, st[GETARG_B(instr)], arith_operand2_type(f, instr, st));
+        }
+        return;
+    }
+
+    switch (op) {
+        case OP_MOVE:
+            st[a] = st[GETARG_B(instr)];
+            break;
+        case OP_LOADI:
+            st[a] = T_INT;
+            break;
+        case OP_LOADF:
+            st[a] = T_FLT;
+            break;
+        case OP_LOADK:
+            st[a] = constant_type(f, GETARG_Bx(instr));
+            break;
+        case OP_LOADKX:
+            st[a] = constant_type(f, GETARG_Ax(f->code[pc+1]));
+            break;
+        case OP_LOADFALSE:
+        case OP_LFALSESKIP:
+        case OP_LOADTRUE:
+        case OP_NEWTABLE:
+        case OP_NOT:
+        case OP_CLOSURE:
+            st[a] = T_OTHER;
+            break;
+        case OP_LOADNIL:
+            for (int r = a; r <= a + GETARG_B(instr); r++) st[r] = T_OTHER;
+            break;
+        case OP_GETUPVAL:
+        case OP_GETTABUP:
+        case OP_GETTABLE:
+        case OP_GETI:
+        case OP_GETFIELD:
+        case OP_LEN:
+            st[a] = T_ANY;
+            break;
+        case OP_SELF:
+            st[a] = T_ANY;
+            st[a+1] = T_ANY;
+            break;
+        case OP_UNM: {
+            TypeSet b = st[GETARG_B(instr)];
+            st[a] = is_exact_type(b) ? b : T_ANY;
+            break;
+        }
+        case OP_BNOT: {
+            TypeSet b = st[GETARG_B(instr)];
+            st[a] = (b & T_OTHER) ? T_ANY : T_INT;
+            break;
+        }
+        case OP_MMBIN:
+        case OP_MMBINI:
+        case OP_MMBINK:
+            st[GETARG_A(f->code[pc-1])] = T_ANY;
+            break;
+        case OP_CONCAT:
+        case OP_CALL:
+        case OP_VARARG:
+            set_types_from(st, a, T_ANY);
+            break;
+        case OP_TFORCALL:
+            set_types_from(st, a + 4, T_ANY);
+            break;
+        case OP_TESTSET:
+            if (target != pc + 2) st[a] = st[GETARG_B(instr)];
+            break;
+        case OP_FORPREP: {
+            TypeSet t;
+            if (target != pc + 1) {
+                t = T_ANY;  // skipped the loop
+            } else if (st[a] == T_INT && st[a+2] == T_INT) {
+                t = T_INT;
+            } else if (!(st[a] & T_INT) || !(st[a+2] & T_INT)) {
+                t = T_FLT;
+            } else {
+                t = T_NUM;
+            }
+            for (int r = a; r <= a + 3; r++) st[r] = t;
+            break;
+        }
+        case OP_FORLOOP:
+            if (target != pc + 1) st[a+3] = st[a];
+            break;
+        case OP_TFORLOOP:
+            if (target != pc + 1) st[a+2] = st[a+4];
+            break;
+        default:
+            // Does not write to any register
+            break;
+    }
+}
+
+// An instruction is cold if its function ran, but the instruction did not.
+static
+int is_cold_instruction(int pc)
+{
+    return (current_profile && current_profile->pcs[pc].count == 0);
+}
+
+// Assumes that the operands of the instruction at `pc` have the same types
+// as in the profile, if it only saw integers or only floats. This is safe
+// because the regions check the types that they assume on entry.
+static
+void narrow_from_profile(Proto *f, int pc, TypeSet *st)
+{
+    if (!current_profile) return;
+    ProfileEntry *e = &current_profile->pcs[pc];
+    if (e->count < PROFILE_MIN_COUNT) return;
+    int regs[2];
+    int n = luaV_profoperands(f->code[pc], regs);
+    for (int j = 0; j < n; j++) {
+        TypeSet t = e->types[j];
+        if (is_exact_type(t) && (st[regs[j]] & t)) st[regs[j]] = t;
+    }
+}
+
+static
+void infer_types(Proto *f)
+{
+    types_nregs = f->maxstacksize;
+    free(types_before);
+    free(types_reached);
+    types_before  = calloc((size_t)f->sizecode * types_nregs + 1, sizeof(TypeSet));
+    types_reached = calloc(f->sizecode, 1);
+    int *worklist = malloc(f->sizecode * sizeof(int));
+    char *queued  = calloc(f->sizecode, 1);
+    TypeSet *st   = malloc(types_nregs + 1);
+    TypeSet *cur  = malloc(types_nregs + 1);
+    char *captured = calloc(types_nregs + 1, 1);
+    if (!types_before || !types_reached || !worklist || !queued || !st || !cur || !captured) {
+        fatal_error("out of memory");
+    }
+
+    // Registers captured by closures may be assigned through their upvalues.
+    for (int pc = 0; pc < f->sizecode; pc++) {
+        Instruction instr = f->code[pc];
+        if (GET_OPCODE(instr) == OP_CLOSURE) {
+            Proto *p = f->p[GETARG_Bx(instr)];
+            for (int j = 0; j < p->sizeupvalues; j++) {
+                if (p->upvalues[j].instack) captured[p->upvalues[j].idx] = 1;
+            }
+        }
+    }
+
+    // Parameters and uninitialized registers may hold anything.
+    set_types_from(TYPES_AT(0), 0, T_ANY);
+    types_reached[0] = 1;
+    int n = 0;
+    worklist[n++] = 0;
+    queued[0] = 1;
+
+    while (n > 0) {
+        int pc = worklist[--n];
+        queued[pc] = 0;
+
+        memcpy(cur, TYPES_AT(pc), types_nregs);
+        narrow_from_profile(f, pc, cur);
+
+        int succ[2];
+        int nsucc = instruction_successors(f, pc, succ);
+        for (int j = 0; j < nsucc; j++) {
+            int target = succ[j];
+            if (target < 0 || target >= f->sizecode) continue;
+            if (is_arith_with_mmbin(GET_OPCODE(f->code[pc])) && target == pc + 1 &&
+                !arith_may_call_metamethod(f, f->code[pc], cur)) continue;
+
+            memcpy(st, cur, types_nregs);
+            infer_edge(f, pc, target, st);
+            for (int r = 0; r < types_nregs; r++) {
+                if (captured[r]) st[r] = T_ANY;
+            }
+
+            TypeSet *dst = TYPES_AT(target);
+            int changed = !types_reached[target];
+            types_reached[target] = 1;
+            for (int r = 0; r < types_nregs; r++) {
+                TypeSet t = dst[r] | st[r];
+                if (t != dst[r]) { dst[r] = t; changed = 1; }
+            }
+            if (changed && !queued[target]) {
+                worklist[n++] = target;
+                queued[target] = 1;
+            }
+        }
+    }
+
+    free(worklist);
+    free(queued);
+    free(st);
+    free(cur);
+    free(captured);
+}
+
+//
+// Constant propagation
+// --------------------
+//
+// A forward dataflow analysis that finds the registers that always hold the
+// same constant (nil, a boolean, a number or a string) at each instruction.
+// Unlike the type inference, it only follows the branches that can be taken
+// with those constants, so it also finds the code that never runs. The tests
+// and the arithmetic whose operands are constants are folded: they get a
+// single successor, which the other analyses also see.
+//
+// Registers captured by closures may change behind our back, through their
+// upvalues, so they are never constant. So may any register, with
+// debug.setlocal, whenever Lua code runs. Without -n a hook can run before any
+// instruction, so nothing is ever constant. With -n, the constants are
+// forgotten after each instruction that may run Lua code.
+//
+
+#define CONST_ANY (-1)  // Not a constant
+
+static int     consts_npool = 0;
+static int     consts_capacity = 0;
+static TValue *consts_pool = NULL;    // The values of the constants
+static int    *consts_before = NULL;  // sizecode * nregs; an index in consts_pool, or CONST_ANY
+static char   *const_reached = NULL;  // sizecode
+static int    *folded_value = NULL;   // sizecode; the constant result of the instruction, or CONST_ANY
+
+#define CONSTS_AT(pc) (consts_before + (size_t)(pc) * types_nregs)
+
+// Floats are compared by their bits, so that 0.0 and -0.0 are different.
+static
+int same_constant(const TValue *a, const TValue *b)
+{
+    if (ttypetag(a) != ttypetag(b)) return 0;
+    if (ttisfloat(a)) {
+        lua_Number x = fltvalue(a), y = fltvalue(b);
+        return (memcmp(&x, &y, sizeof(lua_Number)) == 0);
+    }
+    return luaV_rawequalobj(a, b);
+}
+
+static
+int const_index(const TValue *v)
+{
+    for (int c = 0; c < consts_npool; c++) {
+        if (same_constant(&consts_pool[c], v)) return c;
+    }
+    if (consts_npool == consts_capacity) {
+        consts_capacity = (consts_capacity ? 2 * consts_capacity : 16);
+        consts_pool = realloc(consts_pool, consts_capacity * sizeof(TValue));
+        if (!consts_pool) { fatal_error("out of memory"); }
+    }
+    consts_pool[consts_npool] = *v;
+    return consts_npool++;
+}
+
+static
+const TValue *const_value(int c)
+{
+    return (c == CONST_ANY ? NULL : &consts_pool[c]);
+}
+
+// Does what the fast path of the arithmetic would do. Operations that would
+// raise an error, or call a metamethod, are not folded. Neither are results
+// that we could not write as C literals.
+static
+int fold_rawarith(int luaop, const TValue *p1, const TValue *p2)
+{
+    if (!p1 || !p2) return CONST_ANY;
+    if ((luaop == LUA_OPIDIV || luaop == LUA_OPMOD) &&
+        ttisinteger(p1) && ttisinteger(p2) && ivalue(p2) == 0) return CONST_ANY;
+    TValue res;
+    if (!luaO_rawarith(NULL, luaop, p1, p2, &res)) return CONST_ANY;
+    if (ttisfloat(&res) && !isfinite(fltvalue(&res))) return CONST_ANY;
+    return const_index(&res);
+}
+
+static
+int fold_arith(Proto *f, Instruction instr, const int *cv)
+{
+    OpCode op = GET_OPCODE(instr);
+    const TValue *rb = const_value(cv[GETARG_B(instr)]);
+    TValue imm;
+    setivalue(&imm, GETARG_sC(instr));
+    switch (op) {
+        case OP_ADDI:
+            return fold_rawarith(LUA_OPADD, rb, &imm);
+        case OP_SHRI:
+            return fold_rawarith(LUA_OPSHR, rb, &imm);
+        case OP_SHLI:
+            return fold_rawarith(LUA_OPSHL, &imm, rb);
+        case OP_ADDK: case OP_SUBK: case OP_MULK: case OP_MODK:
+        case OP_POWK: case OP_DIVK: case OP_IDIVK:
+        case OP_BANDK: case OP_BORK: case OP_BXORK:
+            return fold_rawarith(op - OP_ADDK + LUA_OPADD, rb, &f->k[GETARG_C(instr)]);
+        default:
+            return fold_rawarith(op - OP_ADD + LUA_OPADD, rb, const_value(cv[GETARG_C(instr)]));
+    }
+}
+
+// The outcome of a test, or -1 if it is not constant.
+static
+int fold_condition(Proto *f, Instruction instr, const int *cv)
+{
+    OpCode op = GET_OPCODE(instr);
+    const TValue *ra = const_value(cv[GETARG_A(instr)]);
+    const TValue *rb = (op == OP_TESTSET || op == OP_EQ || op == OP_LT || op == OP_LE)
+                       ? const_value(cv[GETARG_B(instr)]) : NULL;
+    int im = GETARG_sB(instr);
+    switch (op) {
+        case OP_TEST:
+            return ra ? !l_isfalse(ra) : -1;
+        case OP_TESTSET:
+            return rb ? !l_isfalse(rb) : -1;
+        case OP_EQ:
+            return (ra && rb) ? luaV_rawequalobj(ra, rb) : -1;
+        case OP_EQK:
+            return ra ? luaV_rawequalobj(ra, &f->k[GETARG_B(instr)]) : -1;
+        case OP_EQI:
+            if (!ra) return -1;
+            if (ttisinteger(ra)) return (ivalue(ra) == im);
+            if (ttisfloat(ra)) return (fltvalue(ra) == cast_num(im));
+            return 0;
+        case OP_LT: case OP_LE:
+            // Mixed integers and floats have subtle rules; leave them alone.
+            if (!ra || !rb) return -1;
+            if (ttisinteger(ra) && ttisinteger(rb)) {
+                return (op == OP_LT ? ivalue(ra) < ivalue(rb) : ivalue(ra) <= ivalue(rb));
+            }
+            if (ttisfloat(ra) && ttisfloat(rb)) {
+                return (op == OP_LT ? fltvalue(ra) < fltvalue(rb) : fltvalue(ra) <= fltvalue(rb));
+            }
+            return -1;
+        case OP_LTI: case OP_LEI: case OP_GTI: case OP_GEI: {
+            lua_Number x;
+            if (ra && ttisinteger(ra)) {
+                lua_Integer i = ivalue(ra);
+                switch (op) {
+                    case OP_LTI: return (i < im);
+                    case OP_LEI: return (i <= im);
+                    case OP_GTI: return (i > im);
+                    default:     return (i >= im);
+                }
+            }
+            if (!ra || !ttisfloat(ra)) return -1;
+            x = fltvalue(ra);
+            switch (op) {
+                case OP_LTI: return (x < cast_num(im));
+                case OP_LEI: return (x <= cast_num(im));
+                case OP_GTI: return (x > cast_num(im));
+                default:     return (x >= cast_num(im));
+            }
+        }
+        default:
+            return -1;
+    }
+}
+
+// The only successor of the instruction at `pc` given the constants in `cv`,
+// or -1 if there may be more than one.
+static
+int folded_successor(Proto *f, int pc, const int *cv)
+{
+    Instruction instr = f->code[pc];
+    OpCode op = GET_OPCODE(instr);
+    if (is_arith_with_mmbin(op)) {
+        return (fold_arith(f, instr, cv) != CONST_ANY ? pc + 2 : -1);
+    }
+    if (is_conditional(op)) {
+        int cond = fold_condition(f, instr, cv);
+        if (cond < 0) return -1;
+        return (cond != GETARG_k(instr) ? pc + 2 : next_jump_target(f, pc));
+    }
+    return -1;
+}
+
+static
+int fold_unary(Instruction instr, const int *cv)
+{
+    const TValue *rb = const_value(cv[GETARG_B(instr)]);
+    switch (GET_OPCODE(instr)) {
+        case OP_UNM:
+            return fold_rawarith(LUA_OPUNM, rb, rb);
+        case OP_BNOT:
+            return fold_rawarith(LUA_OPBNOT, rb, rb);
+        case OP_NOT: {
+            TValue v;
+            if (!rb) return CONST_ANY;
+            if (l_isfalse(rb)) setbtvalue(&v); else setbfvalue(&v);
+            return const_index(&v);
+        }
+        default:
+            return CONST_ANY;
+    }
+}
+
+// Updates the constants `cv` with the effect of the instruction at `pc`, when
+// control flows from it to `target`.
+static
+void const_edge(Proto *f, int pc, int target, int *cv)
+{
+    Instruction instr = f->code[pc];
+    OpCode op = GET_OPCODE(instr);
+    int a = GETARG_A(instr);
+    TValue v;
+
+    if (is_arith_with_mmbin(op)) {
+        if (target == pc + 2) cv[a] = fold_arith(f, instr, cv);
+        return;
+    }
+
+    switch (op) {
+        case OP_MOVE:
+            cv[a] = cv[GETARG_B(instr)];
+            break;
+        case OP_LOADI:
+            setivalue(&v, GETARG_sBx(instr));
+            cv[a] = const_index(&v);
+            break;
+        case OP_LOADF:
+            setfltvalue(&v, cast_num(GETARG_sBx(instr)));
+            cv[a] = const_index(&v);
+            break;
+        case OP_LOADK:
+            cv[a] = const_index(&f->k[GETARG_Bx(instr)]);
+            break;
+        case OP_LOADKX:
+            cv[a] = const_index(&f->k[GETARG_Ax(f->code[pc+1])]);
+            break;
+        case OP_LOADFALSE:
+        case OP_LFALSESKIP:
+            setbfvalue(&v);
+            cv[a] = const_index(&v);
+            break;
+        case OP_LOADTRUE:
+            setbtvalue(&v);
+            cv[a] = const_index(&v);
+            break;
+        case OP_LOADNIL:
+            setnilvalue(&v);
+            for (int r = a; r <= a + GETARG_B(instr); r++) cv[r] = const_index(&v);
+            break;
+        case OP_UNM:
+        case OP_BNOT:
+        case OP_NOT:
+            cv[a] = fold_unary(instr, cv);
+            break;
+        case OP_TESTSET:
+            if (target != pc + 2) cv[a] = cv[GETARG_B(instr)];
+            break;
+        case OP_MMBIN:
+        case OP_MMBINI:
+        case OP_MMBINK:
+            cv[GETARG_A(f->code[pc-1])] = CONST_ANY;
+            break;
+        default:
+            for (int r = 0; r < types_nregs; r++) {
+                if (instruction_may_write(f, pc, r)) cv[r] = CONST_ANY;
+            }
+            break;
+    }
+}
+
+// Instructions that may run Lua code: calls, metamethods, and the finalizers
+// called by the GC steps. The arithmetic only calls metamethods from the
+// OP_MMBIN that follows it.
+static
+int may_run_lua(Proto *f, int pc)
+{
+    OpCode op = GET_OPCODE(f->code[pc]);
+    switch (op) {
+        case OP_MOVE: case OP_LOADI: case OP_LOADF: case OP_LOADK: case OP_LOADKX:
+        case OP_LOADFALSE: case OP_LFALSESKIP: case OP_LOADTRUE: case OP_LOADNIL:
+        case OP_GETUPVAL: case OP_SETUPVAL: case OP_NOT: case OP_JMP:
+        case OP_TEST: case OP_TESTSET: case OP_EQK: case OP_EQI:
+        case OP_FORPREP: case OP_FORLOOP: case OP_EXTRAARG:
+            return 0;
+        default:
+            return !(OP_ADDI <= op && op <= OP_SHR);
+    }
+}
+
+static
+void fold_constants(Proto *f)
+{
+    int nregs = f->maxstacksize;
+    types_nregs = nregs;
+    free(folded_succ);
+    folded_succ = NULL;  // So that instruction_successors gives us all of them
+    free(folded_value);
+    free(consts_before);
+    free(const_reached);
+    consts_npool = 0;
+    consts_before = malloc(((size_t)f->sizecode * nregs + 1) * sizeof(int));
+    const_reached = calloc(f->sizecode, 1);
+    int *succ_out = malloc(f->sizecode * sizeof(int));
+    int *value_out = malloc(f->sizecode * sizeof(int));
+    int *worklist = malloc(f->sizecode * sizeof(int));
+    char *queued  = calloc(f->sizecode, 1);
+    char *captured = calloc(nregs + 1, 1);
+    int *cv = malloc((nregs + 1) * sizeof(int));
+    if (!consts_before || !const_reached || !succ_out || !value_out ||
+        !worklist || !queued || !captured || !cv) {
+        fatal_error("out of memory");
+    }
+
+    for (int pc = 0; pc < f->sizecode; pc++) {
+        Instruction instr = f->code[pc];
+        if (GET_OPCODE(instr) == OP_CLOSURE) {
+            Proto *p = f->p[GETARG_Bx(instr)];
+            for (int j = 0; j < p->sizeupvalues; j++) {
+                if (p->upvalues[j].instack) captured[p->upvalues[j].idx] = 1;
+            }
+        }
+    }
+
+    // Parameters and uninitialized registers may hold anything.
+    for (int r = 0; r < nregs; r++) CONSTS_AT(0)[r] = CONST_ANY;
+    const_reached[0] = 1;
+    int n = 0;
+    worklist[n++] = 0;
+    queued[0] = 1;
+
+    while (n > 0) {
+        int pc = worklist[--n];
+        queued[pc] = 0;
+
+        int succ[2];
+        int nsucc;
+        int folded = folded_successor(f, pc, CONSTS_AT(pc));
+        if (folded >= 0) {
+            succ[0] = folded;
+            nsucc = 1;
+        } else {
+            nsucc = instruction_successors(f, pc, succ);
+        }
+        // Folded instructions have constant operands, so they cannot call
+        // metamethods.
+        OpCode op = GET_OPCODE(f->code[pc]);
+        int runs_lua = !no_hooks ||
+            (may_run_lua(f, pc) && folded < 0 &&
+             !((op == OP_UNM || op == OP_BNOT) && fold_unary(f->code[pc], CONSTS_AT(pc)) != CONST_ANY));
+        for (int j = 0; j < nsucc; j++) {
+            int target = succ[j];
+            if (target < 0 || target >= f->sizecode) continue;
+
+            memcpy(cv, CONSTS_AT(pc), nregs * sizeof(int));
+            const_edge(f, pc, target, cv);
+            for (int r = 0; r < nregs; r++) {
+                if (captured[r] || runs_lua) cv[r] = CONST_ANY;
+            }
+
+            int *dst = CONSTS_AT(target);
+            int changed = 0;
+            if (!const_reached[target]) {
+                const_reached[target] = 1;
+                memcpy(dst, cv, nregs * sizeof(int));
+                changed = 1;
+            } else {
+                for (int r = 0; r < nregs; r++) {
+                    if (dst[r] != cv[r] && dst[r] != CONST_ANY) { dst[r] = CONST_ANY; changed = 1; }
+                }
+            }
+            if (changed && !queued[target]) {
+                worklist[n++] = target;
+                queued[target] = 1;
+            }
+        }
+    }
+
+    for (int pc = 0; pc < f->sizecode; pc++) {
+        succ_out[pc] = -1;
+        value_out[pc] = CONST_ANY;
+        if (!const_reached[pc]) continue;
+        Instruction instr = f->code[pc];
+        OpCode op = GET_OPCODE(instr);
+        succ_out[pc] = folded_successor(f, pc, CONSTS_AT(pc));
+        if (is_arith_with_mmbin(op)) {
+            value_out[pc] = fold_arith(f, instr, CONSTS_AT(pc));
+        } else if (op == OP_UNM || op == OP_BNOT || op == OP_NOT) {
+            value_out[pc] = fold_unary(instr, CONSTS_AT(pc));
+        }
+    }
+    folded_succ = succ_out;
+    folded_value = value_out;
+
+    free(worklist);
+    free(queued);
+    free(captured);
+    free(cv);
+}
+
+//
+// Liveness
+// --------
+//
+// A backward dataflow analysis that computes which registers may be read
+// before being overwritten, starting at each instruction. The backends use it
+// to avoid writing values back to the Lua stack when nobody will read them.
+// Registers captured by closures may be read at any time, through their
+// upvalues, so we consider them to be live everywhere.
+//
+
+static char *live_before = NULL; // sizecode * nregs
+
+#define LIVE_AT(pc) (live_before + (size_t)(pc) * types_nregs)
+
+static
+void mark_range(char *set, int first, int last)
+{
+    if (last >= types_nregs) last = types_nregs - 1;
+    for (int r = first; r <= last; r++) {
+        set[r] = 1;
+    }
+}
+
+// Registers that the instruction may read (use) and registers that it always
+// overwrites (def). Instructions that we are not sure about use everything.
+static
+void instruction_uses_defs(Proto *f, int pc, char *use, char *def)
+{
+    Instruction instr = f->code[pc];
+    OpCode op = GET_OPCODE(instr);
+    int a = GETARG_A(instr);
+    int b = GETARG_B(instr);
+    int c = GETARG_C(instr);
+    int all = types_nregs - 1;
+
+    memset(use, 0, types_nregs);
+    memset(def, 0, types_nregs);
+
+    if (is_arith_with_mmbin(op)) {
+        use[b] = 1;
+        if (OP_ADD <= op && op <= OP_SHR) use[c] = 1;
+        def[a] = 1;
+        return;
+    }
+
+    switch (op) {
+        case OP_MOVE: case OP_UNM: case OP_BNOT: case OP_NOT: case OP_LEN:
+        case OP_GETI: case OP_GETFIELD:
+            use[b] = 1; def[a] = 1; break;
+        case OP_LOADI: case OP_LOADF: case OP_LOADK: case OP_LOADKX:
+        case OP_LOADFALSE: case OP_LFALSESKIP: case OP_LOADTRUE:
+        case OP_GETUPVAL: case OP_GETTABUP: case OP_NEWTABLE: case OP_CLOSURE:
+            def[a] = 1; break;
+        case OP_LOADNIL:
+            mark_range(def, a, a + b); break;
+        case OP_SETUPVAL: case OP_TEST: case OP_TBC:
+        case OP_EQK: case OP_EQI: case OP_LTI: case OP_LEI: case OP_GTI: case OP_GEI:
+        case OP_RETURN1:
+            use[a] = 1; break;
+        case OP_GETTABLE:
+            use[b] = 1; use[c] = 1; def[a] = 1; break;
+        case OP_SETTABUP:
+            if (!TESTARG_k(instr)) use[c] = 1;
+            break;
+        case OP_SETTABLE:
+            use[a] = 1; use[b] = 1;
+            if (!TESTARG_k(instr)) use[c] = 1;
+            break;
+        case OP_SETI: case OP_SETFIELD:
+            use[a] = 1;
+            if (!TESTARG_k(instr)) use[c] = 1;
+            break;
+        case OP_SELF:
+            use[b] = 1;
+            if (!TESTARG_k(instr)) use[c] = 1;
+            def[a] = 1; def[a+1] = 1;
+            break;
+        case OP_MMBIN:
+            use[a] = 1; use[b] = 1; def[GETARG_A(f->code[pc-1])] = 1; break;
+        case OP_MMBINI: case OP_MMBINK:
+            use[a] = 1; def[GETARG_A(f->code[pc-1])] = 1; break;
+        case OP_CONCAT:
+            mark_range(use, a, a + b - 1); def[a] = 1; break;
+        case OP_EQ: case OP_LT: case OP_LE:
+            use[a] = 1; use[b] = 1; break;
+        case OP_TESTSET:
+            use[b] = 1; break;
+        case OP_JMP: case OP_RETURN0: case OP_EXTRAARG:
+            break;
+        case OP_CALL:
+            mark_range(use, a, (b == 0 ? all : a + b - 1));
+            if (c > 0) mark_range(def, a, a + c - 2);
+            break;
+        case OP_TAILCALL:
+            mark_range(use, (TESTARG_k(instr) ? 0 : a), (b == 0 ? all : a + b - 1));
+            break;
+        case OP_RETURN:
+            mark_range(use, (TESTARG_k(instr) ? 0 : a), (b == 0 ? all : a + b - 2));
+            break;
+        case OP_FORLOOP: case OP_FORPREP:
+            mark_range(use, a, a + 2); break;
+        case OP_TFORPREP:
+            mark_range(use, a, a + 3); break;
+        case OP_TFORCALL:
+            mark_range(use, a, a + 3); mark_range(def, a + 4, a + 3 + c); break;
+        case OP_TFORLOOP:
+            use[a+4] = 1; break;
+        case OP_SETLIST:
+            mark_range(use, a, (b == 0 ? all : a + b)); break;
+        case OP_VARARG:
+            if (c > 0) mark_range(def, a, a + c - 2);
+            break;
+        default:
+            // OP_CLOSE, OP_VARARGPREP, ...
+            mark_range(use, 0, all);
+            break;
+    }
+}
+
+static
+void compute_liveness(Proto *f)
+{
+    int nregs = types_nregs;
+    free(live_before);
+    live_before = calloc((size_t)f->sizecode * nregs + 1, 1);
+    char *captured = calloc(nregs + 1, 1);
+    char *use = malloc(nregs + 1);
+    char *def = malloc(nregs + 1);
+    char *live = malloc(nregs + 1);
+    if (!live_before || !captured || !use || !def || !live) { fatal_error("out of memory"); }
+
+    for (int pc = 0; pc < f->sizecode; pc++) {
+        Instruction instr = f->code[pc];
+        if (GET_OPCODE(instr) == OP_CLOSURE) {
+            Proto *p = f->p[GETARG_Bx(instr)];
+            for (int j = 0; j < p->sizeupvalues; j++) {
+                if (p->upvalues[j].instack) captured[p->upvalues[j].idx] = 1;
+            }
+        }
+    }
+
+    // Iterate in reverse order until nothing changes. Usually converges in a
+    // couple of rounds, because most edges point forward.
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (int pc = f->sizecode - 1; pc >= 0; pc--) {
+            memcpy(live, captured, nregs);
+            int succ[2];
+            int nsucc = instruction_successors(f, pc, succ);
+            for (int j = 0; j < nsucc; j++) {
+                if (succ[j] < 0 || succ[j] >= f->sizecode) continue;
+                const char *after = LIVE_AT(succ[j]);
+                for (int r = 0; r < nregs; r++) live[r] |= after[r];
+            }
+            instruction_uses_defs(f, pc, use, def);
+            char *before = LIVE_AT(pc);
+            for (int r = 0; r < nregs; r++) {
+                char l = use[r] || captured[r] || (live[r] && !def[r]);
+                if (l != before[r]) { before[r] = l; changed = 1; }
+            }
+        }
+    }
+
+    free(captured);
+    free(use);
+    free(def);
+    free(live);
+}
+
+#endif
+
+#if defined(LUAOT_USE_GOTOS)
+#include "luaot_gotos.c"
+#elif defined(LUAOT_USE_SWITCHES)
+#include "luaot_switches.c"
+#else
+#error "Must define LUAOT_USE_GOTOS or LUAOT_USE_SWITCHES"
+#endif
+
+static
+void create_functions(Proto *p)
+{
+    // luaot_footer.c should use the same traversal order as this.
+    create_function(p);
+    for (int i = 0; i < p->sizep; i++) {
+        create_functions(p->p[i]);
+    }
+}
+
+static
+void print_backend_header()
+{
+    if (no_hooks) {
+        println("#define LUAOT_NO_HOOKS 1");
+    }
+    #if defined(LUAOT_USE_GOTOS)
+    println("#include \"luaot_header.c\"");
+    #elif defined(LUAOT_USE_SWITCHES)
+    println("#include \"trampoline_header.c\"");
+    #endif
+}
+
+//
+// Sharded output
+// --------------
+//
+// Compiling a single huge C file is slow, and cannot take advantage of
+// parallel builds. With -j N, the functions are split across N additional C
+// files (output_1.c ... output_N.c), which share the declarations in
+// output.h. The main output file keeps the function table, the bundled code
+// and the luaopen function. We generate the shards in parallel, with one
+// child process per shard.
+//
+
+static
+char *output_filename_with(const char *suffix)
+{
+    size_t n = strlen(output_filename) - 2;  // Without the ".c"
+    char *name = malloc(n + strlen(suffix) + 1);
+    if (!name) { fatal_error("out of memory"); }
+    memcpy(name, output_filename, n);
+    strcpy(name + n, suffix);
+    return name;
+}
+
+static
+const char *shard_header_name()
+{
+    static char *name = NULL;
+    if (!name) {
+        char *path = output_filename_with(".h");
+        char *base = strrchr(path, '/');
+        name = (base ? base + 1 : path);
+    }
+    return name;
+}
+
+static
+void print_shared_header()
+{
+    FILE *main_file = output_file;
+    char *filename = output_filename_with(".h");
+    output_file = fopen(filename, "w");
+    if (output_file == NULL) { fatal_error(strerror(errno)); }
+
+    println("#ifndef LUAOT_SHARED_HEADER");
+    println("#define LUAOT_SHARED_HEADER");
+    printnl();
+    println("/* Shards only see the exported functions from lvm.c */");
+    println("#define LUAOT_IS_MODULE 1");
+    print_backend_header();
+    printnl();
+    println("#if defined(__GNUC__)");
+    println("#define LUAOT_HIDDEN __attribute__((visibility(\"hidden\")))");
+    println("#else");
+    println("#define LUAOT_HIDDEN");
+    println("#endif");
+    printnl();
+    for (int i = 0; i < nprotos; i++) {
+        println("LUAOT_HIDDEN CallInfo *magic_implementation_%02d(lua_State *L, CallInfo *ci);", i);
+    }
+    printnl();
+    println("#endif");
+
+    fclose(output_file);
+    free(filename);
+    output_file = main_file;
+}
+
+static
+void print_shards()
+{
+    print_shared_header();
+
+    // Assign the biggest functions first, each one to the least loaded shard.
+    int *shard_of = malloc(nprotos * sizeof(int));
+    long *load = calloc(nshards, sizeof(long));
+    char *assigned = calloc(nprotos, 1);
+    if (!shard_of || !load || !assigned) { fatal_error("out of memory"); }
+    for (int k = 0; k < nprotos; k++) {
+        int best = -1;
+        for (int id = 0; id < nprotos; id++) {
+            if (!assigned[id] && (best < 0 || all_protos[id]->sizecode > all_protos[best]->sizecode)) {
+                best = id;
+            }
+        }
+        int s = 0;
+        for (int j = 1; j < nshards; j++) {
+            if (load[j] < load[s]) s = j;
+        }
+        assigned[best] = 1;
+        shard_of[best] = s;
+        load[s] += all_protos[best]->sizecode;
+    }
+
+    fflush(NULL);  // Otherwise the children would also write our buffers
+    pid_t *pids = malloc(nshards * sizeof(pid_t));
+    if (!pids) { fatal_error("out of memory"); }
+    for (int s = 0; s < nshards; s++) {
+        pid_t pid = fork();
+        if (pid < 0) { fatal_error(strerror(errno)); }
+        if (pid == 0) {
+            char suffix[32];
+            snprintf(suffix, sizeof(suffix), "_%d.c", s + 1);
+            char *filename = output_filename_with(suffix);
+            output_file = fopen(filename, "w");
+            if (output_file == NULL) { fatal_error(strerror(errno)); }
+            println("#include \"%s\"", shard_header_name());
+            printnl();
+            for (int id = 0; id < nprotos; id++) {
+                if (shard_of[id] != s) continue;
+                nfunctions = id;
+                create_function(all_protos[id]);
+            }
+            if (fclose(output_file) != 0) { fatal_error(strerror(errno)); }
+            _exit(0);
+        }
+        pids[s] = pid;
+    }
+
+    int failed = 0;
+    for (int s = 0; s < nshards; s++) {
+        int status;
+        if (waitpid(pids[s], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            failed = 1;
+        }
+    }
+    if (failed) { fatal_error("could not generate all the shards"); }
+    nfunctions = nprotos;
+
+    free(shard_of);
+    free(load);
+    free(assigned);
+    free(pids);
+}
+
+static
+void print_functions(Proto **protos, int n)
+{
+    // The functions may call each other directly, so declare them first.
+    module_first_function = malloc(n * sizeof(int));
+    if (!module_first_function) { fatal_error("out of memory"); }
+    for (int m = 0; m < n; m++) {
+        module_first_function[m] = nprotos;
+        collect_protos(protos[m], NULL);
+    }
+    if (nshards > 0) {
+        print_shards();
+    } else {
+        for (int i = 0; i < nprotos; i++) {
+            println("static CallInfo *magic_implementation_%02d(lua_State *L, CallInfo *ci);", i);
+        }
+        printnl();
+
+        for (int m = 0; m < n; m++) {
+            create_functions(protos[m]);
+        }
+    }
+
+    // With -t, the interpreter may also find the functions in this library by
+    // the hash of their bytecode, when they get hot (see laot.c). It compares
+    // the full signatures before it uses one of them.
+    if (tier_table) {
+        for (int i = 0; i < nprotos; i++) {
+            Proto *f = all_protos[i];
+            size_t size = luaV_codesig(f, NULL, 0);
+            lu_byte *sig = malloc(size);
+            if (!sig) { fatal_error("out of memory"); }
+            luaV_codesig(f, sig, size);
+            println("static const lu_byte luaot_tier_sig_%02d[] = {", i);
+            for (size_t j = 0; j < size; j++) {
+                if (j % 16 == 0) print("  ");
+                print("%d,", sig[j]);
+                if (j % 16 == 15 || j + 1 == size) printnl();
+            }
+            println("};");
+            printnl();
+            free(sig);
+        }
+        println("const LuaotTierEntry luaot_tier_functions[] = {");
+        for (int i = 0; i < nprotos; i++) {
+            Proto *f = all_protos[i];
+            println("  { 0x%08x, %d, magic_implementation_%02d, luaot_tier_sig_%02d, sizeof(luaot_tier_sig_%02d) },",
+                    luaV_codehash(f), f->sizecode, i, i, i);
+        }
+        println("  { 0, 0, NULL, NULL, 0 }");
+        println("};");
+        printnl();
+    }
+
+    if (emit_proto_data) {
+        return;  // LUAOT_PROTOS has them instead
+    }
+    println("static AotCompiledFunction LUAOT_FUNCTIONS[] = {");
+    for (int i = 0; i < nfunctions; i++) {
+        println("  magic_implementation_%02d,", i);
+    }
+    println("  NULL");
+    println("};");
+}
+
+static
+void print_source_code(const char *input_filename, int m)
+{
+    // Since the code we are generating is lifted from lvm.c, we need it to use
+    // Lua functions instead of C functions. And to create the Lua functions,
+    // we have to `load` them from source code.
+    //
+    // The most readable approach would be to bundle this Lua source code as a
+    // big C string literal. However, C compilers have limits on how big a
+    // string literal can be, so instead of using a string literal, we use a
+    // plain char array instead.
+
+    FILE *infile = fopen(input_filename, "r");
+    if (!infile) { fatal_error("could not open input file a second time"); }
+
+    println("static const char LUAOT_MODULE_SOURCE_CODE_%d[] = {", m);
+
+    int c;
+    int col = 0;
+    do {
+        if (col == 0) {
+            print(" ");
+        }
+
+        c = fgetc(infile);
+        if (c == EOF) {
+            print(" %3d", 0);
+        } else {
+            print(" %3d", c);
+            print(",");
+        }
+
+        col++;
+        if (col == 16 || c == EOF) {
+            print("\n");
+            col = 0;
+        }
+    } while (c != EOF);
+    println("};");
+
+    fclose(infile);
+}
+
+static int bytecode_col = 0;
+
+static
+int write_bytecode(lua_State *L, const void *p, size_t size, void *ud)
+{
+    (void) L; (void) ud;
+    const unsigned char *bytes = p;
+    for (size_t i = 0; i < size; i++) {
+        if (bytecode_col == 0) {
+            print(" ");
+        }
+        print(" %3d,", bytes[i]);
+        bytecode_col++;
+        if (bytecode_col == 16) {
+            print("\n");
+            bytecode_col = 0;
+        }
+    }
+    return 0;
+}
+
+static
+void print_bytecode(lua_State *L, int idx, int m)
+{
+    // Instead of the source code, we can also bundle the precompiled bytecode
+    // for the main function. This way, the module does not need to be parsed
+    // again when it is loaded.
+
+    if (m == 0) {
+        println("#define LUAOT_USE_BYTECODE 1");
+    }
+    println("static const unsigned char LUAOT_MODULE_BYTECODE_%d[] = {", m);
+    bytecode_col = 0;
+    lua_pushvalue(L, idx);
+    if (lua_dump(L, write_bytecode, NULL, strip_debug_info) != 0) {
+        fatal_error("could not dump the bytecode");
+    }
+    lua_pop(L, 1);
+    if (bytecode_col != 0) {
+        print("\n");
+    }
+    println("};");
+}
+
+static
+void print_c_string(const char *s, size_t len)
+{
+    print("\"");
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\' || c == '?' || !isprint(c)) {
+            print("\\%03o", c);
+        } else {
+            print("%c", c);
+        }
+    }
+    print("\"");
+}
+
+static
+void print_proto_arrays(Proto *f, int id)
+{
+    println("static const Instruction LUAOT_CODE_%02d[] = {", id);
+    for (int i = 0; i < f->sizecode; i++) {
+        println("  0x%08x,", f->code[i]);
+    }
+    println("};");
+
+    if (f->sizek > 0) {
+        println("static const LuaotConstant LUAOT_K_%02d[] = {", id);
+        for (int i = 0; i < f->sizek; i++) {
+            const TValue *o = &f->k[i];
+            int tt = ttypetag(o);
+            switch (tt) {
+                case LUA_VNUMFLT: {
+                    lua_Number n = fltvalue(o);
+                    if (n == (lua_Number)HUGE_VAL) {
+                        println("  { .tt = LUA_VNUMFLT, .n = HUGE_VAL },");
+                    } else if (n == -(lua_Number)HUGE_VAL) {
+                        println("  { .tt = LUA_VNUMFLT, .n = -HUGE_VAL },");
+                    } else {
+                        println("  { .tt = LUA_VNUMFLT, .n = %a },", (double)n);
+                    }
+                    break;
+                }
+                case LUA_VNUMINT: {
+                    lua_Integer n = ivalue(o);
+                    if (n == LUA_MININTEGER) {
+                        println("  { .tt = LUA_VNUMINT, .i = LUA_MININTEGER },");
+                    } else {
+                        println("  { .tt = LUA_VNUMINT, .i = " LUA_INTEGER_FMT " },", (LUAI_UACINT)n);
+                    }
+                    break;
+                }
+                case LUA_VSHRSTR:
+                case LUA_VLNGSTR: {
+                    TString *ts = tsvalue(o);
+                    print("  { .tt = %s, .s = ", (tt == LUA_VSHRSTR ? "LUA_VSHRSTR" : "LUA_VLNGSTR"));
+                    print_c_string(getstr(ts), tsslen(ts));
+                    println(", .len = %zu },", tsslen(ts));
+                    break;
+                }
+                case LUA_VNIL:   println("  { .tt = LUA_VNIL },"); break;
+                case LUA_VFALSE: println("  { .tt = LUA_VFALSE },"); break;
+                case LUA_VTRUE:  println("  { .tt = LUA_VTRUE },"); break;
+                default: fatal_error("unknown constant type");
+            }
+        }
+        println("};");
+    }
+
+    if (f->sizeupvalues > 0) {
+        println("static const LuaotUpvalue LUAOT_UPVALUES_%02d[] = {", id);
+        for (int i = 0; i < f->sizeupvalues; i++) {
+            Upvaldesc *uv = &f->upvalues[i];
+            print("  { .name = ");
+            if (strip_debug_info || uv->name == NULL) {
+                print("NULL");
+            } else {
+                print_c_string(getstr(uv->name), tsslen(uv->name));
+            }
+            println(", .instack = %d, .idx = %d, .kind = %d },", uv->instack, uv->idx, uv->kind);
+        }
+        println("};");
+    }
+
+    if (f->sizep > 0) {
+        println("static const int LUAOT_P_%02d[] = {", id);
+        for (int i = 0; i < f->sizep; i++) {
+            println("  %d,", proto_id(f->p[i]));
+        }
+        println("};");
+    }
+
+    if (strip_debug_info) return;
+
+    if (f->sizelineinfo > 0) {
+        println("static const ls_byte LUAOT_LINEINFO_%02d[] = {", id);
+        for (int i = 0; i < f->sizelineinfo; i++) {
+            println("  %d,", f->lineinfo[i]);
+        }
+        println("};");
+    }
+
+    if (f->sizeabslineinfo > 0) {
+        println("static const AbsLineInfo LUAOT_ABSLINEINFO_%02d[] = {", id);
+        for (int i = 0; i < f->sizeabslineinfo; i++) {
+            println("  { %d, %d },", f->abslineinfo[i].pc, f->abslineinfo[i].line);
+        }
+        println("};");
+    }
+
+    if (f->sizelocvars > 0) {
+        println("static const LuaotLocVar LUAOT_LOCVARS_%02d[] = {", id);
+        for (int i = 0; i < f->sizelocvars; i++) {
+            LocVar *v = &f->locvars[i];
+            print("  { ");
+            print_c_string(getstr(v->varname), tsslen(v->varname));
+            println(", %d, %d },", v->startpc, v->endpc);
+        }
+        println("};");
+    }
+}
+
+static
+void print_proto_data()
+{
+    // Instead of loading the functions from source code or from bytecode, we
+    // can also emit the contents of each Proto as static C data. The functions
+    // that build the Protos from this data are in luaot_protodata.c
+
+    println("#define LUAOT_USE_PROTO_DATA 1");
+    println("#include \"luaot_protodata.c\"");
+    printnl();
+
+    for (int id = 0; id < nprotos; id++) {
+        print_proto_arrays(all_protos[id], id);
+        printnl();
+    }
+
+    println("static const LuaotProto LUAOT_PROTOS[] = {");
+    for (int id = 0; id < nprotos; id++) {
+        Proto *f = all_protos[id];
+        Proto *parent = all_parents[id];
+        int debug = !strip_debug_info;
+        println("  {");
+        println("    .implementation = magic_implementation_%02d,", id);
+        if (debug && f->source && (!parent || f->source != parent->source)) {
+            print("    .source = ");
+            print_c_string(getstr(f->source), tsslen(f->source));
+            println(",");
+            println("    .sourcelen = %zu,", tsslen(f->source));
+        }
+        println("    .linedefined = %d,", f->linedefined);
+        println("    .lastlinedefined = %d,", f->lastlinedefined);
+        println("    .numparams = %d,", f->numparams);
+        println("    .is_vararg = %d,", f->is_vararg);
+        println("    .maxstacksize = %d,", f->maxstacksize);
+        println("    .sizecode = %d, .code = LUAOT_CODE_%02d,", f->sizecode, id);
+        if (f->sizek > 0)
+            println("    .sizek = %d, .k = LUAOT_K_%02d,", f->sizek, id);
+        if (f->sizeupvalues > 0)
+            println("    .sizeupvalues = %d, .upvalues = LUAOT_UPVALUES_%02d,", f->sizeupvalues, id);
+        if (f->sizep > 0)
+            println("    .sizep = %d, .p = LUAOT_P_%02d,", f->sizep, id);
+        if (debug && f->sizelineinfo > 0)
+            println("    .sizelineinfo = %d, .lineinfo = LUAOT_LINEINFO_%02d,", f->sizelineinfo, id);
+        if (debug && f->sizeabslineinfo > 0)
+            println("    .sizeabslineinfo = %d, .abslineinfo = LUAOT_ABSLINEINFO_%02d,", f->sizeabslineinfo, id);
+        if (debug && f->sizelocvars > 0)
+            println("    .sizelocvars = %d, .locvars = LUAOT_LOCVARS_%02d,", f->sizelocvars, id);
+        println("  },");
+    }
+    println("};");
 }
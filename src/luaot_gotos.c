@@ -14,6 +14,18 @@ int jump_target(Proto *f, int pc)
     return (pc+1) + GETARG_sJ(instr);
 }
 
+// Where we may continue after returning from a Lua function or after a
+// coroutine resumes. It is possible to yield elsewhere (for example, inside
+// a metamethod), but those are rare enough that the interpreter can take
+// care of them.
+static
+int is_resume_point(Proto *f, int pc)
+{
+    if (pc == 0) return 1;
+    OpCode prev = GET_OPCODE(f->code[pc-1]);
+    return (prev == OP_CALL || prev == OP_TFORCALL);
+}
+
 static
 void println_goto_ret()
 {
@@ -27,11 +39,1527 @@ void println_goto_ret()
     println("    }");
 }
 
+//
+// Type-specialized regions
+// ------------------------
+// A region is a group of consecutive instructions that only operate on
+// numbers whose types were determined by infer_types. For each region we emit
+// a fast path that skips the tag checks and the metamethod fallbacks. It is
+// placed in front of the generic code for the first instruction, protected by
+// a guard that checks the tags of the registers that the region reads. If the
+// guard fails we run the generic code instead.
+//
+// Regions may contain forward branches (if-then-else) and may jump back to
+// their first instruction (loops). All other jumps leave the region and go
+// back to the generic code, using the usual labels.
+//
+// Inside a region, the registers live in C variables named ireg_N and freg_N,
+// depending on their type, so that the C compiler can keep them in machine
+// registers. They are loaded when we enter the region, and are written back
+// to the Lua stack when we leave it. We only write back values that changed,
+// and that the code after the exit might read.
+//
+
+static int     *region_end = NULL;     // Last pc of the region starting at pc, or -1
+static int     *region_of = NULL;      // First pc of the region that contains pc, or -1
+static char    *region_reached = NULL; // Whether an edge from inside the region reaches pc
+static TypeSet *region_types = NULL;   // Register types, considering only edges from the region
+static TypeSet *region_dirty = NULL;   // Registers that are only up to date in the C variables
+static int     *pred_start = NULL;     // The predecessors of pc are in pred_list, from
+static int     *pred_list = NULL;      //   pred_start[pc] to pred_start[pc+1]-1
+
+#define REGION_TYPES(pc) (region_types + (size_t)(pc) * types_nregs)
+#define REGION_DIRTY(pc) (region_dirty + (size_t)(pc) * types_nregs)
+
+// State of the region that is being emitted
+static int      spec_start;
+static TypeSet *spec_live_in = NULL;  // Registers that may be read before being written
+static TypeSet *spec_written = NULL;  // Types that are assigned to each register
+static TypeSet *spec_dirty = NULL;    // The current value of region_dirty
+static char    *spec_label = NULL;    // Whether other parts of the region jump to pc
+static int      side_exit_to_start;   // Whether the region jumps to its own generic code
+
+// The instruction that runs after `pc`, when its fast path is taken.
+static
+int spec_next(Proto *f, int pc)
+{
+    OpCode op = GET_OPCODE(f->code[pc]);
+    return (is_arith_with_mmbin(op) || is_conditional(op)) ? pc + 2 : pc + 1;
+}
+
+// Successors of `pc` when its fast path is taken. The first one is the
+// fallthrough, if the instruction has one.
+static
+int spec_successors(Proto *f, int pc, int *succ, int *has_fallthrough)
+{
+    Instruction instr = f->code[pc];
+    OpCode op = GET_OPCODE(instr);
+    *has_fallthrough = 1;
+    if (is_conditional(op)) {
+        succ[0] = pc + 2;
+        succ[1] = jump_target(f, pc+1);
+        return 2;
+    }
+    switch (op) {
+        case OP_JMP:
+            *has_fallthrough = 0;
+            succ[0] = jump_target(f, pc);
+            return 1;
+        case OP_FORLOOP:
+            succ[0] = pc + 1;
+            succ[1] = (pc+1) - GETARG_Bx(instr);
+            return 2;
+        default:
+            succ[0] = spec_next(f, pc);
+            return 1;
+    }
+}
+
+// Whether the generic code would call updatetrap when following this edge.
+static
+int spec_edge_is_jump(Proto *f, int pc, int j)
+{
+    OpCode op = GET_OPCODE(f->code[pc]);
+    return (op == OP_JMP || (op == OP_FORLOOP && j == 0) || (is_conditional(op) && j == 1));
+}
+
+static
+int spec_is_bitwise(OpCode op)
+{
+    switch (op) {
+        case OP_BAND: case OP_BOR: case OP_BXOR: case OP_SHL: case OP_SHR:
+        case OP_BANDK: case OP_BORK: case OP_BXORK: case OP_SHRI: case OP_SHLI:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+// Returns 0 if the instruction cannot be specialized with the register types
+// in `st`, 2 if it is a numeric operation that benefits from it, or 1 if it
+// can merely be part of a specialized region.
+static
+int spec_kind(Proto *f, int pc, const TypeSet *st)
+{
+    Instruction instr = f->code[pc];
+    OpCode op = GET_OPCODE(instr);
+    int a = GETARG_A(instr);
+
+    // Folded instructions are already as simple as they get.
+    if (folded_succ[pc] >= 0 || folded_value[pc] != CONST_ANY) return 0;
+
+    if (is_arith_with_mmbin(op)) {
+        TypeSet tb = st[GETARG_B(instr)];
+        TypeSet tc = arith_operand2_type(f, instr, st);
+        if (!is_exact_type(tb) || !is_exact_type(tc)) return 0;
+        if (spec_is_bitwise(op)) return (tb == T_INT && tc == T_INT) ? 2 : 0;
+        if ((op == OP_MODK || op == OP_IDIVK) && tb == T_INT && tc == T_INT) {
+            return (ivalue(&f->k[GETARG_C(instr)]) != 0) ? 2 : 0;
+        }
+        return 2;
+    }
+
+    switch (op) {
+        case OP_MOVE:
+            return is_exact_type(st[GETARG_B(instr)]) ? 1 : 0;
+        case OP_LOADI:
+        case OP_LOADF:
+        case OP_JMP:
+            return 1;
+        case OP_LOADK:
+            return is_exact_type(constant_type(f, GETARG_Bx(instr))) ? 1 : 0;
+        case OP_UNM:
+            return is_exact_type(st[GETARG_B(instr)]) ? 2 : 0;
+        case OP_EQ:
+            return (is_exact_type(st[a]) && st[a] == st[GETARG_B(instr)]) ? 2 : 0;
+        case OP_LT:
+        case OP_LE:
+            return (is_exact_type(st[a]) && is_exact_type(st[GETARG_B(instr)])) ? 2 : 0;
+        case OP_EQK:
+            return (is_exact_type(st[a]) && st[a] == constant_type(f, GETARG_B(instr))) ? 2 : 0;
+        case OP_EQI: case OP_LTI: case OP_LEI: case OP_GTI: case OP_GEI:
+            return is_exact_type(st[a]) ? 2 : 0;
+        case OP_FORLOOP:
+            return (is_exact_type(st[a]) && st[a] == st[a+1] && st[a] == st[a+2]) ? 2 : 0;
+        default:
+            return 0;
+    }
+}
+
+static
+void build_predecessors(Proto *f)
+{
+    free(pred_start);
+    free(pred_list);
+    pred_start = calloc(f->sizecode + 2, sizeof(int));
+    pred_list = malloc((2 * f->sizecode + 1) * sizeof(int));
+    if (!pred_start || !pred_list) { fatal_error("out of memory"); }
+
+    int succ[2];
+    for (int pc = 0; pc < f->sizecode; pc++) {
+        int n = instruction_successors(f, pc, succ);
+        for (int j = 0; j < n; j++) {
+            if (0 <= succ[j] && succ[j] < f->sizecode) pred_start[succ[j] + 1]++;
+        }
+    }
+    for (int pc = 0; pc < f->sizecode; pc++) {
+        pred_start[pc + 1] += pred_start[pc];
+    }
+    int *fill = calloc(f->sizecode + 1, sizeof(int));
+    if (!fill) { fatal_error("out of memory"); }
+    for (int pc = 0; pc < f->sizecode; pc++) {
+        int n = instruction_successors(f, pc, succ);
+        for (int j = 0; j < n; j++) {
+            int s = succ[j];
+            if (0 <= s && s < f->sizecode) pred_list[pred_start[s] + fill[s]++] = pc;
+        }
+    }
+    free(fill);
+}
+
+// The metamethod fallback of an arithmetic instruction and the jump after a
+// test belong to the region of the instruction before them.
+static
+int is_in_region(Proto *f, int pc, int start)
+{
+    if (region_of[pc] == start) return 1;
+    if (pc > 0 && region_of[pc-1] == start) {
+        OpCode prev = GET_OPCODE(f->code[pc-1]);
+        return (is_arith_with_mmbin(prev) || is_conditional(prev));
+    }
+    return 0;
+}
+
+// Grows a region starting at `start`, for as long as we can specialize the
+// instructions. Stops before instructions that are reachable from outside the
+// region, so they can start their own region. Returns where to continue.
+static
+int plan_region(Proto *f, int start)
+{
+    int nregs = types_nregs;
+    TypeSet *st = malloc(nregs + 1);
+    if (!st) { fatal_error("out of memory"); }
+
+    region_reached[start] = 1;
+    memcpy(REGION_TYPES(start), TYPES_AT(start), nregs);
+    narrow_from_profile(f, start, REGION_TYPES(start));
+
+    int last = -1;
+    int useful = 0;
+    int farthest = start;
+    int pc;
+    for (pc = start; pc < f->sizecode; pc++) {
+        if (!region_reached[pc]) {
+            if (is_in_region(f, pc, start)) continue;
+            break;
+        }
+        if (pc != start) {
+            int outside = 0;
+            for (int j = pred_start[pc]; j < pred_start[pc+1]; j++) {
+                if (!is_in_region(f, pred_list[j], start)) outside = 1;
+            }
+            if (outside) break;
+        }
+        TypeSet *types = REGION_TYPES(pc);
+        int kind = spec_kind(f, pc, types);
+        if (kind == 0) break;
+        if (kind == 2) useful = 1;
+        region_of[pc] = start;
+        last = pc;
+
+        int succ[2], fall;
+        int n = spec_successors(f, pc, succ, &fall);
+        for (int j = 0; j < n; j++) {
+            int s = succ[j];
+            if (s <= pc || s >= f->sizecode) continue;
+            memcpy(st, types, nregs);
+            infer_edge(f, pc, s, st);
+            TypeSet *dst = REGION_TYPES(s);
+            if (!region_reached[s]) {
+                region_reached[s] = 1;
+                memcpy(dst, st, nregs);
+            } else {
+                for (int r = 0; r < nregs; r++) dst[r] |= st[r];
+            }
+            if (s > farthest) farthest = s;
+        }
+    }
+
+    if (useful) {
+        region_end[start] = last;
+    } else {
+        for (int p = start; p <= last; p++) {
+            if (region_of[p] == start) region_of[p] = -1;
+        }
+    }
+    for (int p = start; p <= farthest; p++) {
+        if (region_of[p] != start) region_reached[p] = 0;
+    }
+
+    free(st);
+    return (last < 0 ? start + 1 : pc);
+}
+
+static
+void plan_regions(Proto *f)
+{
+    int nregs = types_nregs;
+    free(region_end);
+    free(region_of);
+    free(region_reached);
+    free(region_types);
+    free(region_dirty);
+    free(spec_live_in);
+    free(spec_written);
+    free(spec_dirty);
+    free(spec_label);
+    region_end = malloc(f->sizecode * sizeof(int));
+    region_of = malloc(f->sizecode * sizeof(int));
+    region_reached = calloc(f->sizecode, 1);
+    region_types = calloc((size_t)f->sizecode * nregs + 1, sizeof(TypeSet));
+    region_dirty = calloc((size_t)f->sizecode * nregs + 1, sizeof(TypeSet));
+    spec_live_in = malloc(nregs + 1);
+    spec_written = malloc(nregs + 1);
+    spec_dirty = malloc(nregs + 1);
+    spec_label = calloc(f->sizecode, 1);
+    if (!region_end || !region_of || !region_reached || !region_types || !region_dirty ||
+        !spec_live_in || !spec_written || !spec_dirty || !spec_label) {
+        fatal_error("out of memory");
+    }
+
+    build_predecessors(f);
+    for (int pc = 0; pc < f->sizecode; pc++) {
+        region_end[pc] = -1;
+        region_of[pc] = -1;
+    }
+
+    int pc = 0;
+    while (pc < f->sizecode) {
+        if (types_reached[pc]) {
+            pc = plan_region(f, pc);
+        } else {
+            pc++;
+        }
+    }
+}
+
+static int spec_indent = 6;
+
+static
+__attribute__ ((format (printf, 1, 2)))
+void spec_println(const char *fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    fprintf(output_file, "%*s", spec_indent, "");
+    vfprintf(output_file, fmt, args);
+    va_end(args);
+    fprintf(output_file, "\n");
+}
+
+//
+// C expressions for the operands of specialized instructions. They are
+// stored in a small ring of buffers, so a few of them may be used at once.
+//
+
+static
+char *spec_buffer()
+{
+    static char buffers[8][128];
+    static int n = 0;
+    return buffers[n++ % 8];
+}
+
+static
+const char *spec_reg(int r, TypeSet t)
+{
+    char *buf = spec_buffer();
+    snprintf(buf, 128, "%creg_%d", (t == T_INT ? 'i' : 'f'), r);
+    return buf;
+}
+
+static
+const char *spec_constant(Proto *f, int kidx)
+{
+    const TValue *o = &f->k[kidx];
+    char *buf = spec_buffer();
+    if (ttisinteger(o)) {
+        lua_Integer n = ivalue(o);
+        if (n == LUA_MININTEGER) {
+            snprintf(buf, 128, "LUA_MININTEGER");
+        } else {
+            snprintf(buf, 128, "((lua_Integer)" LUA_INTEGER_FMT ")", (LUAI_UACINT)n);
+        }
+    } else {
+        lua_Number n = fltvalue(o);
+        if (n == n && n - n == 0) {
+            snprintf(buf, 128, "(%a)", (double)n);
+        } else {
+            snprintf(buf, 128, "fltvalue(k + %d)", kidx);
+        }
+    }
+    return buf;
+}
+
+static
+const char *spec_integer(int n)
+{
+    char *buf = spec_buffer();
+    snprintf(buf, 128, "((lua_Integer)%d)", n);
+    return buf;
+}
+
+// Converts an operand of type t to a float
+static
+const char *spec_tofloat(const char *e, TypeSet t)
+{
+    if (t == T_FLT) return e;
+    char tmp[128];
+    strcpy(tmp, e);  /* e may come from the same ring of buffers */
+    char *buf = spec_buffer();
+    snprintf(buf, 128, "cast_num(%s)", tmp);
+    return buf;
+}
+
+static
+void spec_set(int r, TypeSet t, const char *e)
+{
+    spec_println("%s = %s;", spec_reg(r, t), e);
+    spec_dirty[r] = t;
+}
+
+static
+void spec_spill_reg(int r)
+{
+    if (spec_dirty[r] == T_INT) {
+        spec_println("setivalue(s2v(base + %d), ireg_%d);", r, r);
+    } else {
+        spec_println("setfltvalue(s2v(base + %d), freg_%d);", r, r);
+    }
+}
+
+// Writes back the registers that the generic code at `target` might read.
+static
+void spec_spill(int target)
+{
+    const char *live = LIVE_AT(target);
+    for (int r = 0; r < types_nregs; r++) {
+        if (spec_dirty[r] && live[r]) spec_spill_reg(r);
+    }
+}
+
+// Before jumping to another part of the region, writes back the registers
+// that the code over there assumes are up to date on the stack.
+static
+void spec_reconcile(int target)
+{
+    const char *live = LIVE_AT(target);
+    const TypeSet *dirty = REGION_DIRTY(target);
+    for (int r = 0; r < types_nregs; r++) {
+        if (spec_dirty[r] && !dirty[r] && live[r]) spec_spill_reg(r);
+    }
+}
+
+// Whether the registers that are kept in C variables have the right types to
+// jump back to the start of the region.
+static
+int spec_can_loop(int target, const TypeSet *st)
+{
+    if (target != spec_start) return 0;
+    for (int r = 0; r < types_nregs; r++) {
+        if (spec_live_in[r] && spec_live_in[r] != st[r]) return 0;
+    }
+    return 1;
+}
+
+// Follows an edge from `pc` to `target`. `st` are the types after the edge.
+static
+void spec_edge(int pc, int target, int is_jump, const TypeSet *st)
+{
+    if (spec_can_loop(target, st)) {
+        if (is_jump) {
+            if (!no_hooks) {
+                spec_println("updatetrap(ci);");
+                spec_println("if (l_unlikely(trap)) {");
+                spec_indent += 2;
+                spec_spill(target);
+                spec_println("goto label_%02d;", target);
+                spec_indent -= 2;
+                spec_println("}");
+            }
+        }
+        spec_reconcile(target);
+        spec_println("goto spec_%02d;", target);
+    } else if (target > pc && region_of[target] == spec_start) {
+        spec_reconcile(target);
+        spec_println("goto spec_%02d;", target);
+    } else {
+        spec_spill(target);
+        if (is_jump && !no_hooks) {
+            spec_println("updatetrap(ci);");
+        }
+        spec_println("goto label_%02d;", target);
+    }
+}
+
+// Jumps back to the generic version of the current instruction.
+static
+void spec_side_exit(int pc)
+{
+    spec_spill(pc);
+    if (pc == spec_start) {
+        side_exit_to_start = 1;
+        spec_println("goto generic_%02d;", pc);
+    } else {
+        spec_println("goto label_%02d;", pc);
+    }
+}
+
+static
+void spec_arith(Proto *f, int pc, const TypeSet *st)
+{
+    Instruction instr = f->code[pc];
+    OpCode op = GET_OPCODE(instr);
+    int a = GETARG_A(instr);
+    TypeSet tb = st[GETARG_B(instr)];
+    TypeSet tc = arith_operand2_type(f, instr, st);
+    TypeSet tr = arith_result_type(op, tb, tc);
+
+    const char *vb = spec_reg(GETARG_B(instr), tb);
+    const char *vc;
+    switch (op) {
+        case OP_ADDI: case OP_SHRI: case OP_SHLI:
+            vc = spec_integer(GETARG_sC(instr));
+            break;
+        case OP_ADDK: case OP_SUBK: case OP_MULK: case OP_MODK:
+        case OP_POWK: case OP_DIVK: case OP_IDIVK:
+        case OP_BANDK: case OP_BORK: case OP_BXORK:
+            vc = spec_constant(f, GETARG_C(instr));
+            break;
+        default:
+            vc = spec_reg(GETARG_C(instr), tc);
+            break;
+    }
+
+    const char *iop = NULL;
+    const char *fop = NULL;
+    switch (op) {
+        case OP_ADD: case OP_ADDI: case OP_ADDK: iop = "l_addi";   fop = "luai_numadd";  break;
+        case OP_SUB: case OP_SUBK:               iop = "l_subi";   fop = "luai_numsub";  break;
+        case OP_MUL: case OP_MULK:               iop = "l_muli";   fop = "luai_nummul";  break;
+        case OP_MOD: case OP_MODK:               iop = "luaV_mod"; fop = "luaV_modf";    break;
+        case OP_IDIV: case OP_IDIVK:             iop = "luaV_idiv"; fop = "luai_numidiv"; break;
+        case OP_DIV: case OP_DIVK:               fop = "luai_numdiv"; break;
+        case OP_POW: case OP_POWK:               fop = "luai_numpow"; break;
+        default: break;
+    }
+
+    char expr[512];
+    if (spec_is_bitwise(op)) {
+        switch (op) {
+            case OP_BAND: case OP_BANDK: snprintf(expr, sizeof(expr), "l_band(%s, %s)", vb, vc); break;
+            case OP_BOR:  case OP_BORK:  snprintf(expr, sizeof(expr), "l_bor(%s, %s)", vb, vc); break;
+            case OP_BXOR: case OP_BXORK: snprintf(expr, sizeof(expr), "l_bxor(%s, %s)", vb, vc); break;
+            case OP_SHL:  snprintf(expr, sizeof(expr), "luaV_shiftl(%s, %s)", vb, vc); break;
+            case OP_SHR:  snprintf(expr, sizeof(expr), "luaV_shiftr(%s, %s)", vb, vc); break;
+            case OP_SHRI: snprintf(expr, sizeof(expr), "luaV_shiftl(%s, -%s)", vb, vc); break;
+            case OP_SHLI: snprintf(expr, sizeof(expr), "luaV_shiftl(%s, %s)", vc, vb); break;
+            default: fatal_error("impossible");
+        }
+    } else if (tr == T_INT) {
+        if (op == OP_MOD || op == OP_IDIV) {
+            // Let the generic code raise the division by zero error
+            spec_println("if (l_unlikely(%s == 0)) {", vc);
+            spec_indent += 2;
+            spec_side_exit(pc);
+            spec_indent -= 2;
+            spec_println("}");
+        }
+        snprintf(expr, sizeof(expr), "%s(L, %s, %s)", iop, vb, vc);
+    } else {
+        snprintf(expr, sizeof(expr), "%s(L, %s, %s)", fop, spec_tofloat(vb, tb), spec_tofloat(vc, tc));
+    }
+    spec_set(a, tr, expr);
+}
+
+// Prints the jump that is taken when a test does not fall through.
+static
+void spec_condjump(Proto *f, int pc, const char *cond, const TypeSet *st)
+{
+    Instruction instr = f->code[pc];
+    const char *hint = jump_hint(pc);
+    if (hint[0]) {
+        spec_println("if (%s(%s(%s))) {", hint, (GETARG_k(instr) ? "" : "!"), cond);
+    } else {
+        spec_println("if (%s(%s)) {", (GETARG_k(instr) ? "" : "!"), cond);
+    }
+    spec_indent += 2;
+    spec_edge(pc, jump_target(f, pc+1), 1, st);
+    spec_indent -= 2;
+    spec_println("}");
+}
+
+static
+void spec_compare(Proto *f, int pc, const TypeSet *st)
+{
+    Instruction instr = f->code[pc];
+    OpCode op = GET_OPCODE(instr);
+    int a = GETARG_A(instr);
+    TypeSet ta = st[a];
+    const char *va = spec_reg(a, ta);
+
+    char cond[512];
+    switch (op) {
+        case OP_EQ:
+        case OP_EQK: {
+            const char *vb = (op == OP_EQ)
+                ? spec_reg(GETARG_B(instr), ta)
+                : spec_constant(f, GETARG_B(instr));
+            snprintf(cond, sizeof(cond), "%s == %s", va, vb);
+            break;
+        }
+        case OP_LT:
+        case OP_LE: {
+            TypeSet tb = st[GETARG_B(instr)];
+            const char *vb = spec_reg(GETARG_B(instr), tb);
+            const char *name = (op == OP_LT) ? "LT" : "LE";
+            const char *sym  = (op == OP_LT) ? "<" : "<=";
+            if (ta == T_INT && tb == T_INT) {
+                snprintf(cond, sizeof(cond), "%s %s %s", va, sym, vb);
+            } else if (ta == T_FLT && tb == T_FLT) {
+                snprintf(cond, sizeof(cond), "luai_num%s(%s, %s)", (op == OP_LT ? "lt" : "le"), va, vb);
+            } else if (ta == T_INT) {
+                snprintf(cond, sizeof(cond), "%sintfloat(%s, %s)", name, va, vb);
+            } else {
+                snprintf(cond, sizeof(cond), "%sfloatint(%s, %s)", name, va, vb);
+            }
+            break;
+        }
+        default: {
+            const char *sym;
+            switch (op) {
+                case OP_EQI: sym = "=="; break;
+                case OP_LTI: sym = "<";  break;
+                case OP_LEI: sym = "<="; break;
+                case OP_GTI: sym = ">";  break;
+                case OP_GEI: sym = ">="; break;
+                default: fatal_error("impossible"); return;
+            }
+            const char *vim = spec_integer(GETARG_sB(instr));
+            snprintf(cond, sizeof(cond), "%s %s %s", va, sym, spec_tofloat(vim, ta));
+            break;
+        }
+    }
+    spec_condjump(f, pc, cond, st);
+}
+
+static
+void spec_forloop(Proto *f, int pc, const TypeSet *st)
+{
+    Instruction instr = f->code[pc];
+    int a = GETARG_A(instr);
+    int loop = (pc+1) - GETARG_Bx(instr);
+    TypeSet *dirty = malloc(types_nregs + 1);
+    TypeSet *back = malloc(types_nregs + 1);
+    if (!dirty || !back) { fatal_error("out of memory"); }
+    memcpy(dirty, spec_dirty, types_nregs);
+    memcpy(back, st, types_nregs);
+    infer_edge(f, pc, loop, back);
+
+    spec_println("{");
+    spec_indent += 2;
+    if (st[a] == T_INT) {
+        spec_println("lua_Unsigned count = l_castS2U(ireg_%d);", a+1);
+        spec_println("if (count > 0) {  /* still more iterations? */");
+        spec_indent += 2;
+        spec_set(a+1, T_INT, "l_castU2S(count - 1)");
+        spec_println("ireg_%d = intop(+, ireg_%d, ireg_%d);", a, a, a+2);
+        spec_dirty[a] = T_INT;
+        spec_set(a+3, T_INT, spec_reg(a, T_INT));
+    } else {
+        spec_println("lua_Number step = freg_%d;", a+2);
+        spec_println("lua_Number limit = freg_%d;", a+1);
+        spec_println("lua_Number idx = luai_numadd(L, freg_%d, step);", a);
+        spec_println("if (luai_numlt(0, step) ? luai_numle(idx, limit) : luai_numle(limit, idx)) {");
+        spec_indent += 2;
+        spec_set(a, T_FLT, "idx");
+        spec_set(a+3, T_FLT, "idx");
+    }
+    spec_edge(pc, loop, 1, back);
+    spec_indent -= 2;
+    spec_println("}");
+    spec_indent -= 2;
+    spec_println("}");
+    memcpy(spec_dirty, dirty, types_nregs);
+
+    free(dirty);
+    free(back);
+}
+
+// Registers that a specialized instruction reads, and the registers that it
+// writes when control flows to `target`, with their new types.
+static
+void spec_uses_defs(Proto *f, int pc, int target, const TypeSet *st, char *use, TypeSet *def)
+{
+    Instruction instr = f->code[pc];
+    OpCode op = GET_OPCODE(instr);
+    int a = GETARG_A(instr);
+    int b = GETARG_B(instr);
+    memset(use, 0, types_nregs);
+    memset(def, 0, types_nregs);
+    if (is_arith_with_mmbin(op)) {
+        use[b] = 1;
+        if (OP_ADD <= op && op <= OP_SHR) use[GETARG_C(instr)] = 1;
+        def[a] = arith_result_type(op, st[b], arith_operand2_type(f, instr, st));
+        return;
+    }
+    switch (op) {
+        case OP_MOVE: case OP_UNM:
+            use[b] = 1; def[a] = st[b]; break;
+        case OP_LOADI:
+            def[a] = T_INT; break;
+        case OP_LOADF:
+            def[a] = T_FLT; break;
+        case OP_LOADK:
+            def[a] = constant_type(f, GETARG_Bx(instr)); break;
+        case OP_EQ: case OP_LT: case OP_LE:
+            use[a] = 1; use[b] = 1; break;
+        case OP_EQK: case OP_EQI: case OP_LTI: case OP_LEI: case OP_GTI: case OP_GEI:
+            use[a] = 1; break;
+        case OP_FORLOOP:
+            use[a] = 1; use[a+1] = 1; use[a+2] = 1;
+            if (target != pc + 1) {
+                def[a] = st[a]; def[a+1] = st[a]; def[a+3] = st[a];
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+// Computes the live-in registers, the written registers, the labels, and the
+// dirty registers at each instruction of the region.
+static
+void spec_setup(Proto *f, int start)
+{
+    int nregs = types_nregs;
+    int end = region_end[start];
+    int size = end - start + 1;
+    char *live = calloc((size_t)size * nregs + 1, 1);
+    char *dirty_init = calloc(size, 1);
+    char *use = malloc(nregs + 1);
+    TypeSet *def = malloc(nregs + 1);
+    TypeSet *st = malloc(nregs + 1);
+    if (!live || !dirty_init || !use || !def || !st) { fatal_error("out of memory"); }
+
+    #define IS_MEMBER(p) ((p) >= start && (p) <= end && region_of[p] == start)
+    #define LIVE(p) (live + (size_t)((p) - start) * nregs)
+
+    int succ[2], fall;
+
+    // Registers that may be read before being written, going backwards
+    for (int pc = end; pc >= start; pc--) {
+        if (!IS_MEMBER(pc)) continue;
+        char *lv = LIVE(pc);
+        int n = spec_successors(f, pc, succ, &fall);
+        for (int j = 0; j < n; j++) {
+            int s = succ[j];
+            if (s > pc && IS_MEMBER(s)) {
+                for (int r = 0; r < nregs; r++) lv[r] |= LIVE(s)[r];
+            }
+        }
+        spec_uses_defs(f, pc, succ[0], REGION_TYPES(pc), use, def);
+        for (int r = 0; r < nregs; r++) {
+            lv[r] = use[r] || (lv[r] && !def[r]);
+        }
+    }
+    for (int r = 0; r < nregs; r++) {
+        spec_live_in[r] = LIVE(start)[r] ? REGION_TYPES(start)[r] : 0;
+        spec_written[r] = 0;
+    }
+
+    // Written registers, and the jumps inside the region
+    int loops = 0;
+    for (int pc = start; pc <= end; pc++) {
+        if (!IS_MEMBER(pc)) continue;
+        spec_label[pc] = 0;
+    }
+    for (int pc = start; pc <= end; pc++) {
+        if (!IS_MEMBER(pc)) continue;
+        int next = pc + 1;
+        while (next <= end && !IS_MEMBER(next)) next++;
+        int n = spec_successors(f, pc, succ, &fall);
+        for (int j = 0; j < n; j++) {
+            int s = succ[j];
+            spec_uses_defs(f, pc, s, REGION_TYPES(pc), use, def);
+            for (int r = 0; r < nregs; r++) spec_written[r] |= def[r];
+            memcpy(st, REGION_TYPES(pc), nregs);
+            infer_edge(f, pc, s, st);
+            if (spec_can_loop(s, st)) {
+                loops = 1;
+            } else if (s > pc && IS_MEMBER(s) && !(j == 0 && fall && s == next)) {
+                spec_label[s] = 1;
+            }
+        }
+    }
+    spec_label[start] = loops;
+
+    // When we jump back to the start, the live-in registers that the loop
+    // modifies are only up to date in the C variables. Other registers are
+    // dirty if they are dirty in all the paths that lead to the instruction.
+    TypeSet *dirty = REGION_DIRTY(start);
+    for (int r = 0; r < nregs; r++) {
+        dirty[r] = (loops && spec_written[r]) ? spec_live_in[r] : 0;
+    }
+    dirty_init[0] = 1;
+    for (int pc = start; pc <= end; pc++) {
+        if (!IS_MEMBER(pc)) continue;
+        int n = spec_successors(f, pc, succ, &fall);
+        for (int j = 0; j < n; j++) {
+            int s = succ[j];
+            if (!(s > pc && IS_MEMBER(s))) continue;
+            spec_uses_defs(f, pc, s, REGION_TYPES(pc), use, def);
+            TypeSet *dst = REGION_DIRTY(s);
+            const TypeSet *types = REGION_TYPES(s);
+            for (int r = 0; r < nregs; r++) {
+                TypeSet d = def[r] ? def[r] : REGION_DIRTY(pc)[r];
+                if (!dirty_init[s - start]) {
+                    dst[r] = d;
+                } else if (dst[r] != d) {
+                    dst[r] = 0;
+                }
+                if (!is_exact_type(types[r])) dst[r] = 0;
+            }
+            dirty_init[s - start] = 1;
+        }
+    }
+
+    #undef IS_MEMBER
+    #undef LIVE
+
+    free(live);
+    free(dirty_init);
+    free(use);
+    free(def);
+    free(st);
+}
+
+static
+void create_region(Proto *f, int start)
+{
+    int nregs = types_nregs;
+    int end = region_end[start];
+    TypeSet *next_st = malloc(nregs + 1);
+    if (!next_st) { fatal_error("out of memory"); }
+    spec_start = start;
+    spec_setup(f, start);
+
+    print("    if (l_likely(!trap");
+    for (int r = 0; r < nregs; r++) {
+        if (spec_live_in[r] == T_INT) print(" && ttisinteger(s2v(base + %d))", r);
+        if (spec_live_in[r] == T_FLT) print(" && ttisfloat(s2v(base + %d))", r);
+    }
+    println(")) {");
+    spec_println("/* specialized code for instructions %d to %d */", start, end);
+    for (int r = 0; r < nregs; r++) {
+        TypeSet t = spec_written[r] | spec_live_in[r];
+        if (t & T_INT) spec_println("lua_Integer ireg_%d;", r);
+        if (t & T_FLT) spec_println("lua_Number freg_%d;", r);
+    }
+    for (int r = 0; r < nregs; r++) {
+        if (spec_live_in[r] == T_INT) spec_println("ireg_%d = ivalue(s2v(base + %d));", r, r);
+        if (spec_live_in[r] == T_FLT) spec_println("freg_%d = fltvalue(s2v(base + %d));", r, r);
+    }
+
+    side_exit_to_start = 0;
+    int falls_into = 0;  // Whether the previous instruction falls through to pc
+    for (int pc = start; pc <= end; pc++) {
+        if (region_of[pc] != start) continue;
+        Instruction instr = f->code[pc];
+        OpCode op = GET_OPCODE(instr);
+        int a = GETARG_A(instr);
+        const TypeSet *st = REGION_TYPES(pc);
+
+        if (pc != start && falls_into) {
+            spec_reconcile(pc);
+        }
+        if (spec_label[pc]) {
+            println("    spec_%02d:", pc);
+        }
+        memcpy(spec_dirty, REGION_DIRTY(pc), nregs);
+
+        if (is_arith_with_mmbin(op)) {
+            spec_arith(f, pc, st);
+        } else {
+            switch (op) {
+                case OP_MOVE:
+                    spec_set(a, st[GETARG_B(instr)], spec_reg(GETARG_B(instr), st[GETARG_B(instr)]));
+                    break;
+                case OP_LOADI:
+                    spec_set(a, T_INT, spec_integer(GETARG_sBx(instr)));
+                    break;
+                case OP_LOADF:
+                    spec_set(a, T_FLT, spec_tofloat(spec_integer(GETARG_sBx(instr)), T_INT));
+                    break;
+                case OP_LOADK:
+                    spec_set(a, constant_type(f, GETARG_Bx(instr)), spec_constant(f, GETARG_Bx(instr)));
+                    break;
+                case OP_UNM: {
+                    TypeSet tb = st[GETARG_B(instr)];
+                    const char *vb = spec_reg(GETARG_B(instr), tb);
+                    char expr[256];
+                    if (tb == T_INT) {
+                        snprintf(expr, sizeof(expr), "intop(-, 0, %s)", vb);
+                    } else {
+                        snprintf(expr, sizeof(expr), "luai_numunm(L, %s)", vb);
+                    }
+                    spec_set(a, tb, expr);
+                    break;
+                }
+                case OP_JMP:
+                    spec_edge(pc, jump_target(f, pc), 1, st);
+                    break;
+                case OP_FORLOOP:
+                    spec_forloop(f, pc, st);
+                    break;
+                default:
+                    spec_compare(f, pc, st);
+                    break;
+            }
+        }
+
+        // Continue with the fallthrough, if it is the next thing we emit
+        int succ[2], fall;
+        spec_successors(f, pc, succ, &fall);
+        int next = pc + 1;
+        while (next <= end && region_of[next] != start) next++;
+        falls_into = 0;
+        if (fall) {
+            if (succ[0] == next && next <= end) {
+                falls_into = 1;
+            } else {
+                memcpy(next_st, st, nregs);
+                infer_edge(f, pc, succ[0], next_st);
+                spec_edge(pc, succ[0], spec_edge_is_jump(f, pc, 0), next_st);
+            }
+        }
+    }
+    println("    }");
+    if (side_exit_to_start) {
+        println("    generic_%02d:", start);
+    }
+
+    free(next_st);
+}
+
+//
+// Counted loops
+// -------------
+// A numeric for loop whose initial value and step are integers keeps its
+// counter, index and step in C variables, named after the OP_FORPREP, so that
+// OP_FORLOOP does not have to check the step's tag and load them from the
+// stack at every iteration. If the body of the loop is part of a specialized
+// region, the region already does that with its own variables, so we leave it
+// alone.
+//
+// We still write the stack copies if the body might yield or run a hook,
+// because then the interpreter may finish the loop. When we resume after a
+// call inside the loop, we reload the C variables from the stack.
+//
+
+#define LOOP_NONE    0
+#define LOOP_CHECKED 1  // The step must be checked at run time
+#define LOOP_INT     2  // The type inference says it is an integer loop
+
+static char *counted_loop = NULL;  // For each OP_FORPREP
+static char *loop_stores = NULL;   // Whether to keep the stack copies up to date
+
+//
+// Inside an integer loop, t[i] with the loop variable as the key, and a table
+// that the loop does not assign to, uses the array part of the table directly.
+// Its address and size are kept in C variables, named after the loop and the
+// table's register. They are loaded by the first access, and forgotten by
+// anything that might resize a table or run other code: calls, metamethods,
+// and the slow paths of the other table accesses. Hooks might change the
+// register, so we do not trust the C variables while they are on.
+//
+
+static char *loop_hoists = NULL;   // Per OP_FORPREP and register: whether it is hoisted
+static int  *hoisted_get = NULL;   // For each OP_GETTABLE, its loop, or -1
+
+#define LOOP_HOIST(forprep, r) (loop_hoists[(size_t)(forprep) * types_nregs + (r)])
+
+// Instructions that never call a metamethod or another Lua function.
+static
+int cannot_suspend(Proto *f, int pc)
+{
+    switch (GET_OPCODE(f->code[pc])) {
+        case OP_MOVE: case OP_LOADI: case OP_LOADF: case OP_LOADK: case OP_LOADKX:
+        case OP_LOADFALSE: case OP_LFALSESKIP: case OP_LOADTRUE: case OP_LOADNIL:
+        case OP_GETUPVAL: case OP_SETUPVAL: case OP_NEWTABLE: case OP_CLOSURE:
+        case OP_NOT: case OP_JMP: case OP_TEST: case OP_TESTSET:
+        case OP_EQK: case OP_EQI: case OP_FORPREP: case OP_FORLOOP:
+        case OP_EXTRAARG:
+            return 1;
+        default:
+            // Arithmetic that never falls back to OP_MMBIN is also fine,
+            // but only the profile-free type inference can tell us that.
+            return (!current_profile && !types_reached[pc]);
+    }
+}
+
+static
+void plan_counted_loops(Proto *f)
+{
+    free(counted_loop);
+    free(loop_stores);
+    counted_loop = calloc(f->sizecode, 1);
+    loop_stores = calloc(f->sizecode, 1);
+    if (!counted_loop || !loop_stores) { fatal_error("out of memory"); }
+
+    for (int pc = 0; pc < f->sizecode; pc++) {
+        Instruction instr = f->code[pc];
+        if (GET_OPCODE(instr) != OP_FORPREP) continue;
+        int a = GETARG_A(instr);
+        int forloop = pc + 1 + GETARG_Bx(instr);
+        if (region_of[forloop] >= 0 && region_of[forloop] != forloop) continue;
+        if (region_of[forloop] == forloop) {
+            // A region with just the OP_FORLOOP. It reloads everything
+            // from the stack, so this is better.
+            region_end[forloop] = -1;
+            region_of[forloop] = -1;
+        }
+
+        const TypeSet *st = TYPES_AT(pc);
+        if (!current_profile && types_reached[pc] && st[a] == T_INT && st[a+2] == T_INT) {
+            counted_loop[pc] = LOOP_INT;
+        } else {
+            counted_loop[pc] = LOOP_CHECKED;
+        }
+        loop_stores[pc] = !no_hooks;
+        for (int p = pc + 1; p < forloop; p++) {
+            if (!cannot_suspend(f, p)) loop_stores[pc] = 1;
+        }
+    }
+
+    free(loop_hoists);
+    free(hoisted_get);
+    loop_hoists = calloc((size_t)f->sizecode * types_nregs + 1, 1);
+    hoisted_get = malloc(f->sizecode * sizeof(int));
+    if (!loop_hoists || !hoisted_get) { fatal_error("out of memory"); }
+
+    for (int pc = 0; pc < f->sizecode; pc++) {
+        hoisted_get[pc] = -1;
+    }
+    for (int pc = 0; pc < f->sizecode; pc++) {
+        if (counted_loop[pc] != LOOP_INT) continue;
+        int var = GETARG_A(f->code[pc]) + 3;
+        int forloop = pc + 1 + GETARG_Bx(f->code[pc]);
+        int assigned = 0;
+        for (int p = pc + 1; p < forloop; p++) {
+            if (instruction_may_write(f, p, var)) assigned = 1;
+        }
+        if (assigned) continue;
+        for (int p = pc + 1; p < forloop; p++) {
+            Instruction instr = f->code[p];
+            if (GET_OPCODE(instr) != OP_GETTABLE || GETARG_C(instr) != var) continue;
+            int t = GETARG_B(instr);
+            int written = 0;
+            for (int q = pc + 1; q < forloop; q++) {
+                if (instruction_may_write(f, q, t)) written = 1;
+            }
+            if (written) continue;
+            hoisted_get[p] = pc;
+            LOOP_HOIST(pc, t) = 1;
+        }
+    }
+}
+
+// Instructions that might run other code, which might resize a table. The
+// table accesses do it only in their slow path, and the arithmetic only in
+// the OP_MMBIN that follows it.
+static
+int may_run_code(Proto *f, int pc)
+{
+    OpCode op = GET_OPCODE(f->code[pc]);
+    switch (op) {
+        case OP_GETTABUP: case OP_GETTABLE: case OP_GETI: case OP_GETFIELD:
+        case OP_SETTABUP: case OP_SETTABLE: case OP_SETI: case OP_SETFIELD:
+        case OP_SELF:
+            return 0;
+        default:
+            if (OP_ADDI <= op && op <= OP_SHR) return 0;
+            return !cannot_suspend(f, pc);
+    }
+}
+
+// Forgets the arrays that the loops around `pc` have hoisted.
+static
+void print_forget_arrays(Proto *f, int pc, const char *indent)
+{
+    for (int p = 0; p < pc; p++) {
+        if (counted_loop[p] != LOOP_INT) continue;
+        if (pc > p + 1 + GETARG_Bx(f->code[p])) continue;
+        for (int r = 0; r < types_nregs; r++) {
+            if (LOOP_HOIST(p, r)) println("%slooplim_%02d_%d = 0;", indent, p, r);
+        }
+    }
+}
+
+// Loads the C variables of the loop that starts at `forprep` from the stack.
+static
+void print_loop_load(Proto *f, int forprep, const char *indent)
+{
+    int a = GETARG_A(f->code[forprep]);
+    if (counted_loop[forprep] == LOOP_CHECKED) {
+        println("%sif (ttisinteger(s2v(base + %d))) {", indent, a+2);
+    } else {
+        println("%s{", indent);
+    }
+    println("%s  forcount_%02d = l_castS2U(ivalue(s2v(base + %d)));", indent, forprep, a+1);
+    println("%s  foridx_%02d = ivalue(s2v(base + %d));", indent, forprep, a);
+    println("%s  forstep_%02d = ivalue(s2v(base + %d));", indent, forprep, a+2);
+    println("%s}", indent);
+}
+
+//
+// Inlining
+// --------
+// Calls to small leaf functions, whose callee we can guess (see call_target),
+// are inlined at the call site. The inlined body only has the fast paths of
+// its instructions. If one of them fails, because it would call a metamethod
+// or raise an error, we give up and do the normal call instead. This is safe
+// because until it returns, the body only writes to its own registers, which
+// are C variables. Hooks need a real CallInfo, so if they are on we also do
+// the normal call.
+//
+
+#define INLINE_MAX_INSTRUCTIONS 32
+
+static int inline_site;      // The pc of the OP_CALL that is being inlined
+static int inline_nresults;  // How many results it wants, or -1
+static int inline_can_fail;  // Whether the inlined body has a slow path
+
+static
+int is_inlinable_instruction(Proto *p, int pc)
+{
+    Instruction instr = p->code[pc];
+    switch (GET_OPCODE(instr)) {
+        case OP_MOVE: case OP_LOADI: case OP_LOADF: case OP_LOADK:
+        case OP_LOADFALSE: case OP_LOADTRUE: case OP_LOADNIL:
+        case OP_GETUPVAL: case OP_GETTABUP: case OP_GETTABLE: case OP_GETI: case OP_GETFIELD:
+        case OP_ADDI: case OP_ADDK: case OP_SUBK: case OP_MULK: case OP_POWK: case OP_DIVK:
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_POW: case OP_DIV:
+        case OP_MMBIN: case OP_MMBINI: case OP_MMBINK:
+        case OP_UNM: case OP_NOT:
+        case OP_EQ: case OP_LT: case OP_LE: case OP_EQK: case OP_EQI:
+        case OP_LTI: case OP_LEI: case OP_GTI: case OP_GEI:
+        case OP_TEST: case OP_TESTSET:
+        case OP_RETURN0: case OP_RETURN1:
+            return 1;
+        case OP_JMP:
+            return (GETARG_sJ(instr) >= 0);  // No loops
+        case OP_RETURN:
+            return (!TESTARG_k(instr) && GETARG_B(instr) > 0 && GETARG_C(instr) == 0);
+        default:
+            return 0;
+    }
+}
+
+static
+int is_inlinable(Proto *p)
+{
+    if (p->is_vararg || p->sizecode > INLINE_MAX_INSTRUCTIONS) return 0;
+    for (int pc = 0; pc < p->sizecode; pc++) {
+        if (!is_inlinable_instruction(p, pc)) return 0;
+    }
+    return 1;
+}
+
+static
+void print_inline_fail(const char *cond)
+{
+    println("        if (l_unlikely(%s)) goto inline_fail_%02d;", cond, inline_site);
+    inline_can_fail = 1;
+}
+
+static
+void print_inline_arith(Instruction instr)
+{
+    int site = inline_site;
+    const char *iop = NULL, *fop;
+    switch (GET_OPCODE(instr)) {
+        case OP_ADD: case OP_ADDI: case OP_ADDK: iop = "+"; fop = "luai_numadd"; break;
+        case OP_SUB: case OP_SUBK:               iop = "-"; fop = "luai_numsub"; break;
+        case OP_MUL: case OP_MULK:               iop = "*"; fop = "luai_nummul"; break;
+        case OP_DIV: case OP_DIVK:               fop = "luai_numdiv"; break;
+        default:                                 fop = "luai_numpow"; break;
+    }
+    println("        const TValue *v1 = &in%02d_%d;", site, GETARG_B(instr));
+    switch (GET_OPCODE(instr)) {
+        case OP_ADDI:
+            println("        TValue imm;");
+            println("        setivalue(&imm, %d);", GETARG_sC(instr));
+            println("        const TValue *v2 = &imm;");
+            break;
+        case OP_ADD: case OP_SUB: case OP_MUL: case OP_POW: case OP_DIV:
+            println("        const TValue *v2 = &in%02d_%d;", site, GETARG_C(instr));
+            break;
+        default:
+            println("        const TValue *v2 = &ik[%d];", GETARG_C(instr));
+            break;
+    }
+    if (iop) {
+        println("        if (ttisinteger(v1) && ttisinteger(v2)) {");
+        println("          setivalue(&in%02d_%d, intop(%s, ivalue(v1), ivalue(v2)));", site, GETARG_A(instr), iop);
+        println("        } else {");
+    } else {
+        println("        {");
+    }
+    println("          lua_Number n1, n2;");
+    println("          if (l_unlikely(!tonumberns(v1, n1) || !tonumberns(v2, n2))) goto inline_fail_%02d;", site);
+    println("          setfltvalue(&in%02d_%d, %s(L, n1, n2));", site, GETARG_A(instr), fop);
+    println("        }");
+    inline_can_fail = 1;
+}
+
+// Jumps to the successors of a test, depending on 'cond'.
+static
+void print_inline_condjump(Proto *p, int pc)
+{
+    Instruction instr = p->code[pc];
+    println("        if (cond != %d) goto inline_%02d_%02d;", GETARG_k(instr), inline_site, pc + 2);
+    println("        else goto inline_%02d_%02d;", inline_site, next_jump_target(p, pc));
+}
+
+static
+void print_inline_order(Proto *p, int pc, const char *op)
+{
+    Instruction instr = p->code[pc];
+    int site = inline_site;
+    println("        int cond;");
+    println("        const TValue *v1 = &in%02d_%d;", site, GETARG_A(instr));
+    println("        lua_Integer im = %d;", GETARG_sB(instr));
+    println("        if (ttisinteger(v1)) cond = (ivalue(v1) %s im);", op);
+    println("        else if (ttisfloat(v1)) cond = (fltvalue(v1) %s cast_num(im));", op);
+    println("        else goto inline_fail_%02d;", site);
+    inline_can_fail = 1;
+    print_inline_condjump(p, pc);
+}
+
+// Copies the results of the inlined function to where the caller wants them.
+static
+void print_inline_return(int first, int n)
+{
+    int site = inline_site;
+    if (inline_nresults < 0) {
+        char cond[64];
+        snprintf(cond, sizeof(cond), "L->stack_last - ra <= %d", n);
+        print_inline_fail(cond);
+        for (int j = 0; j < n; j++) {
+            println("        setobj2s(L, ra + %d, &in%02d_%d);", j, site, first + j);
+        }
+        println("        L->top = ra + %d;", n);
+    } else {
+        for (int j = 0; j < inline_nresults; j++) {
+            if (j < n) {
+                println("        setobj2s(L, ra + %d, &in%02d_%d);", j, site, first + j);
+            } else {
+                println("        setnilvalue(s2v(ra + %d));", j);
+            }
+        }
+    }
+    println("        goto label_%02d;", site + 1);
+}
+
+static
+void print_inline_instruction(Proto *p, int pc)
+{
+    Instruction instr = p->code[pc];
+    OpCode op = GET_OPCODE(instr);
+    int site = inline_site;
+    int a = GETARG_A(instr);
+    int b = GETARG_B(instr);
+    int c = GETARG_C(instr);
+
+    if (is_arith_with_mmbin(op)) {
+        print_inline_arith(instr);
+        return;
+    }
+
+    switch (op) {
+        case OP_MOVE:
+            println("        in%02d_%d = in%02d_%d;", site, a, site, b);
+            break;
+        case OP_LOADI:
+            println("        setivalue(&in%02d_%d, %d);", site, a, GETARG_sBx(instr));
+            break;
+        case OP_LOADF:
+            println("        setfltvalue(&in%02d_%d, cast_num(%d));", site, a, GETARG_sBx(instr));
+            break;
+        case OP_LOADK:
+            println("        in%02d_%d = ik[%d];", site, a, GETARG_Bx(instr));
+            break;
+        case OP_LOADFALSE:
+            println("        setbfvalue(&in%02d_%d);", site, a);
+            break;
+        case OP_LOADTRUE:
+            println("        setbtvalue(&in%02d_%d);", site, a);
+            break;
+        case OP_LOADNIL:
+            for (int r = a; r <= a + b; r++) {
+                println("        setnilvalue(&in%02d_%d);", site, r);
+            }
+            break;
+        case OP_GETUPVAL:
+            println("        in%02d_%d = *icl->upvals[%d]->v;", site, a, b);
+            break;
+        case OP_GETTABUP:
+        case OP_GETFIELD: {
+            char t[32];
+            if (op == OP_GETTABUP) {
+                snprintf(t, sizeof(t), "icl->upvals[%d]->v", b);
+            } else {
+                snprintf(t, sizeof(t), "&in%02d_%d", site, b);
+            }
+            println("        const TValue *slot;");
+            println("        if (l_unlikely(!luaV_fastget(L, %s, tsvalue(&ik[%d]), slot, luaH_getshortstr)))", t, c);
+            println("          goto inline_fail_%02d;", site);
+            println("        in%02d_%d = *slot;", site, a);
+            inline_can_fail = 1;
+            break;
+        }
+        case OP_GETI:
+            println("        const TValue *slot;");
+            println("        if (l_unlikely(!luaV_fastgeti(L, &in%02d_%d, %d, slot)))", site, b, c);
+            println("          goto inline_fail_%02d;", site);
+            println("        in%02d_%d = *slot;", site, a);
+            inline_can_fail = 1;
+            break;
+        case OP_GETTABLE:
+            println("        const TValue *slot;");
+            println("        const TValue *rb = &in%02d_%d;", site, b);
+            println("        const TValue *rc = &in%02d_%d;", site, c);
+            println("        if (l_unlikely(!(ttisinteger(rc)");
+            println("                         ? luaV_fastgeti(L, rb, ivalue(rc), slot)");
+            println("                         : luaV_fastget(L, rb, rc, slot, luaH_get))))");
+            println("          goto inline_fail_%02d;", site);
+            println("        in%02d_%d = *slot;", site, a);
+            inline_can_fail = 1;
+            break;
+        case OP_MMBIN:
+        case OP_MMBINI:
+        case OP_MMBINK:
+            println("        /* the fast path of the arithmetic skips this */");
+            break;
+        case OP_UNM:
+            println("        const TValue *v1 = &in%02d_%d;", site, b);
+            println("        if (ttisinteger(v1)) setivalue(&in%02d_%d, intop(-, 0, ivalue(v1)));", site, a);
+            println("        else if (ttisfloat(v1)) setfltvalue(&in%02d_%d, luai_numunm(L, fltvalue(v1)));", site, a);
+            println("        else goto inline_fail_%02d;", site);
+            inline_can_fail = 1;
+            break;
+        case OP_NOT:
+            println("        if (l_isfalse(&in%02d_%d)) setbtvalue(&in%02d_%d);", site, b, site, a);
+            println("        else setbfvalue(&in%02d_%d);", site, a);
+            break;
+        case OP_EQ:
+            println("        const TValue *v1 = &in%02d_%d;", site, a);
+            println("        const TValue *v2 = &in%02d_%d;", site, b);
+            println("        int cond = luaV_rawequalobj(v1, v2);");
+            print_inline_fail("!cond && ttypetag(v1) == ttypetag(v2) && (ttistable(v1) || ttisfulluserdata(v1))");
+            print_inline_condjump(p, pc);
+            break;
+        case OP_LT:
+        case OP_LE:
+            println("        int cond;");
+            println("        const TValue *v1 = &in%02d_%d;", site, a);
+            println("        const TValue *v2 = &in%02d_%d;", site, b);
+            println("        if (ttisinteger(v1) && ttisinteger(v2)) cond = (ivalue(v1) %s ivalue(v2));", (op == OP_LT ? "<" : "<="));
+            println("        else if (ttisnumber(v1) && ttisnumber(v2)) cond = %s(v1, v2);", (op == OP_LT ? "LTnum" : "LEnum"));
+            println("        else goto inline_fail_%02d;", site);
+            inline_can_fail = 1;
+            print_inline_condjump(p, pc);
+            break;
+        case OP_EQK:
+            println("        int cond = luaV_rawequalobj(&in%02d_%d, &ik[%d]);", site, a, b);
+            print_inline_condjump(p, pc);
+            break;
+        case OP_EQI:
+            println("        int cond;");
+            println("        const TValue *v1 = &in%02d_%d;", site, a);
+            println("        if (ttisinteger(v1)) cond = (ivalue(v1) == %d);", GETARG_sB(instr));
+            println("        else if (ttisfloat(v1)) cond = luai_numeq(fltvalue(v1), cast_num(%d));", GETARG_sB(instr));
+            println("        else cond = 0;");
+            print_inline_condjump(p, pc);
+            break;
+        case OP_LTI: print_inline_order(p, pc, "<");  break;
+        case OP_LEI: print_inline_order(p, pc, "<="); break;
+        case OP_GTI: print_inline_order(p, pc, ">");  break;
+        case OP_GEI: print_inline_order(p, pc, ">="); break;
+        case OP_TEST:
+            println("        int cond = !l_isfalse(&in%02d_%d);", site, a);
+            print_inline_condjump(p, pc);
+            break;
+        case OP_TESTSET:
+            println("        if (l_isfalse(&in%02d_%d) == %d) goto inline_%02d_%02d;", site, b, GETARG_k(instr), site, pc + 2);
+            println("        in%02d_%d = in%02d_%d;", site, a, site, b);
+            println("        goto inline_%02d_%02d;", site, next_jump_target(p, pc));
+            break;
+        case OP_JMP:
+            println("        goto inline_%02d_%02d;", site, pc + 1 + GETARG_sJ(instr));
+            break;
+        case OP_RETURN0:
+            print_inline_return(0, 0);
+            break;
+        case OP_RETURN1:
+            print_inline_return(a, 1);
+            break;
+        case OP_RETURN:
+            print_inline_return(a, b - 1);
+            break;
+        default:
+            fatal_error("instruction cannot be inlined");
+            break;
+    }
+}
+
+// Emits the inlined body of the function called at `pc`, if it is a small
+// leaf function. Returns whether it did.
+static
+int print_inlined_call(Proto *f, int pc)
+{
+    Instruction instr = f->code[pc];
+    int callee = call_target(f, pc);
+    int nargs = GETARG_B(instr) - 1;
+    if (callee < 0 || nargs < 0 || !is_inlinable(all_protos[callee])) return 0;
+    Proto *p = all_protos[callee];
+
+    inline_site = pc;
+    inline_nresults = GETARG_C(instr) - 1;
+    inline_can_fail = 0;
+
+    char *is_target = calloc(p->sizecode + 2, 1);
+    if (!is_target) { fatal_error("out of memory"); }
+    int uses_k = 0, uses_upvals = 0;
+    for (int q = 0; q < p->sizecode; q++) {
+        Instruction qi = p->code[q];
+        OpCode op = GET_OPCODE(qi);
+        if (is_conditional(op)) {
+            is_target[q + 2] = 1;
+            is_target[next_jump_target(p, q)] = 1;
+        } else if (op == OP_JMP) {
+            is_target[q + 1 + GETARG_sJ(qi)] = 1;
+        }
+        switch (op) {
+            case OP_LOADK: case OP_GETFIELD: case OP_EQK:
+            case OP_ADDK: case OP_SUBK: case OP_MULK: case OP_POWK: case OP_DIVK:
+                uses_k = 1;
+                break;
+            case OP_GETTABUP:
+                uses_k = 1;
+                uses_upvals = 1;
+                break;
+            case OP_GETUPVAL:
+                uses_upvals = 1;
+                break;
+            default:
+                break;
+        }
+    }
+
+    // With -n, 'trap' stays 0 even when hooks are on, but the callee would
+    // still fall back to the interpreter to run them.
+    println("    if (l_likely(!trap && %sttisLclosure(s2v(ra)) &&", no_hooks ? "!L->hookmask && " : "");
+    println("                clLvalue(s2v(ra))->p->aot_implementation == magic_implementation_%02d)) {", callee);
+    println("      /* inlined call */");
+    if (uses_k || uses_upvals) {
+        println("      LClosure *icl = clLvalue(s2v(ra));");
+    }
+    if (uses_k) {
+        println("      const TValue *ik = icl->p->k;");
+    }
+    for (int r = 0; r < p->maxstacksize; r++) {
+        println("      TValue in%02d_%d;", pc, r);
+    }
+    for (int r = 0; r < p->maxstacksize; r++) {
+        if (r < p->numparams && r < nargs) {
+            println("      in%02d_%d = *s2v(ra + %d);", pc, r, r + 1);
+        } else {
+            println("      setnilvalue(&in%02d_%d);", pc, r);
+        }
+    }
+    for (int q = 0; q < p->sizecode; q++) {
+        if (is_target[q]) {
+            println("      inline_%02d_%02d: {", pc, q);
+        } else {
+            println("      {");
+        }
+        print_inline_instruction(p, q);
+        println("      }");
+    }
+    println("    }");
+    if (inline_can_fail) {
+        println("    inline_fail_%02d: ;", pc);
+    }
+
+    free(is_target);
+    return 1;
+}
+
+//
+// Folded instructions
+// -------------------
+// Constant propagation tells us the result of some instructions, and which
+// way some tests go. We emit those directly, and nothing at all for the
+// instructions that never run.
+//
+
+static
+void print_set_constant(const TValue *v)
+{
+    if (ttisinteger(v)) {
+        if (ivalue(v) == LUA_MININTEGER) {
+            println("    setivalue(s2v(ra), LUA_MININTEGER);");
+        } else {
+            println("    setivalue(s2v(ra), " LUA_INTEGER_FMT ");", (LUAI_UACINT)ivalue(v));
+        }
+    } else if (ttisfloat(v)) {
+        println("    setfltvalue(s2v(ra), %a);", (double)fltvalue(v));
+    } else if (l_isfalse(v)) {
+        println("    setbfvalue(s2v(ra));");
+    } else {
+        println("    setbtvalue(s2v(ra));");
+    }
+}
+
+// Emits the instruction at `pc` if it was folded. Returns whether it was.
+static
+int print_folded(int pc)
+{
+    if (folded_value[pc] != CONST_ANY) {
+        print_set_constant(const_value(folded_value[pc]));
+    } else if (folded_succ[pc] < 0) {
+        return 0;
+    }
+    if (folded_succ[pc] >= 0) {
+        println("    goto label_%02d;  /* constant */", folded_succ[pc]);
+    }
+    return 1;
+}
+
 static
 void create_function(Proto *f)
 {
     int func_id = nfunctions++;
 
+    current_profile = profile_of(f);
+    fold_constants(f);
+    infer_types(f);
+    compute_liveness(f);
+    plan_regions(f);
+    plan_counted_loops(f);
+
     println("// source = %s", getstr(f->source));
     if (f->linedefined == 0) {
         println("// main function");
@@ -39,7 +1567,12 @@ void create_function(Proto *f)
         println("// lines: %d - %d", f->linedefined, f->lastlinedefined);
     }
 
-    println("static");
+    if (nshards == 0) {
+        println("static");  // Otherwise, it is declared in the shared header
+    }
+    if (is_cold_function(f)) {
+        println("LUAOT_COLD");
+    }
     println("CallInfo *magic_implementation_%02d(lua_State *L, CallInfo *ci)", func_id);
     println("{");
     println("  LClosure *cl;");
@@ -48,33 +1581,90 @@ void create_function(Proto *f)
     println("  const Instruction *pc;");
     println("  int trap;");
     printnl();
-    println("  trap = L->hookmask;");
-    println("  cl = clLvalue(s2v(ci->func));");
-    println("  k = cl->p->k;");
-    println("  pc = ci->u.l.savedpc;");
-    println("  if (l_unlikely(trap)) {");
-    println("    if (pc == cl->p->code) {  /* first instruction (not resuming)? */");
-    println("      if (cl->p->is_vararg)");
-    println("        trap = 0;  /* hooks will start after VARARGPREP instruction */");
-    println("      else  /* check 'call' hook */");
-    println("        luaD_hookcall(L, ci);");
-    println("    }");
-    println("    ci->u.l.trap = 1;  /* assume trap is on, for now */");
-    println("  }");
+    // Tail calls to the same function start it over.
+    for (int pc = 0; pc < f->sizecode; pc++) {
+        if (GET_OPCODE(f->code[pc]) == OP_TAILCALL && call_target(f, pc) == func_id) {
+            println("  entry:");
+            break;
+        }
+    }
+    if (no_hooks) {
+        println("  if (l_unlikely(L->hookmask))");
+        println("    return luaV_interpret(L, ci);  /* only the interpreter runs hooks */");
+        println("  trap = 0;");
+        println("  cl = clLvalue(s2v(ci->func));");
+        println("  k = cl->p->k;");
+        println("  pc = ci->u.l.savedpc;");
+    } else {
+        println("  trap = L->hookmask;");
+        println("  cl = clLvalue(s2v(ci->func));");
+        println("  k = cl->p->k;");
+        println("  pc = ci->u.l.savedpc;");
+        println("  if (l_unlikely(trap)) {");
+        println("    if (pc == cl->p->code) {  /* first instruction (not resuming)? */");
+        println("      if (cl->p->is_vararg)");
+        println("        trap = 0;  /* hooks will start after VARARGPREP instruction */");
+        println("      else  /* check 'call' hook */");
+        println("        luaD_hookcall(L, ci);");
+        println("    }");
+        println("    ci->u.l.trap = 1;  /* assume trap is on, for now */");
+        println("  }");
+    }
     println("  base = ci->func + 1;");
     println("  /* main loop of interpreter */");
     println("  Instruction *code = cl->p->code;"); // (!!!)
     println("  Instruction i;");
     println("  StkId ra;");
+    print_upvalue_pointers(f);
+    for (int pc = 0; pc < f->sizecode; pc++) {
+        if (counted_loop[pc]) {
+            println("  lua_Unsigned forcount_%02d = 0;", pc);
+            println("  lua_Integer foridx_%02d = 0, forstep_%02d = 0;", pc, pc);
+            for (int r = 0; r < types_nregs; r++) {
+                if (LOOP_HOIST(pc, r)) {
+                    println("  const TValue *looparr_%02d_%d = NULL;", pc, r);
+                    println("  lua_Unsigned looplim_%02d_%d = 0;", pc, r);
+                }
+            }
+        }
+    }
     printnl();
 
     // If we are returning from another function, or resuming a coroutine,
-    // jump back to where left.
-    println("  switch (pc - code) {");
-    for (int pc = 0; pc < f->sizecode; pc++) {
-        println("    case %d: goto label_%02d;", pc, pc);
+    // jump back to where left. We only have entry points for the places
+    // where that usually happens, because each of them makes the code
+    // harder to optimize. Anything else resumes in the interpreter.
+    int nresume = 0;
+    for (int pc = 1; pc < f->sizecode; pc++) {
+        if (is_resume_point(f, pc)) nresume++;
+    }
+    if (nresume == 0) {
+        println("  if (l_unlikely(pc != code))");
+        println("    return luaV_interpret(L, ci);");
+    } else {
+        println("  switch (pc - code) {");
+        println("    case 0: goto label_00;");
+        for (int pc = 1; pc < f->sizecode; pc++) {
+            if (!is_resume_point(f, pc)) continue;
+            int reload = 0;
+            for (int p = 0; p < pc; p++) {
+                if (counted_loop[p] && pc <= p + 1 + GETARG_Bx(f->code[p])) reload = 1;
+            }
+            if (!reload) {
+                println("    case %d: goto label_%02d;", pc, pc);
+                continue;
+            }
+            println("    case %d:  /* inside a counted loop */", pc);
+            for (int p = 0; p < pc; p++) {
+                if (counted_loop[p] && pc <= p + 1 + GETARG_Bx(f->code[p])) {
+                    print_loop_load(f, p, "      ");
+                }
+            }
+            println("      goto label_%02d;", pc);
+        }
+        println("    default: return luaV_interpret(L, ci);");
+        println("  }");
     }
-    println("  }");
     printnl();
 
     for (int pc = 0; pc < f->sizecode; pc++) {
@@ -83,6 +1673,12 @@ void create_function(Proto *f)
 
         luaot_PrintOpcodeComment(f, pc);
 
+        if (!const_reached[pc]) {
+            println("  label_%02d: ;  /* unreachable */", pc);
+            printnl();
+            continue;
+        }
+
         // While an instruction is executing, the program counter typically
         // points towards the next instruction. There are some corner cases
         // where the program counter getss adjusted mid-instruction, but I
@@ -102,8 +1698,28 @@ void create_function(Proto *f)
             println("  #define LUAOT_SKIP1 label_%02d", skip1);
         }
 
-        println("  label_%02d: {", pc);
+        if (profile_filename && is_conditional(op)) {
+            print_skip_hint(pc);
+        }
+
+        if (is_cold_instruction(pc)) {
+            println("  label_%02d: LUAOT_COLD_LABEL {", pc);
+        } else {
+            println("  label_%02d: {", pc);
+        }
+        if (region_end[pc] >= 0) {
+            create_region(f, pc);
+        }
         println("    aot_vmfetch(0x%08x);", instr);
+        if (may_run_code(f, pc)) {
+            print_forget_arrays(f, pc, "    ");
+        }
+
+        if (print_folded(pc)) {
+            println("  }");
+            printnl();
+            continue;
+        }
 
         switch (op) {
             case OP_MOVE: {
@@ -153,29 +1769,49 @@ void create_function(Proto *f)
                 break;
             }
             case OP_GETUPVAL: {
-                println("    int b = GETARG_B(i);");
-                println("    setobj2s(L, ra, cl->upvals[b]->v);");
+                println("    setobj2s(L, ra, upval_%02d->v);", GETARG_B(instr));
                 break;
             }
             case OP_SETUPVAL: {
-                println("    UpVal *uv = cl->upvals[GETARG_B(i)];");
-                println("    setobj(L, uv->v, s2v(ra));");
-                println("    luaC_barrier(L, uv, s2v(ra));");
+                int b = GETARG_B(instr);
+                println("    setobj(L, upval_%02d->v, s2v(ra));", b);
+                println("    luaC_barrier(L, upval_%02d, s2v(ra));", b);
                 break;
             }
             case OP_GETTABUP: {
                 println("    const TValue *slot;");
-                println("    TValue *upval = cl->upvals[GETARG_B(i)]->v;");
+                println("    TValue *upval = upval_%02d->v;", GETARG_B(instr));
                 println("    TValue *rc = KC(i);");
                 println("    TString *key = tsvalue(rc);  /* key must be a string */");
-                println("    if (luaV_fastget(L, upval, key, slot, luaH_getshortstr)) {");
+                println("    static unsigned int cache = 0;");
+                println("    if (luaot_fastgetcached(L, upval, key, slot, &cache)) {");
                 println("      setobj2s(L, ra, slot);");
                 println("    }");
-                println("    else");
+                println("    else {");
+                print_forget_arrays(f, pc, "      ");
                 println("      Protect(luaV_finishget(L, upval, rc, ra, slot));");
+                println("    }");
                 break;
             }
             case OP_GETTABLE: {
+                if (hoisted_get[pc] >= 0) {
+                    int forprep = hoisted_get[pc];
+                    int t = GETARG_B(instr);
+                    println("    if (l_likely(!trap)) {");
+                    println("      lua_Unsigned n = l_castS2U(foridx_%02d) - 1u;", forprep);
+                    println("      if (l_unlikely(looplim_%02d_%d == 0)) {", forprep, t);
+                    println("        TValue *rb = vRB(i);");
+                    println("        if (ttistable(rb)) {");
+                    println("          looparr_%02d_%d = hvalue(rb)->array;", forprep, t);
+                    println("          looplim_%02d_%d = hvalue(rb)->alimit;", forprep, t);
+                    println("        }");
+                    println("      }");
+                    println("      if (l_likely(n < looplim_%02d_%d) && !isempty(looparr_%02d_%d + n)) {", forprep, t, forprep, t);
+                    println("        setobj2s(L, ra, looparr_%02d_%d + n);", forprep, t);
+                    println("        goto label_%02d;", pc + 1);
+                    println("      }");
+                    println("    }");
+                }
                 println("    const TValue *slot;");
                 println("    TValue *rb = vRB(i);");
                 println("    TValue *rc = vRC(i);");
@@ -185,8 +1821,10 @@ void create_function(Proto *f)
                 println("        : luaV_fastget(L, rb, rc, slot, luaH_get)) {");
                 println("      setobj2s(L, ra, slot);");
                 println("    }");
-                println("    else");
+                println("    else {");
+                print_forget_arrays(f, pc, "      ");
                 println("      Protect(luaV_finishget(L, rb, rc, ra, slot));");
+                println("    }");
                 break;
             }
             case OP_GETI: {
@@ -199,6 +1837,7 @@ void create_function(Proto *f)
                 println("    else {");
                 println("      TValue key;");
                 println("      setivalue(&key, c);");
+                print_forget_arrays(f, pc, "      ");
                 println("      Protect(luaV_finishget(L, rb, &key, ra, slot));");
                 println("    }");
                 break;
@@ -208,24 +1847,30 @@ void create_function(Proto *f)
                 println("    TValue *rb = vRB(i);");
                 println("    TValue *rc = KC(i);");
                 println("    TString *key = tsvalue(rc);  /* key must be a string */");
-                println("    if (luaV_fastget(L, rb, key, slot, luaH_getshortstr)) {");
+                println("    static unsigned int cache = 0;");
+                println("    if (luaot_fastgetcached(L, rb, key, slot, &cache)) {");
                 println("      setobj2s(L, ra, slot);");
                 println("    }");
-                println("    else");
+                println("    else {");
+                print_forget_arrays(f, pc, "      ");
                 println("      Protect(luaV_finishget(L, rb, rc, ra, slot));");
+                println("    }");
                 break;
             }
             case OP_SETTABUP: {
                 println("    const TValue *slot;");
-                println("    TValue *upval = cl->upvals[GETARG_A(i)]->v;");
+                println("    TValue *upval = upval_%02d->v;", GETARG_A(instr));
                 println("    TValue *rb = KB(i);");
                 println("    TValue *rc = RKC(i);");
                 println("    TString *key = tsvalue(rb);  /* key must be a string */");
-                println("    if (luaV_fastget(L, upval, key, slot, luaH_getshortstr)) {");
+                println("    static unsigned int cache = 0;");
+                println("    if (luaot_fastgetcached(L, upval, key, slot, &cache)) {");
                 println("      luaV_finishfastset(L, upval, slot, rc);");
                 println("    }");
-                println("    else");
+                println("    else {");
+                print_forget_arrays(f, pc, "      ");
                 println("      Protect(luaV_finishset(L, upval, rb, rc, slot));");
+                println("    }");
                 break;
             }
             case OP_SETTABLE: {
@@ -238,8 +1883,10 @@ void create_function(Proto *f)
                 println("        : luaV_fastget(L, s2v(ra), rb, slot, luaH_get)) {");
                 println("      luaV_finishfastset(L, s2v(ra), slot, rc);");
                 println("    }");
-                println("    else");
+                println("    else {");
+                print_forget_arrays(f, pc, "      ");
                 println("      Protect(luaV_finishset(L, s2v(ra), rb, rc, slot));");
+                println("    }");
                 break;
             }
             case OP_SETI: {
@@ -252,6 +1899,7 @@ void create_function(Proto *f)
                 println("    else {");
                 println("      TValue key;");
                 println("      setivalue(&key, c);");
+                print_forget_arrays(f, pc, "      ");
                 println("      Protect(luaV_finishset(L, s2v(ra), &key, rc, slot));");
                 println("    }");
                 break;
@@ -261,11 +1909,14 @@ void create_function(Proto *f)
                 println("    TValue *rb = KB(i);");
                 println("    TValue *rc = RKC(i);");
                 println("    TString *key = tsvalue(rb);  /* key must be a string */");
-                println("    if (luaV_fastget(L, s2v(ra), key, slot, luaH_getshortstr)) {");
+                println("    static unsigned int cache = 0;");
+                println("    if (luaot_fastgetcached(L, s2v(ra), key, slot, &cache)) {");
                 println("      luaV_finishfastset(L, s2v(ra), slot, rc);");
                 println("    }");
-                println("    else");
+                println("    else {");
+                print_forget_arrays(f, pc, "      ");
                 println("      Protect(luaV_finishset(L, s2v(ra), rb, rc, slot));");
+                println("    }");
                 break;
             }
             case OP_NEWTABLE: {
@@ -293,11 +1944,18 @@ void create_function(Proto *f)
                 println("    TValue *rc = RKC(i);");
                 println("    TString *key = tsvalue(rc);  /* key must be a string */");
                 println("    setobj2s(L, ra + 1, rb);");
-                println("    if (luaV_fastget(L, rb, key, slot, luaH_getstr)) {");
+                if (TESTARG_k(instr) && ttisshrstring(&f->k[GETARG_C(instr)])) {
+                    println("    static unsigned int cache = 0;");
+                    println("    if (luaot_fastgetcached(L, rb, key, slot, &cache)) {");
+                } else {
+                    println("    if (luaV_fastget(L, rb, key, slot, luaH_getstr)) {");
+                }
                 println("      setobj2s(L, ra, slot);");
                 println("    }");
-                println("    else");
+                println("    else {");
+                print_forget_arrays(f, pc, "      ");
                 println("      Protect(luaV_finishget(L, rb, rc, ra, slot));");
+                println("    }");
                 break;
             }
             case OP_ADDI: {
@@ -492,7 +2150,9 @@ void create_function(Proto *f)
                 break;
             }
             case OP_JMP: {
-                println("    updatetrap(ci);");
+                if (!no_hooks) {
+                    println("    updatetrap(ci);");
+                }
                 println("    goto label_%02d;", jump_target(f, pc));//(!)
                 break;
             }
@@ -553,7 +2213,7 @@ void create_function(Proto *f)
             }
             case OP_TESTSET: {
                 println("    TValue *rb = vRB(i);");
-                println("    if (l_isfalse(rb) == GETARG_k(i))");
+                println("    if (LUAOT_SKIP_HINT(l_isfalse(rb) == GETARG_k(i)))");
                 println("      goto LUAOT_SKIP1;"); // (!)
                 println("    else {");
                 println("      setobj2s(L, ra, rb);");
@@ -562,6 +2222,8 @@ void create_function(Proto *f)
                 break;
             }
             case OP_CALL: {
+                int callee = call_target(f, pc);
+                print_inlined_call(f, pc);
                 println("    CallInfo *newci;");
                 println("    int b = GETARG_B(i);");
                 println("    int nresults = GETARG_C(i) - 1;");
@@ -569,7 +2231,26 @@ void create_function(Proto *f)
                 println("        L->top = ra + b;  /* top signals number of arguments */");
                 println("    /* else previous instruction set top */");
                 println("    savepc(L);  /* in case of errors */");
-                println("    if ((newci = luaD_precall(L, ra, nresults)) == NULL)");
+                if (callee >= 0) {
+                    println("    if (l_likely(ttisLclosure(s2v(ra)) &&");
+                    println("                clLvalue(s2v(ra))->p->aot_implementation == magic_implementation_%02d &&", callee);
+                    println("                getCcalls(L) < LUAOT_MAX_DIRECT_CALLS)) {");
+                    println("        /* direct call to a function of this module */");
+                    println("        newci = luaD_precall(L, ra, nresults);");
+                    println("        newci->callstatus = CIST_FRESH;");
+                    println("        L->nCcalls++;");
+                    println("        luaot_countcall(newci);");
+                    println("        if ((newci = magic_implementation_%02d(L, newci)) != NULL)", callee);
+                    println("            luaV_execute(L, newci);  /* let the trampoline finish it */");
+                    println("        L->nCcalls--;");
+                    println("        luaot_countcall(ci);");
+                    println("        updatetrap(ci);");
+                    println("    }");
+                    print("    else ");
+                } else {
+                    print("    ");
+                }
+                println("if ((newci = luaD_precall(L, ra, nresults)) == NULL)");
                 println("        updatetrap(ci);  /* C call; nothing else to be done */");
                 println("    else {");
                 println("        ci = newci;");
@@ -609,6 +2290,18 @@ void create_function(Proto *f)
                 println("    }");
                 println("    ci->func -= delta;  /* restore 'func' (if vararg) */");
                 println("    luaD_pretailcall(L, ci, ra, b);  /* prepare call frame */");
+                int callee = call_target(f, pc);
+                if (callee == func_id) {
+                    println("    if (l_likely(clLvalue(s2v(ci->func))->p->aot_implementation == magic_implementation_%02d))", callee);
+                    println("      goto entry;  /* same function, in the frame that we just prepared */");
+                } else if (callee >= 0) {
+                    println("#ifdef LUAOT_MUSTTAIL");
+                    println("    if (l_likely(clLvalue(s2v(ci->func))->p->aot_implementation == magic_implementation_%02d)) {", callee);
+                    println("      luaot_countcall(ci);");
+                    println("      LUAOT_MUSTTAIL return magic_implementation_%02d(L, ci);", callee);
+                    println("    }");
+                    println("#endif");
+                }
                 println("    return ci;");
                 break;
             }
@@ -634,13 +2327,17 @@ void create_function(Proto *f)
                 break;
             }
             case OP_RETURN0: {
-                println("    if (l_unlikely(L->hookmask)) {");
-                println("      L->top = ra;");
-                println("      savepc(ci);");
-                println("      luaD_poscall(L, ci, 0);  /* no hurry... */");
-                println("      trap = 1;");
-                println("    }");
-                println("    else {  /* do the 'poscall' here */");
+                if (!no_hooks) {
+                    println("    if (l_unlikely(L->hookmask)) {");
+                    println("      L->top = ra;");
+                    println("      savepc(ci);");
+                    println("      luaD_poscall(L, ci, 0);  /* no hurry... */");
+                    println("      trap = 1;");
+                    println("    }");
+                    println("    else {  /* do the 'poscall' here */");
+                } else {
+                    println("    {  /* no hooks, so do the 'poscall' here */");
+                }
                 println("      int nres;");
                 println("      L->ci = ci->previous;  /* back to caller */");
                 println("      L->top = base - 1;");
@@ -651,13 +2348,17 @@ void create_function(Proto *f)
                 break;
             }
             case OP_RETURN1: {
-                println("    if (l_unlikely(L->hookmask)) {");
-                println("      L->top = ra + 1;");
-                println("      savepc(ci);");
-                println("      luaD_poscall(L, ci, 1);  /* no hurry... */");
-                println("      trap = 1;");
-                println("    }");
-                println("    else {  /* do the 'poscall' here */");
+                if (!no_hooks) {
+                    println("    if (l_unlikely(L->hookmask)) {");
+                    println("      L->top = ra + 1;");
+                    println("      savepc(ci);");
+                    println("      luaD_poscall(L, ci, 1);  /* no hurry... */");
+                    println("      trap = 1;");
+                    println("    }");
+                    println("    else {  /* do the 'poscall' here */");
+                } else {
+                    println("    {  /* no hooks, so do the 'poscall' here */");
+                }
                 println("      int nres = ci->nresults;");
                 println("      L->ci = ci->previous;  /* back to caller */");
                 println("      if (nres == 0)");
@@ -673,6 +2374,33 @@ void create_function(Proto *f)
                 break;
             }
             case OP_FORLOOP: {
+                int forprep = pc - GETARG_Bx(instr);
+                int loop = counted_loop[forprep];
+                if (loop != LOOP_NONE) {
+                    const char *ind = (loop == LOOP_CHECKED) ? "  " : "";
+                    if (loop == LOOP_CHECKED) {
+                        println("    if (ttisinteger(s2v(ra + 2))) {  /* integer loop? */");
+                    }
+                    println("    %sif (forcount_%02d > 0) {  /* still more iterations? */", ind, forprep);
+                    println("    %s  forcount_%02d--;", ind, forprep);
+                    println("    %s  foridx_%02d = intop(+, foridx_%02d, forstep_%02d);", ind, forprep, forprep, forprep);
+                    if (loop_stores[forprep]) {
+                        println("    %s  chgivalue(s2v(ra + 1), forcount_%02d);", ind, forprep);
+                        println("    %s  chgivalue(s2v(ra), foridx_%02d);", ind, forprep);
+                    }
+                    println("    %s  setivalue(s2v(ra + 3), foridx_%02d);  /* control variable */", ind, forprep);
+                    println("    %s  goto label_%02d; /* jump back */", ind, forprep + 1); //(!)
+                    println("    %s}", ind);
+                    if (loop == LOOP_CHECKED) {
+                        println("    }");
+                        println("    else if (floatforloop(ra)) /* float loop */");
+                        println("      goto label_%02d; /* jump back */", forprep + 1); //(!)
+                    }
+                    if (!no_hooks) {
+                        println("    updatetrap(ci);  /* allows a signal to break the loop */");
+                    }
+                    break;
+                }
                 println("    if (ttisinteger(s2v(ra + 2))) {  /* integer loop? */");
                 println("      lua_Unsigned count = l_castS2U(ivalue(s2v(ra + 1)));");
                 println("      if (count > 0) {  /* still more iterations? */");
@@ -687,13 +2415,18 @@ void create_function(Proto *f)
                 println("    }");
                 println("    else if (floatforloop(ra)) /* float loop */");
                 println("      goto label_%02d; /* jump back */", ((pc+1) - GETARG_Bx(instr))); //(!)
-                println("    updatetrap(ci);  /* allows a signal to break the loop */");
+                if (!no_hooks) {
+                    println("    updatetrap(ci);  /* allows a signal to break the loop */");
+                }
                 break;
             }
             case OP_FORPREP: {
                 println("    savestate(L, ci);  /* in case of errors */");
                 println("    if (forprep(L, ra))");
                 println("      goto label_%02d; /* skip the loop */", ((pc+1) + GETARG_Bx(instr) + 1)); //(!)
+                if (counted_loop[pc]) {
+                    print_loop_load(f, pc, "    ");
+                }
                 break;
             }
             case OP_TFORPREP: {
@@ -708,11 +2441,14 @@ void create_function(Proto *f)
                 println("       to-be-closed variable. The call will use the stack after");
                 println("       these values (starting at 'ra + 4')");
                 println("    */");
-                println("    /* push function, state, and control variable */");
-                println("    memcpy(ra + 4, ra, 3 * sizeof(*ra));");
-                println("    L->top = ra + 4 + 3;");
-                println("    ProtectNT(luaD_call(L, ra + 4, GETARG_C(i)));  /* do the call */");
-                println("    updatestack(ci);  /* stack may have changed */");
+                println("    savepc(L);  /* in case of errors */");
+                println("    if (l_unlikely(trap) || !luaot_tforcall(L, ra, GETARG_C(i))) {");
+                println("      /* push function, state, and control variable */");
+                println("      memcpy(ra + 4, ra, 3 * sizeof(*ra));");
+                println("      L->top = ra + 4 + 3;");
+                println("      ProtectNT(luaD_call(L, ra + 4, GETARG_C(i)));  /* do the call */");
+                println("      updatestack(ci);  /* stack may have changed */");
+                println("    }");
                 // (!) Going to the next instruction is a no-op
                 break;
             }
@@ -780,7 +2516,7 @@ void create_function(Proto *f)
             }
             default: {
                 char msg[64];
-                sprintf(msg, "%s is not implemented yet", opnames[op]);
+                sprintf(msg, "%s is not implemented yet", (op < NUM_OPCODES ? opnames[op] : "opcode"));
                 fatal_error(msg);
                 break;
             }
@@ -0,0 +1,168 @@
+//
+// Building the function prototypes from static C data
+// ---------------------------------------------------
+// With the -p option, luaot emits the contents of each Proto as C arrays,
+// instead of bundling the source code or the bytecode. When the module is
+// loaded we only have to copy them into a new Proto tree, which is much
+// faster than parsing or undumping. This follows what lundump.c does, in
+// the same order, so the garbage collector never sees a half-built Proto.
+//
+// The arrays have to be copied, because luaF_freeproto frees them.
+//
+
+typedef struct LuaotConstant {
+    int tt;
+    lua_Integer i;
+    lua_Number n;
+    const char *s;
+    size_t len;
+} LuaotConstant;
+
+typedef struct LuaotUpvalue {
+    const char *name;  /* NULL if the debug information was stripped */
+    lu_byte instack;
+    lu_byte idx;
+    lu_byte kind;
+} LuaotUpvalue;
+
+typedef struct LuaotLocVar {
+    const char *name;
+    int startpc;
+    int endpc;
+} LuaotLocVar;
+
+typedef struct LuaotProto {
+    AotCompiledFunction implementation;
+    const char *source;  /* NULL if the same as the parent's */
+    size_t sourcelen;
+    int linedefined;
+    int lastlinedefined;
+    lu_byte numparams;
+    lu_byte is_vararg;
+    lu_byte maxstacksize;
+    int sizecode;
+    const Instruction *code;
+    int sizek;
+    const LuaotConstant *k;
+    int sizeupvalues;
+    const LuaotUpvalue *upvalues;
+    int sizep;
+    const int *p;  /* indices in the LUAOT_PROTOS array */
+    int sizelineinfo;
+    const ls_byte *lineinfo;
+    int sizeabslineinfo;
+    const AbsLineInfo *abslineinfo;
+    int sizelocvars;
+    const LuaotLocVar *locvars;
+} LuaotProto;
+
+static
+TString *luaot_newstring(lua_State *L, Proto *f, const char *s, size_t len)
+{
+    TString *ts = luaS_newlstr(L, s, len);
+    luaC_objbarrier(L, f, ts);
+    return ts;
+}
+
+static
+void luaot_loadproto(lua_State *L, Proto *f, TString *psource,
+                     const LuaotProto *protos, int id)
+{
+    const LuaotProto *d = &protos[id];
+    int i;
+
+    f->source = d->source ? luaot_newstring(L, f, d->source, d->sourcelen) : psource;
+    f->linedefined = d->linedefined;
+    f->lastlinedefined = d->lastlinedefined;
+    f->numparams = d->numparams;
+    f->is_vararg = d->is_vararg;
+    f->maxstacksize = d->maxstacksize;
+    f->aot_implementation = d->implementation;
+
+    f->code = luaM_newvectorchecked(L, d->sizecode, Instruction);
+    f->sizecode = d->sizecode;
+    memcpy(f->code, d->code, d->sizecode * sizeof(Instruction));
+
+    f->k = luaM_newvectorchecked(L, d->sizek, TValue);
+    f->sizek = d->sizek;
+    for (i = 0; i < d->sizek; i++)
+        setnilvalue(&f->k[i]);
+    for (i = 0; i < d->sizek; i++) {
+        TValue *o = &f->k[i];
+        const LuaotConstant *c = &d->k[i];
+        switch (c->tt) {
+            case LUA_VNIL:    setnilvalue(o); break;
+            case LUA_VFALSE:  setbfvalue(o); break;
+            case LUA_VTRUE:   setbtvalue(o); break;
+            case LUA_VNUMFLT: setfltvalue(o, c->n); break;
+            case LUA_VNUMINT: setivalue(o, c->i); break;
+            case LUA_VSHRSTR:
+            case LUA_VLNGSTR:
+                setsvalue2n(L, o, luaot_newstring(L, f, c->s, c->len));
+                break;
+            default: lua_assert(0);
+        }
+    }
+
+    f->upvalues = luaM_newvectorchecked(L, d->sizeupvalues, Upvaldesc);
+    f->sizeupvalues = d->sizeupvalues;
+    for (i = 0; i < d->sizeupvalues; i++)
+        f->upvalues[i].name = NULL;
+    for (i = 0; i < d->sizeupvalues; i++) {
+        f->upvalues[i].instack = d->upvalues[i].instack;
+        f->upvalues[i].idx = d->upvalues[i].idx;
+        f->upvalues[i].kind = d->upvalues[i].kind;
+    }
+
+    f->p = luaM_newvectorchecked(L, d->sizep, Proto *);
+    f->sizep = d->sizep;
+    for (i = 0; i < d->sizep; i++)
+        f->p[i] = NULL;
+    for (i = 0; i < d->sizep; i++) {
+        f->p[i] = luaF_newproto(L);
+        luaC_objbarrier(L, f, f->p[i]);
+        luaot_loadproto(L, f->p[i], f->source, protos, d->p[i]);
+    }
+
+    f->lineinfo = luaM_newvectorchecked(L, d->sizelineinfo, ls_byte);
+    f->sizelineinfo = d->sizelineinfo;
+    if (d->sizelineinfo > 0)
+        memcpy(f->lineinfo, d->lineinfo, d->sizelineinfo * sizeof(ls_byte));
+    f->abslineinfo = luaM_newvectorchecked(L, d->sizeabslineinfo, AbsLineInfo);
+    f->sizeabslineinfo = d->sizeabslineinfo;
+    if (d->sizeabslineinfo > 0)
+        memcpy(f->abslineinfo, d->abslineinfo, d->sizeabslineinfo * sizeof(AbsLineInfo));
+    f->locvars = luaM_newvectorchecked(L, d->sizelocvars, LocVar);
+    f->sizelocvars = d->sizelocvars;
+    for (i = 0; i < d->sizelocvars; i++)
+        f->locvars[i].varname = NULL;
+    for (i = 0; i < d->sizelocvars; i++) {
+        const LuaotLocVar *v = &d->locvars[i];
+        f->locvars[i].varname = luaot_newstring(L, f, v->name, strlen(v->name));
+        f->locvars[i].startpc = v->startpc;
+        f->locvars[i].endpc = v->endpc;
+    }
+    for (i = 0; i < d->sizeupvalues; i++) {
+        const char *name = d->upvalues[i].name;
+        if (name)
+            f->upvalues[i].name = luaot_newstring(L, f, name, strlen(name));
+    }
+}
+
+// Pushes a closure for the main function of a module, like lua_load does.
+static
+void luaot_pushmain(lua_State *L, const LuaotProto *protos, int id)
+{
+    LClosure *cl = luaF_newLclosure(L, protos[id].sizeupvalues);
+    setclLvalue2s(L, L->top, cl);
+    luaD_inctop(L);
+    cl->p = luaF_newproto(L);
+    luaC_objbarrier(L, cl, cl->p);
+    luaot_loadproto(L, cl->p, NULL, protos, id);
+    luaF_initupvals(L, cl);
+    if (cl->nupvalues >= 1) {  /* does it have an upvalue? */
+        /* set its first upvalue to the global table */
+        lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_GLOBALS);
+        lua_setupvalue(L, -2, 1);
+    }
+}
@@ -4,6 +4,7 @@
 // Based on lvm.c with the following changes:
 //   - Constants are put into macros (LUAOT_PC, LUAOT_NEXT_JUMP, etc)
 //   - Jumps go into a trampoline
+//   - With GCC, jumps use a table of label addresses instead of the switch
 //
 
 static
@@ -24,6 +25,8 @@ void create_function(Proto *f)
 {
     int func_id = nfunctions++;
 
+    current_profile = profile_of(f);
+
     println("// source = %s", getstr(f->source));
     if (f->linedefined == 0) {
         println("// main function");
@@ -31,7 +34,12 @@ void create_function(Proto *f)
         println("// lines: %d - %d", f->linedefined, f->lastlinedefined);
     }
 
-    println("static");
+    if (nshards == 0) {
+        println("static");  // Otherwise, it is declared in the shared header
+    }
+    if (is_cold_function(f)) {
+        println("LUAOT_COLD");
+    }
     println("CallInfo *magic_implementation_%02d(lua_State *L, CallInfo *ci)", func_id);
     println("{");
     println("  LClosure *cl;");
@@ -40,26 +48,44 @@ void create_function(Proto *f)
     println("  const Instruction *pc;");
     println("  int trap;");
     printnl();
-    println("  trap = L->hookmask;");
-    println("  cl = clLvalue(s2v(ci->func));");
-    println("  k = cl->p->k;");
-    println("  pc = ci->u.l.savedpc;");
-    println("  if (l_unlikely(trap)) {");
-    println("    if (pc == cl->p->code) {  /* first instruction (not resuming)? */");
-    println("      if (cl->p->is_vararg)");
-    println("        trap = 0;  /* hooks will start after VARARGPREP instruction */");
-    println("      else  /* check 'call' hook */");
-    println("        luaD_hookcall(L, ci);");
-    println("    }");
-    println("    ci->u.l.trap = 1;  /* assume trap is on, for now */");
-    println("  }");
+    if (no_hooks) {
+        println("  if (l_unlikely(L->hookmask))");
+        println("    return luaV_interpret(L, ci);  /* only the interpreter runs hooks */");
+        println("  trap = 0;");
+        println("  cl = clLvalue(s2v(ci->func));");
+        println("  k = cl->p->k;");
+        println("  pc = ci->u.l.savedpc;");
+    } else {
+        println("  trap = L->hookmask;");
+        println("  cl = clLvalue(s2v(ci->func));");
+        println("  k = cl->p->k;");
+        println("  pc = ci->u.l.savedpc;");
+        println("  if (l_unlikely(trap)) {");
+        println("    if (pc == cl->p->code) {  /* first instruction (not resuming)? */");
+        println("      if (cl->p->is_vararg)");
+        println("        trap = 0;  /* hooks will start after VARARGPREP instruction */");
+        println("      else  /* check 'call' hook */");
+        println("        luaD_hookcall(L, ci);");
+        println("    }");
+        println("    ci->u.l.trap = 1;  /* assume trap is on, for now */");
+        println("  }");
+    }
     println("  base = ci->func + 1;");
     println("  /* main loop of interpreter */");
     println("  Instruction *code = cl->p->code;"); // (!!!)
     println("  Instruction i;");
     println("  StkId ra;");
+    print_upvalue_pointers(f);
     printnl();
 
+    println("#if defined(LUAOT_USE_LABELS)");
+    println("  static void *const luaot_labels[] = {");
+    for (int pc = 0; pc < f->sizecode; pc++) {
+        println("    &&label_%d,", pc);
+    }
+    println("  };");
+    println("  luaot_dispatch();");
+    println("#endif");
     println("  while (1) {");
     println("    switch (pc - code) {");
     for (int pc = 0; pc < f->sizecode; pc++) {
@@ -68,7 +94,11 @@ void create_function(Proto *f)
 
         luaot_PrintOpcodeComment(f, pc);
 
-        println("      case %d: {", pc);
+        if (profile_filename && is_conditional(op)) {
+            print_skip_hint(pc);
+        }
+
+        println("      case %d: luaot_label(%d) {", pc, pc);
         println("        aot_vmfetch(0x%08x);", instr);
 
         switch (op) {
@@ -99,7 +129,7 @@ void create_function(Proto *f)
                 println("        TValue *rb;");
                 println("        rb = k + GETARG_Ax(0x%08x); pc++;", f->code[pc+1]);
                 println("        setobj2s(L, ra, rb);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
@@ -111,7 +141,7 @@ void create_function(Proto *f)
             case OP_LFALSESKIP: {
                 println("        setbfvalue(s2v(ra));");
                 println("        pc++; /* skip next instruction */");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
@@ -129,24 +159,23 @@ void create_function(Proto *f)
                 break;
             }
             case OP_GETUPVAL: {
-                println("        int b = GETARG_B(i);");
-                println("        setobj2s(L, ra, cl->upvals[b]->v);");
+                println("        setobj2s(L, ra, upval_%02d->v);", GETARG_B(instr));
                 // FALLTHROUGH
                 break;
             }
             case OP_SETUPVAL: {
-                println("        UpVal *uv = cl->upvals[GETARG_B(i)];");
-                println("        setobj(L, uv->v, s2v(ra));");
-                println("        luaC_barrier(L, uv, s2v(ra));");
+                println("        setobj(L, upval_%02d->v, s2v(ra));", GETARG_B(instr));
+                println("        luaC_barrier(L, upval_%02d, s2v(ra));", GETARG_B(instr));
                 // FALLTHROUGH
                 break;
             }
             case OP_GETTABUP: {
                 println("        const TValue *slot;");
-                println("        TValue *upval = cl->upvals[GETARG_B(i)]->v;");
+                println("        TValue *upval = upval_%02d->v;", GETARG_B(instr));
                 println("        TValue *rc = KC(i);");
                 println("        TString *key = tsvalue(rc);  /* key must be a string */");
-                println("        if (luaV_fastget(L, upval, key, slot, luaH_getshortstr)) {");
+                println("        static unsigned int cache = 0;");
+                println("        if (luaot_fastgetcached(L, upval, key, slot, &cache)) {");
                 println("          setobj2s(L, ra, slot);");
                 println("        }");
                 println("        else");
@@ -189,7 +218,8 @@ void create_function(Proto *f)
                 println("        TValue *rb = vRB(i);");
                 println("        TValue *rc = KC(i);");
                 println("        TString *key = tsvalue(rc);  /* key must be a string */");
-                println("        if (luaV_fastget(L, rb, key, slot, luaH_getshortstr)) {");
+                println("        static unsigned int cache = 0;");
+                println("        if (luaot_fastgetcached(L, rb, key, slot, &cache)) {");
                 println("          setobj2s(L, ra, slot);");
                 println("        }");
                 println("        else");
@@ -199,11 +229,12 @@ void create_function(Proto *f)
             }
             case OP_SETTABUP: {
                 println("        const TValue *slot;");
-                println("        TValue *upval = cl->upvals[GETARG_A(i)]->v;");
+                println("        TValue *upval = upval_%02d->v;", GETARG_A(instr));
                 println("        TValue *rb = KB(i);");
                 println("        TValue *rc = RKC(i);");
                 println("        TString *key = tsvalue(rb);  /* key must be a string */");
-                println("        if (luaV_fastget(L, upval, key, slot, luaH_getshortstr)) {");
+                println("        static unsigned int cache = 0;");
+                println("        if (luaot_fastgetcached(L, upval, key, slot, &cache)) {");
                 println("          luaV_finishfastset(L, upval, slot, rc);");
                 println("        }");
                 println("        else");
@@ -246,7 +277,8 @@ void create_function(Proto *f)
                 println("        TValue *rb = KB(i);");
                 println("        TValue *rc = RKC(i);");
                 println("        TString *key = tsvalue(rb);  /* key must be a string */");
-                println("        if (luaV_fastget(L, s2v(ra), key, slot, luaH_getshortstr)) {");
+                println("        static unsigned int cache = 0;");
+                println("        if (luaot_fastgetcached(L, s2v(ra), key, slot, &cache)) {");
                 println("          luaV_finishfastset(L, s2v(ra), slot, rc);");
                 println("        }");
                 println("        else");
@@ -270,7 +302,7 @@ void create_function(Proto *f)
                 println("        if (b != 0 || c != 0)");
                 println("          luaH_resize(L, t, c, b);  /* idem */");
                 println("        checkGC(L, ra + 1);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
@@ -280,7 +312,12 @@ void create_function(Proto *f)
                 println("        TValue *rc = RKC(i);");
                 println("        TString *key = tsvalue(rc);  /* key must be a string */");
                 println("        setobj2s(L, ra + 1, rb);");
-                println("        if (luaV_fastget(L, rb, key, slot, luaH_getstr)) {");
+                if (TESTARG_k(instr) && ttisshrstring(&f->k[GETARG_C(instr)])) {
+                    println("        static unsigned int cache = 0;");
+                    println("        if (luaot_fastgetcached(L, rb, key, slot, &cache)) {");
+                } else {
+                    println("        if (luaV_fastget(L, rb, key, slot, luaH_getstr)) {");
+                }
                 println("          setobj2s(L, ra, slot);");
                 println("        }");
                 println("        else");
@@ -290,67 +327,67 @@ void create_function(Proto *f)
             }
             case OP_ADDI: {
                 println("        op_arithI(L, l_addi, luai_numadd);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_ADDK: {
                 println("        op_arithK(L, l_addi, luai_numadd);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_SUBK: {
                 println("        op_arithK(L, l_subi, luai_numsub);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_MULK: {
                 println("        op_arithK(L, l_muli, luai_nummul);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_MODK: {
                 println("        op_arithK(L, luaV_mod, luaV_modf);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_POWK: {
                 println("        op_arithfK(L, luai_numpow);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_DIVK: {
                 println("        op_arithfK(L, luai_numdiv);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_IDIVK: {
                 println("        op_arithK(L, luaV_idiv, luai_numidiv);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_BANDK: {
                 println("        op_bitwiseK(L, l_band);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_BORK: {
                 println("        op_bitwiseK(L, l_bor);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_BXORK: {
                 println("        op_bitwiseK(L, l_bxor);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
@@ -361,7 +398,7 @@ void create_function(Proto *f)
                 println("        if (tointegerns(rb, &ib)) {");
                 println("           pc++; setivalue(s2v(ra), luaV_shiftl(ib, -ic));");
                 println("        }");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
@@ -372,79 +409,79 @@ void create_function(Proto *f)
                 println("        if (tointegerns(rb, &ib)) {");
                 println("           pc++; setivalue(s2v(ra), luaV_shiftl(ic, ib));");
                 println("        }");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_ADD: {
                 println("        op_arith(L, l_addi, luai_numadd);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_SUB: {
                 println("        op_arith(L, l_subi, luai_numsub);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_MUL: {
                 println("        op_arith(L, l_muli, luai_nummul);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_MOD: {
                 println("        op_arith(L, luaV_mod, luaV_modf);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_POW: {
                 println("        op_arithf(L, luai_numpow);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_DIV: {  /* float division (always with floats: */
                 println("        op_arithf(L, luai_numdiv);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_IDIV: {  /* floor division */
                 println("        op_arith(L, luaV_idiv, luai_numidiv);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_BAND: {
                 println("        op_bitwise(L, l_band);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_BOR: {
                 println("        op_bitwise(L, l_bor);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_BXOR: {
                 println("        op_bitwise(L, l_bxor);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_SHR: {
                 println("        op_bitwise(L, luaV_shiftr);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_SHL: {
                 println("        op_bitwise(L, luaV_shiftl);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
@@ -539,7 +576,7 @@ void create_function(Proto *f)
             }
             case OP_JMP: {
                 println("        dojump(ci, i, 0);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
@@ -548,19 +585,19 @@ void create_function(Proto *f)
                 println("        TValue *rb = vRB(i);");
                 println("        Protect(cond = luaV_equalobj(L, s2v(ra), rb));");
                 println("        docondjump();");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_LT: {
                 println("        op_order(L, l_lti, LTnum, lessthanothers);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_LE: {
                 println("        op_order(L, l_lei, LEnum, lessequalothers);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
@@ -569,7 +606,7 @@ void create_function(Proto *f)
                 println("        /* basic types do not use '__eq'; we can use raw equality */");
                 println("        int cond = luaV_equalobj(NULL, s2v(ra), rb);");
                 println("        docondjump();");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
@@ -583,38 +620,38 @@ void create_function(Proto *f)
                 println("        else");
                 println("          cond = 0;  /* other types cannot be equal to a number */");
                 println("        docondjump();");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_LTI: {
                 println("        op_orderI(L, l_lti, luai_numlt, 0, TM_LT);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_LEI: {
                 println("        op_orderI(L, l_lei, luai_numle, 0, TM_LE);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_GTI: {
                 println("        op_orderI(L, l_gti, luai_numgt, 1, TM_LT);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_GEI: {
                 println("        op_orderI(L, l_gei, luai_numge, 1, TM_LE);");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_TEST: {
                 println("        int cond = !l_isfalse(s2v(ra));");
                 println("        docondjump();");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
@@ -626,11 +663,12 @@ void create_function(Proto *f)
                 println("          setobj2s(L, ra, rb);");
                 println("          donextjump(ci);");
                 println("        }");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
             case OP_CALL: {
+                int callee = call_target(f, pc);
                 println("        CallInfo *newci;");
                 println("        int b = GETARG_B(i);");
                 println("        int nresults = GETARG_C(i) - 1;");
@@ -638,7 +676,26 @@ void create_function(Proto *f)
                 println("            L->top = ra + b;  /* top signals number of arguments */");
                 println("        /* else previous instruction set top */");
                 println("        savepc(L);  /* in case of errors */");
-                println("        if ((newci = luaD_precall(L, ra, nresults)) == NULL)");
+                if (callee >= 0) {
+                    println("        if (l_likely(ttisLclosure(s2v(ra)) &&");
+                    println("                    clLvalue(s2v(ra))->p->aot_implementation == magic_implementation_%02d &&", callee);
+                    println("                    getCcalls(L) < LUAOT_MAX_DIRECT_CALLS)) {");
+                    println("            /* direct call to a function of this module */");
+                    println("            newci = luaD_precall(L, ra, nresults);");
+                    println("            newci->callstatus = CIST_FRESH;");
+                    println("            L->nCcalls++;");
+                    println("            luaot_countcall(newci);");
+                    println("            if ((newci = magic_implementation_%02d(L, newci)) != NULL)", callee);
+                    println("                luaV_execute(L, newci);  /* let the trampoline finish it */");
+                    println("            L->nCcalls--;");
+                    println("            luaot_countcall(ci);");
+                    println("            updatetrap(ci);");
+                    println("        }");
+                    print("        else ");
+                } else {
+                    print("        ");
+                }
+                println("if ((newci = luaD_precall(L, ra, nresults)) == NULL)");
                 println("            updatetrap(ci);  /* C call; nothing else to be done */");
                 println("        else {");
                 println("            ci = newci;");
@@ -706,13 +763,17 @@ void create_function(Proto *f)
                 break;
             }
             case OP_RETURN0: {
-                println("        if (l_unlikely(L->hookmask)) {");
-                println("          L->top = ra;");
-                println("          savepc(ci);");
-                println("          luaD_poscall(L, ci, 0);  /* no hurry... */");
-                println("          trap = 1;");
-                println("        }");
-                println("        else {  /* do the 'poscall' here */");
+                if (!no_hooks) {
+                    println("        if (l_unlikely(L->hookmask)) {");
+                    println("          L->top = ra;");
+                    println("          savepc(ci);");
+                    println("          luaD_poscall(L, ci, 0);  /* no hurry... */");
+                    println("          trap = 1;");
+                    println("        }");
+                    println("        else {  /* do the 'poscall' here */");
+                } else {
+                    println("        {  /* no hooks, so do the 'poscall' here */");
+                }
                 println("          int nres;");
                 println("          L->ci = ci->previous;  /* back to caller */");
                 println("          L->top = base - 1;");
@@ -724,13 +785,17 @@ void create_function(Proto *f)
                 break;
             }
             case OP_RETURN1: {
-                println("        if (l_unlikely(L->hookmask)) {");
-                println("          L->top = ra + 1;");
-                println("          savepc(ci);");
-                println("          luaD_poscall(L, ci, 1);  /* no hurry... */");
-                println("          trap = 1;");
-                println("        }");
-                println("        else {  /* do the 'poscall' here */");
+                if (!no_hooks) {
+                    println("        if (l_unlikely(L->hookmask)) {");
+                    println("          L->top = ra + 1;");
+                    println("          savepc(ci);");
+                    println("          luaD_poscall(L, ci, 1);  /* no hurry... */");
+                    println("          trap = 1;");
+                    println("        }");
+                    println("        else {  /* do the 'poscall' here */");
+                } else {
+                    println("        {  /* no hooks, so do the 'poscall' here */");
+                }
                 println("          int nres = ci->nresults;");
                 println("          L->ci = ci->previous;  /* back to caller */");
                 println("          if (nres == 0)");
@@ -761,8 +826,10 @@ void create_function(Proto *f)
                 println("        }");
                 println("        else if (floatforloop(ra)) /* float loop */");
                 println("          pc -= %d; /* jump back */", GETARG_Bx(instr));
-                println("        updatetrap(ci);  /* allows a signal to break the loop */");
-                println("        break;");
+                if (!no_hooks) {
+                    println("        updatetrap(ci);  /* allows a signal to break the loop */");
+                }
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
@@ -770,7 +837,7 @@ void create_function(Proto *f)
                 println("        savestate(L, ci);  /* in case of errors */");
                 println("        if (forprep(L, ra))");
                 println("          pc += %d; /* skip the loop */", GETARG_Bx(instr) + 1);
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
@@ -778,7 +845,7 @@ void create_function(Proto *f)
                 println("        /* create to-be-closed upvalue (if needed) */");
                 println("        halfProtect(luaF_newtbcupval(L, ra + 3));");
                 println("        pc += %d;", GETARG_Bx(instr));
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
@@ -788,11 +855,14 @@ void create_function(Proto *f)
                 println("           to-be-closed variable. The call will use the stack after");
                 println("           these values (starting at 'ra + 4')");
                 println("        */");
-                println("        /* push function, state, and control variable */");
-                println("        memcpy(ra + 4, ra, 3 * sizeof(*ra));");
-                println("        L->top = ra + 4 + 3;");
-                println("        ProtectNT(luaD_call(L, ra + 4, GETARG_C(i)));  /* do the call */");
-                println("        updatestack(ci);  /* stack may have changed */");
+                println("        savepc(L);  /* in case of errors */");
+                println("        if (l_unlikely(trap) || !luaot_tforcall(L, ra, GETARG_C(i))) {");
+                println("          /* push function, state, and control variable */");
+                println("          memcpy(ra + 4, ra, 3 * sizeof(*ra));");
+                println("          L->top = ra + 4 + 3;");
+                println("          ProtectNT(luaD_call(L, ra + 4, GETARG_C(i)));  /* do the call */");
+                println("          updatestack(ci);  /* stack may have changed */");
+                println("        }");
                 // (!) Going to the next instruction is a no-op
                 // FALLTHROUGH
                 break;
@@ -802,7 +872,7 @@ void create_function(Proto *f)
                 println("          setobjs2s(L, ra + 2, ra + 4);  /* save control variable */");
                 println("          pc -= %d; /* jump back */", GETARG_Bx(instr));
                 println("        }");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
@@ -833,7 +903,7 @@ void create_function(Proto *f)
                 println("          last--;");
                 println("          luaC_barrierback(L, obj2gco(h), val);");
                 println("        }");
-                println("        break;");
+                println("        luaot_dispatch();");
                 // PC
                 break;
             }
@@ -7,6 +7,10 @@
 #define lvm_c
 #define LUA_CORE
 
+#if defined(LUAOT_COUNTERS) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE  /* for 'syscall' (see LUAOT_COUNTERS below) */
+#endif
+
 #include "lprefix.h"
 
 #include <float.h>
@@ -18,6 +22,7 @@
 
 #include "lua.h"
 
+#include "laot.h"
 #include "ldebug.h"
 #include "ldo.h"
 #include "lfunc.h"
@@ -1110,7 +1115,8 @@ void luaV_finishOp (lua_State *L) {
 ** was expected (parameter 'k'), else do next instruction, which must
 ** be a jump.
 */
-#define docondjump()	if (cond != GETARG_k(i)) pc++; else donextjump(ci);
+#define docondjump()  \
+	if (cond != GETARG_k(i)) pc++; else { proftaken(); donextjump(ci); }
 
 
 /*
@@ -1148,27 +1154,566 @@ void luaV_finishOp (lua_State *L) {
            luai_threadyield(L); }
 
 
+/*
+** Count a loop iteration, for tiered execution. Long loops make a function
+** hot, but we only switch to the compiled code on its next call.
+*/
+#define tiercount()	(cl->p->aot_counter++)
+
+
 /* fetch an instruction and prepare its execution */
 #define vmfetch()	{ \
   if (l_unlikely(trap)) {  /* stack reallocation or hooks? */ \
     trap = luaG_traceexec(L, pc);  /* handle hooks */ \
     updatebase(ci);  /* correct stack */ \
   } \
+  profinstr(pc); \
   i = *(pc++); \
   ra = RA(i); /* WARNING: any stack reallocation invalidates 'ra' */ \
 }
 
+
+/*
+** {==================================================================
+** Profiles for luaot
+** ===================================================================
+*/
+
+#ifndef LUAOT_IS_MODULE
+static unsigned int hashbytes (unsigned int h, const void *b, size_t n) {
+  const unsigned char *s = cast(const unsigned char *, b);
+  size_t j;
+  for (j = 0; j < n; j++) {  /* FNV-1a */
+    h ^= s[j];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+
+/*
+** A hash of the bytecode and the constants of a function, which is what
+** the compiled code depends on. It identifies the function in profiles
+** and in the cache of compiled functions, no matter where it came from.
+*/
+unsigned int luaV_codehash (const Proto *p) {
+  unsigned int h = 2166136261u;
+  lu_byte header[3];
+  int i;
+  header[0] = p->numparams;
+  header[1] = p->is_vararg;
+  header[2] = p->maxstacksize;
+  h = hashbytes(h, header, sizeof(header));
+  for (i = 0; i < p->sizecode; i++) {
+    lu_byte b[4];
+    int j;
+    for (j = 0; j < 4; j++)  /* same result on any byte order */
+      b[j] = cast_byte((p->code[i] >> (8 * j)) & 0xff);
+    h = hashbytes(h, b, 4);
+  }
+  for (i = 0; i < p->sizek; i++) {
+    const TValue *o = &p->k[i];
+    lu_byte tag = ttypetag(o);
+    h = hashbytes(h, &tag, 1);
+    switch (tag) {
+      case LUA_VNUMINT: {
+        lua_Integer n = ivalue(o);
+        h = hashbytes(h, &n, sizeof(n));
+        break;
+      }
+      case LUA_VNUMFLT: {
+        lua_Number n = fltvalue(o);
+        h = hashbytes(h, &n, sizeof(n));
+        break;
+      }
+      case LUA_VSHRSTR: case LUA_VLNGSTR:
+        h = hashbytes(h, getstr(tsvalue(o)), tsslen(tsvalue(o)));
+        break;
+      default:  /* nil or boolean; the tag is enough */
+        break;
+    }
+  }
+  return h;
+}
+
+
+
+/*
+** The signature of a function is everything that 'luaV_codehash' hashes,
+** plus the upvalue descriptors of its nested functions, which the
+** analyses of luaot also depend on. The cache of compiled functions
+** compares it byte by byte, because the hash alone can collide.
+*/
+typedef struct SigBuffer {
+  lu_byte *b;
+  size_t size;  /* capacity of 'b' */
+  size_t n;  /* bytes written so far, even if they did not fit */
+} SigBuffer;
+
+
+static void addsig (SigBuffer *sb, const void *b, size_t n) {
+  if (sb->n < sb->size)
+    memcpy(sb->b + sb->n, b, (sb->size - sb->n < n) ? sb->size - sb->n : n);
+  sb->n += n;
+}
+
+
+static void addsigint (SigBuffer *sb, size_t x) {
+  lu_byte b[4];
+  int j;
+  for (j = 0; j < 4; j++)  /* same result on any byte order */
+    b[j] = cast_byte((x >> (8 * j)) & 0xff);
+  addsig(sb, b, 4);
+}
+
+
+/*
+** Writes the signature of 'p' to 'buff', up to 'size' bytes, and returns
+** its full size (like 'snprintf').
+*/
+size_t luaV_codesig (const Proto *p, lu_byte *buff, size_t size) {
+  SigBuffer sb;
+  lu_byte header[3];
+  int i, j;
+  sb.b = buff; sb.size = size; sb.n = 0;
+  header[0] = p->numparams;
+  header[1] = p->is_vararg;
+  header[2] = p->maxstacksize;
+  addsig(&sb, header, sizeof(header));
+  addsigint(&sb, p->sizecode);
+  for (i = 0; i < p->sizecode; i++)
+    addsigint(&sb, p->code[i]);
+  addsigint(&sb, p->sizek);
+  for (i = 0; i < p->sizek; i++) {
+    const TValue *o = &p->k[i];
+    lu_byte tag = ttypetag(o);
+    addsig(&sb, &tag, 1);
+    switch (tag) {
+      case LUA_VNUMINT: {
+        lua_Integer n = ivalue(o);
+        addsig(&sb, &n, sizeof(n));
+        break;
+      }
+      case LUA_VNUMFLT: {
+        lua_Number n = fltvalue(o);
+        addsig(&sb, &n, sizeof(n));
+        break;
+      }
+      case LUA_VSHRSTR: case LUA_VLNGSTR:
+        addsigint(&sb, tsslen(tsvalue(o)));
+        addsig(&sb, getstr(tsvalue(o)), tsslen(tsvalue(o)));
+        break;
+      default:  /* nil or boolean; the tag is enough */
+        break;
+    }
+  }
+  addsigint(&sb, p->sizep);
+  for (i = 0; i < p->sizep; i++) {
+    const Proto *np = p->p[i];
+    addsigint(&sb, np->sizeupvalues);
+    for (j = 0; j < np->sizeupvalues; j++) {
+      lu_byte desc[3];
+      desc[0] = np->upvalues[j].instack;
+      desc[1] = np->upvalues[j].idx;
+      desc[2] = np->upvalues[j].kind;
+      addsig(&sb, desc, sizeof(desc));
+    }
+  }
+  return sb.n;
+}
+
+
+/*
+** The registers whose types are recorded in the profiles, for the
+** arithmetic and comparison instructions. Returns how many there are.
+*/
+int luaV_profoperands (Instruction i, int *regs) {
+  switch (GET_OPCODE(i)) {
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_MOD: case OP_POW:
+    case OP_DIV: case OP_IDIV: case OP_BAND: case OP_BOR: case OP_BXOR:
+    case OP_SHL: case OP_SHR:
+      regs[0] = GETARG_B(i); regs[1] = GETARG_C(i);
+      return 2;
+    case OP_ADDI: case OP_ADDK: case OP_SUBK: case OP_MULK: case OP_MODK:
+    case OP_POWK: case OP_DIVK: case OP_IDIVK: case OP_BANDK: case OP_BORK:
+    case OP_BXORK: case OP_SHRI: case OP_SHLI: case OP_UNM: case OP_BNOT:
+      regs[0] = GETARG_B(i);
+      return 1;
+    case OP_EQ: case OP_LT: case OP_LE:
+      regs[0] = GETARG_A(i); regs[1] = GETARG_B(i);
+      return 2;
+    case OP_EQK: case OP_EQI: case OP_LTI: case OP_LEI: case OP_GTI:
+    case OP_GEI:
+      regs[0] = GETARG_A(i);
+      return 1;
+    default:
+      return 0;
+  }
+}
+#endif
+
+
+#if defined(LUAOT_PROFILE)
+
+/*
+** When Lua is compiled with LUAOT_PROFILE, the interpreter counts how
+** many times it runs each instruction, how often each conditional jump
+** is taken, and the types of the operands of arithmetic and comparisons.
+** At exit it appends this to the file named by the LUAOT_PROFILE
+** environment variable (or "luaot.profile"), for 'luaot -P'. Operand
+** types are a set of bits: 1 for integers, 2 for floats, 4 for others.
+*/
+
+typedef struct ProfileEntry {
+  l_uint32 count;  /* times that the instruction ran */
+  l_uint32 taken;  /* times that the jump after a test was taken */
+  lu_byte types[2];  /* types of the operands */
+} ProfileEntry;
+
+typedef struct Profile {
+  struct Profile *next;  /* list of all profiles */
+  unsigned int hash;
+  int sizecode;
+  int linedefined;
+  char source[64];  /* only for humans */
+  l_uint32 calls;
+  ProfileEntry pcs[1];
+} Profile;
+
+static Profile *allprofiles = NULL;
+
+
+static void writeprofiles (void) {
+  const char *name = getenv("LUAOT_PROFILE");
+  FILE *f = fopen(name ? name : "luaot.profile", "a");
+  Profile *prof;
+  int pc;
+  if (f == NULL) {
+    perror("luaot profile");
+    return;
+  }
+  for (prof = allprofiles; prof != NULL; prof = prof->next) {
+    fprintf(f, "function %08x %d %lu %s:%d\n", prof->hash, prof->sizecode,
+               (unsigned long)prof->calls, prof->source, prof->linedefined);
+    for (pc = 0; pc < prof->sizecode; pc++) {
+      ProfileEntry *e = &prof->pcs[pc];
+      if (e->count > 0)
+        fprintf(f, "%d %lu %lu %d %d\n", pc, (unsigned long)e->count,
+                   (unsigned long)e->taken, e->types[0], e->types[1]);
+    }
+  }
+  fclose(f);
+}
+
+
+static Profile *getprofile (Proto *p) {
+  Profile *prof = cast(Profile *, p->profile);
+  if (prof == NULL) {
+    size_t size = sizeof(Profile) + (p->sizecode - 1) * sizeof(ProfileEntry);
+    prof = cast(Profile *, calloc(1, size));
+    if (prof == NULL)
+      abort();  /* profiling is a debugging tool; keep it simple */
+    if (allprofiles == NULL)
+      atexit(writeprofiles);
+    prof->next = allprofiles;
+    allprofiles = prof;
+    prof->hash = luaV_codehash(p);
+    prof->sizecode = p->sizecode;
+    prof->linedefined = p->linedefined;
+    if (p->source)
+      snprintf(prof->source, sizeof(prof->source), "%s", getstr(p->source));
+    p->profile = prof;
+  }
+  return prof;
+}
+
+
+static int proftype (const TValue *o) {
+  return ttisinteger(o) ? 1 : ttisfloat(o) ? 2 : 4;
+}
+
+
+static void profinstr_ (Profile *prof, const Proto *p, const Instruction *pc,
+                        StkId base) {
+  ProfileEntry *e = &prof->pcs[pc - p->code];
+  int regs[2];
+  int n = luaV_profoperands(*pc, regs);
+  int j;
+  e->count++;
+  for (j = 0; j < n; j++)
+    e->types[j] |= proftype(s2v(base + regs[j]));
+}
+
+#define profinstr(pc)	profinstr_(prof, cl->p, pc, base)
+#define proftaken()	(prof->pcs[pc - 1 - cl->p->code].taken++)
+
+#else
+
+#define profinstr(pc)	((void)0)
+#define proftaken()	((void)0)
+
+#endif
+
+
+#if defined(LUAOT_COUNTERS)
+
+/*
+** When Lua is compiled with LUAOT_COUNTERS, it uses the hardware counters
+** of the CPU (Linux perf events) to measure the cycles, instructions,
+** branch misses and cache misses of each function, in user space. We read
+** the counters whenever another function starts running: when the
+** trampoline in 'luaV_execute' runs compiled code, and when the interpreter
+** enters a function or returns to it. So the C functions count for the Lua
+** function that called them, and so do the functions that a compiled
+** function calls directly. Interpreted and compiled runs of a function are
+** counted apart. 'lua_close' prints a report, sorted by cycles, to the file
+** named by the LUAOT_COUNTERS environment variable (or to stderr). Compiled
+** modules must be built with the same flag.
+*/
+
+#ifndef LUAOT_IS_MODULE
+
+#if !defined(__linux__)
+#error "LUAOT_COUNTERS needs the perf events of Linux"
+#endif
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+#define NCOUNTERS	4
+
+typedef struct CountedEvent {
+  l_uint32 type;
+  unsigned long long config;
+  const char *name;
+} CountedEvent;
+
+static CountedEvent countedevents[NCOUNTERS] = {
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, "cycles" },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, "instructions" },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, "branch-misses" },
+  { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, "cache-misses" },
+};
+
+/* Virtual machines often have no hardware counters; then we count time */
+static const CountedEvent taskclock =
+  { PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, "task-clock(ns)" };
+
+typedef struct Counters {
+  struct Counters *next;  /* list of all counters */
+  int linedefined;
+  char source[64];  /* only for humans */
+  unsigned long long count[2][NCOUNTERS];  /* interpreted and compiled */
+} Counters;
+
+static Counters *allcounters = NULL;
+static Counters *curcounters = NULL;  /* function that is running */
+static int curcompiled;  /* whether it runs compiled code */
+static unsigned long long lastcount[NCOUNTERS];  /* when it started */
+
+static int countfd = -2;  /* group of events; -1 if we have none */
+static int countslot[NCOUNTERS];  /* of each event in the group, or -1 */
+static int ncountslots = 0;
+
+
+static int perfopen (int e, int group) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = countedevents[e].type;
+  attr.config = countedevents[e].config;
+  attr.read_format = PERF_FORMAT_GROUP;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return cast_int(syscall(SYS_perf_event_open, &attr, 0, -1, group, 0));
+}
+
+
+static void opencounters (void) {
+  int e;
+  countfd = perfopen(0, -1);  /* cycles lead the group */
+  if (countfd < 0) {
+    countedevents[0] = taskclock;
+    countfd = perfopen(0, -1);
+  }
+  if (countfd < 0) {
+    fprintf(stderr, "luaot counters: %s\n", strerror(errno));
+    countfd = -1;
+    return;
+  }
+  countslot[0] = ncountslots++;
+  for (e = 1; e < NCOUNTERS; e++)  /* not every CPU has every event */
+    countslot[e] = (perfopen(e, countfd) >= 0) ? ncountslots++ : -1;
+}
+
+
+static int readcounters (unsigned long long *now) {
+  unsigned long long buf[1 + NCOUNTERS];  /* number of events, values */
+  ssize_t size = (1 + ncountslots) * sizeof(buf[0]);
+  int e;
+  if (read(countfd, buf, sizeof(buf)) != size)
+    return 0;
+  for (e = 0; e < NCOUNTERS; e++)
+    now[e] = (countslot[e] >= 0) ? buf[1 + countslot[e]] : 0;
+  return 1;
+}
+
+
+/*
+** Charge what the counters moved since the last switch to the function
+** that was running, and start counting for 'c' (NULL for no function).
+*/
+static void countswitch (Counters *c, int compiled) {
+  unsigned long long now[NCOUNTERS];
+  int e;
+  if (c == curcounters && compiled == curcompiled)
+    return;  /* nothing changes */
+  if (countfd == -2)
+    opencounters();
+  if (countfd < 0 || !readcounters(now))
+    return;
+  if (curcounters != NULL) {
+    for (e = 0; e < NCOUNTERS; e++)
+      curcounters->count[curcompiled][e] += now[e] - lastcount[e];
+  }
+  curcounters = c;
+  curcompiled = compiled;
+  memcpy(lastcount, now, sizeof(now));
+}
+
+
+static Counters *getcounters (Proto *p) {
+  Counters *c = cast(Counters *, p->counters);
+  if (c == NULL) {
+    c = cast(Counters *, calloc(1, sizeof(Counters)));
+    if (c == NULL)
+      abort();  /* profiling is a debugging tool; keep it simple */
+    c->next = allcounters;
+    allcounters = c;
+    c->linedefined = p->linedefined;
+    if (p->source)
+      snprintf(c->source, sizeof(c->source), "%s", getstr(p->source));
+    p->counters = c;
+  }
+  return c;
+}
+
+
+void luaV_countproto (Proto *p, int compiled) {
+  countswitch(getcounters(p), compiled);
+}
+
+
+typedef struct CountRow {
+  Counters *c;
+  int compiled;
+} CountRow;
+
+
+static int cmpcountrows (const void *a, const void *b) {
+  const CountRow *ra = cast(const CountRow *, a);
+  const CountRow *rb = cast(const CountRow *, b);
+  unsigned long long ca = ra->c->count[ra->compiled][0];
+  unsigned long long cb = rb->c->count[rb->compiled][0];
+  return (ca < cb) - (ca > cb);  /* most cycles first */
+}
+
+
+static void printcount (FILE *f, int e, unsigned long long n) {
+  if (countslot[e] >= 0)
+    fprintf(f, " %14llu", n);
+  else
+    fprintf(f, " %14s", "-");
+}
+
+
+void luaV_countreport (void) {
+  const char *name = getenv("LUAOT_COUNTERS");
+  FILE *f = stderr;
+  CountRow *rows;
+  Counters *c;
+  unsigned long long total = 0;
+  int nrows = 0;
+  int i, e;
+  if (countfd < 0)
+    return;  /* no Lua function ran, or there are no counters */
+  countswitch(NULL, 0);  /* charge the function that is running */
+  for (c = allcounters; c != NULL; c = c->next)
+    nrows += 2;
+  rows = cast(CountRow *, malloc(nrows * sizeof(CountRow)));
+  if (rows == NULL)
+    return;
+  nrows = 0;
+  for (c = allcounters; c != NULL; c = c->next) {
+    for (i = 0; i < 2; i++) {
+      if (c->count[i][0] > 0) {
+        rows[nrows].c = c;
+        rows[nrows].compiled = i;
+        nrows++;
+        total += c->count[i][0];
+      }
+    }
+  }
+  qsort(rows, nrows, sizeof(CountRow), cmpcountrows);
+  if (name != NULL && (f = fopen(name, "w")) == NULL) {
+    perror("luaot counters");
+    f = stderr;
+  }
+  fprintf(f, "%7s", "%");
+  for (e = 0; e < NCOUNTERS; e++)
+    fprintf(f, " %14s", countedevents[e].name);
+  fprintf(f, " %5s  %-4s %s\n", "IPC", "mode", "function");
+  for (i = 0; i < nrows; i++) {
+    unsigned long long *n = rows[i].c->count[rows[i].compiled];
+    fprintf(f, "%6.2f%%", 100.0 * n[0] / total);
+    for (e = 0; e < NCOUNTERS; e++)
+      printcount(f, e, n[e]);
+    if (countedevents[0].type == PERF_TYPE_HARDWARE && countslot[1] >= 0)
+      fprintf(f, " %5.2f", (double)n[1] / n[0]);
+    else
+      fprintf(f, " %5s", "-");
+    fprintf(f, "  %-4s %s:%d\n", rows[i].compiled ? "aot" : "lua",
+               rows[i].c->source, rows[i].c->linedefined);
+  }
+  if (f != stderr)
+    fclose(f);
+  free(rows);
+  for (c = allcounters; c != NULL; c = c->next)  /* next report starts anew */
+    memset(c->count, 0, sizeof(c->count));
+}
+
+#endif
+
+#define countproto(p,compiled)	luaV_countproto(p, compiled)
+
+#else
+
+#define countproto(p,compiled)	((void)0)
+
+#endif
+
+/* }================================================================== */
+
 #define vmdispatch(o)	switch(o)
 #define vmcase(l)	case l:
 #define vmbreak		break
 
-static CallInfo *luaV_execute_(lua_State *L, CallInfo *ci)
+/*
+** When 'interp' is true, the first frame runs in the interpreter even if
+** it has a compiled implementation.
+*/
+static CallInfo *luaV_execute_(lua_State *L, CallInfo *ci, int interp)
 {
   LClosure *cl;
   TValue *k;
   StkId base;
   const Instruction *pc;
   int trap;
+#if defined(LUAOT_PROFILE)
+  Profile *prof;
+#endif
 #if LUA_USE_JUMPTABLE
 #include "ljumptab.h"
 #endif
@@ -1178,11 +1723,28 @@ static CallInfo *luaV_execute_(lua_State *L, CallInfo *ci)
   cl = clLvalue(s2v(ci->func));
 #if LUAOT
   if (cl->p->aot_implementation) {
-      return ci;
+      if (!interp)
+          return ci;
+      interp = 0;  /* only for this frame */
   }
 #endif
   k = cl->p->k;
   pc = ci->u.l.savedpc;
+#if LUAOT
+  /* tiered execution: is it time to look for a compiled version? */
+  if (pc == cl->p->code &&
+      l_unlikely(++cl->p->aot_counter >= LUAOT_TIER_THRESHOLD)) {
+    cl->p->aot_counter = 0;
+    if (!cl->p->aot_implementation && luaA_tierup(L, cl->p))
+      return ci;  /* let the trampoline run the compiled code */
+  }
+#endif
+#if defined(LUAOT_PROFILE)
+  prof = getprofile(cl->p);
+  if (pc == cl->p->code)
+    prof->calls++;
+#endif
+  countproto(cl->p, 0);
   if (l_unlikely(trap)) {
     if (pc == cl->p->code) {  /* first instruction (not resuming)? */
       if (cl->p->is_vararg)
@@ -1587,6 +2149,8 @@ static CallInfo *luaV_execute_(lua_State *L, CallInfo *ci)
         vmbreak;
       }
       vmcase(OP_JMP) {
+        if (GETARG_sJ(i) < 0)
+          tiercount();
         dojump(ci, i, 0);
         vmbreak;
       }
@@ -1651,6 +2215,7 @@ static CallInfo *luaV_execute_(lua_State *L, CallInfo *ci)
           pc++;
         else {
           setobj2s(L, ra, rb);
+          proftaken();
           donextjump(ci);
         }
         vmbreak;
@@ -1783,6 +2348,7 @@ static CallInfo *luaV_execute_(lua_State *L, CallInfo *ci)
         }
         else if (floatforloop(ra))  /* float loop */
           pc -= GETARG_Bx(i);  /* jump back */
+        tiercount();
         updatetrap(ci);  /* allows a signal to break the loop */
         vmbreak;
       }
@@ -1821,6 +2387,7 @@ static CallInfo *luaV_execute_(lua_State *L, CallInfo *ci)
         if (!ttisnil(s2v(ra + 4))) {  /* continue loop? */
           setobjs2s(L, ra + 2, ra + 4);  /* save control variable */
           pc -= GETARG_Bx(i);  /* jump back */
+          tiercount();
         }
         vmbreak;
       }
@@ -1877,14 +2444,32 @@ static CallInfo *luaV_execute_(lua_State *L, CallInfo *ci)
 
 #ifndef LUAOT_IS_MODULE
 void luaV_execute (lua_State *L, CallInfo *ci) {
+#if defined(LUAOT_COUNTERS)
+    Counters *caller = curcounters;  /* of the function that called us */
+    int callercompiled = curcompiled;
+#endif
     do {
         LClosure *cl = clLvalue(s2v(ci->func));
         if (cl->p->aot_implementation) {
+            countproto(cl->p, 1);
             ci = cl->p->aot_implementation(L, ci);
         } else {
-            ci = luaV_execute_(L, ci);
+            ci = luaV_execute_(L, ci, 0);
         }
     } while (ci);
+#if defined(LUAOT_COUNTERS)
+    countswitch(caller, callercompiled);
+#endif
+}
+
+/*
+** Compiled functions only have entry points for the places where they can
+** be resumed in the common case (after calls). In the rare case that they
+** are resumed somewhere else (e.g., after a metamethod yields), they use
+** this to continue in the interpreter, until the next call or return.
+*/
+CallInfo *luaV_interpret (lua_State *L, CallInfo *ci) {
+    return luaV_execute_(L, ci, 1);
 }
 #endif
 
@@ -126,6 +126,14 @@ LUAI_FUNC void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
                                TValue *val, const TValue *slot);
 LUAI_FUNC void luaV_finishOp (lua_State *L);
 LUAI_FUNC void luaV_execute (lua_State *L, CallInfo *ci);
+LUAI_FUNC CallInfo *luaV_interpret (lua_State *L, CallInfo *ci);
+LUAI_FUNC unsigned int luaV_codehash (const Proto *p);
+LUAI_FUNC size_t luaV_codesig (const Proto *p, lu_byte *buff, size_t size);
+LUAI_FUNC int luaV_profoperands (Instruction i, int *regs);
+#if defined(LUAOT_COUNTERS)
+LUAI_FUNC void luaV_countproto (Proto *p, int compiled);
+LUAI_FUNC void luaV_countreport (void);
+#endif
 LUAI_FUNC void luaV_concat (lua_State *L, int total);
 LUAI_FUNC lua_Integer luaV_idiv (lua_State *L, lua_Integer x, lua_Integer y);
 LUAI_FUNC lua_Integer luaV_mod (lua_State *L, lua_Integer x, lua_Integer y);
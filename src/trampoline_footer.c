@@ -1,20 +1,39 @@
 #include "lauxlib.h"
 #include "lualib.h"
 
-static int next_id = 0;
+//
+// This file is included once for each module in the generated code, after
+// defining LUAOT_MODULE_NAME, LUAOT_LUAOPEN_NAME, LUAOT_FIRST_FUNCTION, and
+// either LUAOT_MODULE_SOURCE_CODE or LUAOT_MODULE_BYTECODE.
+//
 
+#if !defined(LUAOT_FOOTER_ONCE)
+#define LUAOT_FOOTER_ONCE 1
+#if !defined(LUAOT_USE_PROTO_DATA)
 static
-void bind_magic(Proto *f)
+void bind_magic(Proto *f, int *next_id)
 {
     // This traversal order should be the same one that luaot.c uses
-    f->aot_implementation = LUAOT_FUNCTIONS[next_id++];
+    f->aot_implementation = LUAOT_FUNCTIONS[(*next_id)++];
     for(int i=0; i < f->sizep; i++) {
-        bind_magic(f->p[i]);
+        bind_magic(f->p[i], next_id);
     }
 }
+#endif
+#endif
 
+#if defined(LUAOT_LUAOPEN_STATIC)
+static
+#endif
 int LUAOT_LUAOPEN_NAME(lua_State *L) {
+#if defined(LUAOT_USE_PROTO_DATA)
+    luaot_pushmain(L, LUAOT_PROTOS, LUAOT_FIRST_FUNCTION);
+#else
+#if defined(LUAOT_USE_BYTECODE)
+    int ok = luaL_loadbufferx(L, (const char *) LUAOT_MODULE_BYTECODE, sizeof(LUAOT_MODULE_BYTECODE), "AOT Compiled module \""LUAOT_MODULE_NAME"\"", "b");
+#else
     int ok = luaL_loadbuffer(L, LUAOT_MODULE_SOURCE_CODE, sizeof(LUAOT_MODULE_SOURCE_CODE)-1, "AOT Compiled module \""LUAOT_MODULE_NAME"\"");
+#endif
     switch (ok) {
       case LUA_OK:
         /* No errors */
@@ -33,8 +52,17 @@ int LUAOT_LUAOPEN_NAME(lua_State *L) {
     }
 
     LClosure *cl = (void *) lua_topointer(L, -1);
-    bind_magic(cl->p);
+    int next_id = LUAOT_FIRST_FUNCTION;
+    bind_magic(cl->p, &next_id);
+#endif
 
     lua_call(L, 0, 1);
     return 1;
 }
+
+#undef LUAOT_MODULE_NAME
+#undef LUAOT_LUAOPEN_NAME
+#undef LUAOT_LUAOPEN_STATIC
+#undef LUAOT_FIRST_FUNCTION
+#undef LUAOT_MODULE_SOURCE_CODE
+#undef LUAOT_MODULE_BYTECODE
@@ -4,21 +4,205 @@
 
 #include "lvm.c"
 
+//
+// Direct calls between functions of the same module nest on the C stack, so
+// we only make them while there is plenty of room left for other C calls.
+// Deeper calls go through the luaV_execute trampoline, as usual.
+//
+
+#define LUAOT_MAX_DIRECT_CALLS (LUAI_MAXCCALLS / 2)
+
+//
+// With LUAOT_COUNTERS (see lvm.c), the direct calls between the functions of
+// the same module must tell the hardware counters which function is running,
+// because they do not go through the trampoline.
+//
+
+#if defined(LUAOT_COUNTERS)
+#define luaot_countcall(ci)	luaV_countproto(clLvalue(s2v((ci)->func))->p, 1)
+#else
+#define luaot_countcall(ci)	((void)0)
+#endif
+
+//
+// Inline caches for the field accesses with a constant string key. Each site
+// remembers where it found the key in the node array of the last table that
+// it saw. If the key is still there, we can skip the hashing. There is no need
+// to remember the table, because we check the key itself.
+//
+
+static inline
+const TValue *luaot_getshortstr(Table *t, TString *key, unsigned int *cache)
+{
+  unsigned int idx = *cache;
+  const TValue *slot;
+  if (l_likely(idx < cast_uint(sizenode(t)))) {
+    Node *n = gnode(t, idx);
+    if (keyisshrstr(n) && keystrval(n) == key)
+      return gval(n);
+  }
+  slot = luaH_getshortstr(t, key);
+  if (!isabstkey(slot))
+    *cache = cast_uint(nodefromval(slot) - gnode(t, 0));
+  return slot;
+}
+
+#define luaot_fastgetcached(L,t,k,slot,cache) \
+  (!ttistable(t) \
+   ? (slot = NULL, 0)  /* not a table; 'slot' is NULL and result is 0 */ \
+   : (slot = luaot_getshortstr(hvalue(t), k, cache), !isempty(slot)))
+
+//
+// Generic for loops over 'pairs' and 'ipairs' step through the table here,
+// without calling the iterator, if it is the one from the base library and
+// the state is a table. Returns 0 if the iterator must be called as usual.
+// Otherwise, it leaves the same results as 'luaB_next' or 'luaB_ipairsaux'
+// in 'ra + 4' and after.
+//
+
+// Not in lualib.h, because they are internal to the base library
+LUAI_FUNC int luaB_next (lua_State *L);
+LUAI_FUNC int luaB_ipairsaux (lua_State *L);
+
+// Whether 'luaH_next' accepts 'key'. If it does not, we let 'next' raise the
+// error, because 'luaH_next' would add the position of the compiled code to
+// the message. Dead keys are also left to 'next'.
+static inline
+int luaot_nextkeyok(Table *h, const TValue *key)
+{
+  lua_Integer k;
+  if (ttisnil(key))
+    return 1;
+  if (ttisinteger(key) && l_castS2U(ivalue(key)) - 1u < h->alimit)
+    return 1;  /* in the array part */
+  if (ttisfloat(key) && luaV_flttointeger(fltvalue(key), &k, F2Ieq))
+    return 0;  /* 'luaH_get' would find it, but 'luaH_next' does not */
+  return !isabstkey(luaH_get(h, key));
+}
+
+static inline
+int luaot_tforcall(lua_State *L, StkId ra, int nresults)
+{
+  Table *h;
+  int n;  /* number of results that were set */
+  if (!ttislcf(s2v(ra)) || !ttistable(s2v(ra + 1)))
+    return 0;
+  h = hvalue(s2v(ra + 1));
+  if (fvalue(s2v(ra)) == luaB_next) {
+    if (!luaot_nextkeyok(h, s2v(ra + 2)))
+      return 0;
+    setobjs2s(L, ra + 4, ra + 2);
+    if (luaH_next(L, h, ra + 4))
+      n = 2;
+    else {
+      setnilvalue(s2v(ra + 4));
+      n = 1;
+    }
+  }
+  else if (fvalue(s2v(ra)) == luaB_ipairsaux && ttisinteger(s2v(ra + 2))) {
+    lua_Integer idx = intop(+, ivalue(s2v(ra + 2)), 1);
+    const TValue *slot = luaH_getint(h, idx);
+    if (!isempty(slot)) {
+      setivalue(s2v(ra + 4), idx);
+      setobj2s(L, ra + 5, slot);
+      n = 2;
+    }
+    else if (h->metatable == NULL) {
+      setnilvalue(s2v(ra + 4));
+      n = 1;
+    }
+    else
+      return 0;  /* there might be an __index metamethod */
+  }
+  else
+    return 0;
+  for (; n < nresults; n++)
+    setnilvalue(s2v(ra + 4 + n));
+  return 1;
+}
+
 //
 // Our modified version of vmfetch(). Since instr and index are compile time
 // constants, the C compiler should be able to optimize the code in many cases.
 //
 
+//
+// The compiled functions keep the UpVal objects that they use in C variables
+// (see print_upvalue_pointers). Lua code can replace them with
+// debug.upvaluejoin, so we load them again whenever the interpreter would
+// update 'trap', which it does after everything that can run Lua code.
+//
+
+#undef  updatetrap
+#define updatetrap(ci)  (trap = ci->u.l.trap, luaot_loadupvals())
+
 #undef  vmfetch
 #define aot_vmfetch(instr)	{ \
   if (l_unlikely(trap)) {  /* stack reallocation or hooks? */ \
     trap = luaG_traceexec(L, pc);  /* handle hooks */ \
     updatebase(ci);  /* correct stack */ \
+    luaot_loadupvals();  /* the hook may have joined upvalues */ \
   } \
   i = instr; pc++; \
   ra = RA(i); /* WARNING: any stack reallocation invalidates 'ra' */ \
 }
 
+//
+// With luaot -n, the compiled functions do not support debug hooks. If hooks
+// are on when a function is entered, it runs in the interpreter instead.
+// Without hooks, 'trap' would only tell us that the stack was reallocated, so
+// we update the base after every operation that could do that, instead of
+// checking 'trap' before every instruction.
+//
+
+#if defined(LUAOT_NO_HOOKS)
+#undef  aot_vmfetch
+#define aot_vmfetch(instr)	{ i = instr; pc++; ra = RA(i); }
+
+#undef  updatetrap
+#define updatetrap(ci)  (updatebase(ci), luaot_loadupvals())
+
+#undef  updatestack
+#define updatestack(ci)  { updatebase(ci); ra = RA(i); }
+
+#undef  dojump
+#define dojump(ci,i,e)	{ pc += GETARG_sJ(i) + e; }
+#endif
+
+#undef  docondjump
+#define docondjump()	if (LUAOT_SKIP_HINT(cond != GETARG_k(i))) pc++; else donextjump(ci);
+
+//
+// Jumps between the instructions of a function. Each function has a switch
+// over the pc, in a loop, so a jump sets the pc and goes back to the switch.
+// With GCC and compatible compilers, each function also has a static table
+// with the address of the label of each instruction, and a jump goes straight
+// to its target through it, without the range check of the switch. Define
+// LUAOT_USE_SWITCH to always use the switch.
+//
+
+#if defined(__GNUC__) && !defined(LUAOT_USE_SWITCH)
+#define LUAOT_USE_LABELS
+#define luaot_label(n)	label_##n:
+#define luaot_dispatch()	goto *luaot_labels[pc - code]
+#else
+#define luaot_label(n)
+#define luaot_dispatch()	break
+#endif
+
+//
+// Hints from the profiles (luaot -P). The code generator redefines
+// LUAOT_SKIP_HINT before each test, as l_likely or l_unlikely.
+//
+
+#define LUAOT_SKIP_HINT
+
+#if defined(__GNUC__)
+#define LUAOT_COLD  __attribute__((cold))
+#else
+#define LUAOT_COLD
+#endif
+
 #undef  vmdispatch
 #undef  vmcase
 #undef  vmbreak